@@ -0,0 +1,989 @@
+// allocator_core.h - what malloc_1.cpp, malloc_2.cpp and malloc_3.cpp are built from. each file is one
+// AllocatorCore of four policies, picked at compile time:
+//   page source    where the pages come from: SbrkPageSource, MMapPageSource or FilePageSource
+//   small objects  NoSmallObjects, or SlabSmallObjects for requests up to SLAB_MAX_SIZE
+//   mid engine     the file's own: malloc_1's bump arenas, malloc_2's fit policies, malloc_3's buddy
+//   large objects  NoLargeObjects, or MMapLargeObjects (malloc_3 brings its own cached mmap layer)
+// the core routes every call to the layer that owns the size or the pointer and sums the layers' stats, the
+// layers never call each other. a layer only needs the members the file's configuration ends up calling
+#ifndef ALLOCATOR_CORE_H
+#define ALLOCATOR_CORE_H
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#define SBRK_FAILED (void *) (-1)
+#define CORE_MAX_SIZE 100000000
+// page sources, choose with -DHEAP_BACKEND (malloc_2) or -DBUDDY_CHUNK_BACKEND (malloc_3)
+#define CHUNK_BACKEND_MMAP 0 // anonymous mappings
+#define CHUNK_BACKEND_SBRK 1 // the program break
+#define CHUNK_BACKEND_FILE 2 // shared mappings of one memfd, freed chunks are punched out of it
+#define PAGE_SOURCE_RESERVE_SIZE (size_t(1) << 36) // the break range, only pages that are touched cost memory
+// small object layers, choose with -DSMALL_OBJECT_LAYER=SMALL_OBJECT_SLAB
+#define SMALL_OBJECT_NONE 0
+#define SMALL_OBJECT_SLAB 1 // requests up to SLAB_MAX_SIZE come from size class slabs
+// large object layers, choose with -DLARGE_OBJECT_LAYER=LARGE_OBJECT_UNCACHED etc.
+#define LARGE_OBJECT_CACHED 0   // freed regions are kept for reuse
+#define LARGE_OBJECT_UNCACHED 1 // every region is unmapped when it is freed
+#define LARGE_OBJECT_NONE 2     // the mid engine takes every size
+#define SLAB_MAX_SIZE 256
+#define SLAB_GRANULE 16 // the class sizes, and the alignment of every small object
+#define SLAB_NUM_OF_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_ARENA_SIZE (64 << 20) // reserved on the first small allocation, slabs are carved from it in order
+#define SLAB_NUM_OF_SLABS (SLAB_ARENA_SIZE / SLAB_SIZE)
+#define LARGE_OBJECT_HEADER_SIZE 16
+#define LARGE_OBJECT_CACHE_SLOTS 8 // freed regions MMapLargeObjects<true> keeps, reused for the same page count
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ STATS ~~~~~~~~~~~~~~~~~~~
+// what every layer adds to, in the terms of the _num_* functions
+struct CoreStats
+{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+};
+
+// the four counters of a layer that serializes its own updates (a single thread, or a lock it holds)
+class BlockCounters
+{
+private:
+    size_t num_of_allocated_blocks;
+    size_t num_of_bytes_in_allocated_blocks;
+    size_t num_of_allocated_blocks_that_are_free;
+    size_t num_of_bytes_in_allocated_blocks_that_are_free;
+public:
+    constexpr BlockCounters(): num_of_allocated_blocks(0), num_of_bytes_in_allocated_blocks(0),
+                               num_of_allocated_blocks_that_are_free(0),
+                               num_of_bytes_in_allocated_blocks_that_are_free(0) {}
+    size_t getNumOfAllocatedBlocks() const
+    {
+        return this->num_of_allocated_blocks;
+    }
+    void incNumOfAllocatedBlocksBy(size_t num_of_blocks)
+    {
+        this->num_of_allocated_blocks += num_of_blocks;
+    }
+    void decNumOfAllocatedBlocksBy(size_t num_of_blocks)
+    {
+        this->num_of_allocated_blocks -= num_of_blocks;
+    }
+    size_t getNumOfBytesInAllocatedBlocks() const
+    {
+        return this->num_of_bytes_in_allocated_blocks;
+    }
+    void incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes)
+    {
+        this->num_of_bytes_in_allocated_blocks += num_of_bytes;
+    }
+    void decNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes)
+    {
+        this->num_of_bytes_in_allocated_blocks -= num_of_bytes;
+    }
+    size_t getNumOfAllocatedBlocksThatAreFree() const
+    {
+        return this->num_of_allocated_blocks_that_are_free;
+    }
+    void incNumOfAllocatedBlocksThatAreFreeBy(size_t num_of_blocks)
+    {
+        this->num_of_allocated_blocks_that_are_free += num_of_blocks;
+    }
+    void decNumOfAllocatedBlocksThatAreFreeBy(size_t num_of_blocks)
+    {
+        this->num_of_allocated_blocks_that_are_free -= num_of_blocks;
+    }
+    size_t getNumOfBytesInAllocatedBlocksThatAreFree() const
+    {
+        return this->num_of_bytes_in_allocated_blocks_that_are_free;
+    }
+    void incNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes)
+    {
+        this->num_of_bytes_in_allocated_blocks_that_are_free += num_of_bytes;
+    }
+    void decNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes)
+    {
+        this->num_of_bytes_in_allocated_blocks_that_are_free -= num_of_bytes;
+    }
+    // meta_data_size is the header every block carries
+    void addStats(CoreStats* stats, size_t meta_data_size) const
+    {
+        stats->free_blocks += this->num_of_allocated_blocks_that_are_free;
+        stats->free_bytes += this->num_of_bytes_in_allocated_blocks_that_are_free;
+        stats->allocated_blocks += this->num_of_allocated_blocks;
+        stats->allocated_bytes += this->num_of_bytes_in_allocated_blocks;
+        stats->meta_data_bytes += this->num_of_allocated_blocks * meta_data_size;
+    }
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ PAGE SOURCES ~~~~~~~~~~~~~~~~~~~
+// every page source hands out pages in two ways, and takes chunks back:
+//   moveBreak(delta)                    like sbrk, on one contiguous range that only grows, so the block at its
+//                                       top can always grow in place. returns the old break, or SBRK_FAILED
+//   mapChunk(size, alignment, populate) a chunk of its own, aligned to alignment (a power of two). populate
+//                                       faults it in as it is mapped. NULL on failure
+//   unmapChunk(chunk, size)             gives a chunk back, false if the source can't
+//   releasePages(start, size)           gives the memory of pages that stay mapped back, they read as zeros
+//                                       after
+// they serialize themselves, except for moveBreak, whose callers already do
+
+static inline size_t getPageSize()
+{
+    static const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+// maps size + alignment and unmaps what sticks out on both sides of the aligned range. the range is left
+// reserved, ready to be mapped over with MAP_FIXED
+static inline char* reserveAlignedRange(size_t size, size_t alignment)
+{
+    size_t length = size + alignment;
+    void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    auto start = reinterpret_cast<uintptr_t>(mapped);
+    uintptr_t aligned = (start + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (aligned > start)
+    {
+        munmap(mapped, aligned - start);
+    }
+    size_t tail = start + length - (aligned + size);
+    if (tail > 0)
+    {
+        munmap(reinterpret_cast<void*>(aligned + size), tail);
+    }
+    return reinterpret_cast<char*>(aligned);
+}
+
+class SbrkPageSource
+{
+private:
+    std::mutex lock; // for mapChunk, the break is the whole process's
+public:
+    constexpr SbrkPageSource(): lock() {}
+    void* moveBreak(long delta)
+    {
+        return sbrk(delta);
+    }
+    // pads the break up to the alignment first, the padding is lost. there is nothing to populate with
+    void* mapChunk(size_t size, size_t alignment, bool populate)
+    {
+        (void) populate;
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto current_address = reinterpret_cast<uintptr_t>(sbrk(0));
+        size_t padding = (alignment - (current_address % alignment)) % alignment;
+        void* old_break = sbrk(long(padding + size));
+        if (old_break == SBRK_FAILED)
+        {
+            return nullptr;
+        }
+        return static_cast<char*>(old_break) + padding;
+    }
+    bool unmapChunk(void* chunk, size_t size)
+    {
+        (void) chunk;
+        (void) size;
+        return false;
+    }
+    void releasePages(void* start, size_t size)
+    {
+        madvise(start, size, MADV_DONTNEED);
+    }
+};
+
+// the break is our own, in a range reserved on the first call. unlike the program break no one else moves it
+class MMapPageSource
+{
+private:
+    char* heap_start;
+    char* heap_break;
+public:
+    constexpr MMapPageSource(): heap_start(nullptr), heap_break(nullptr) {}
+    void* moveBreak(long delta)
+    {
+        if (this->heap_start == nullptr)
+        {
+            void* reserved = mmap(nullptr, PAGE_SOURCE_RESERVE_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (reserved == MAP_FAILED)
+            {
+                return SBRK_FAILED;
+            }
+            this->heap_start = static_cast<char*>(reserved);
+            this->heap_break = this->heap_start;
+        }
+        if (delta > 0 && size_t(delta) > PAGE_SOURCE_RESERVE_SIZE - size_t(this->heap_break - this->heap_start))
+        {
+            return SBRK_FAILED;
+        }
+        char* old_break = this->heap_break;
+        this->heap_break += delta;
+        return old_break;
+    }
+    // populate maps the chunk again in place with MAP_POPULATE, which faults it in with the mapping instead
+    // of page by page
+    void* mapChunk(size_t size, size_t alignment, bool populate)
+    {
+        if (alignment <= getPageSize())
+        {
+            void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0), -1, 0);
+            return (mapped == MAP_FAILED) ? nullptr : mapped;
+        }
+        char* chunk = reserveAlignedRange(size, alignment);
+        if (chunk == nullptr)
+        {
+            return nullptr;
+        }
+        // the reservation is MAP_NORESERVE, the chunk is mapped again as ordinary memory
+        if (mmap(chunk, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                 (populate ? MAP_POPULATE : 0), -1, 0) == MAP_FAILED)
+        {
+            munmap(chunk, size);
+            return nullptr;
+        }
+        return chunk;
+    }
+    bool unmapChunk(void* chunk, size_t size)
+    {
+        return munmap(chunk, size) == 0;
+    }
+    void releasePages(void* start, size_t size)
+    {
+        madvise(start, size, MADV_DONTNEED);
+    }
+};
+
+// everything is a MAP_SHARED mapping of one memfd, made on first use: the break range is the file's first
+// PAGE_SOURCE_RESERVE_SIZE bytes, chunks get the offsets after it. the file only grows, a chunk that is given
+// back has its range punched out so its memory goes back while the offsets stay used. for benchmarking the
+// page cache path, and a step towards heaps in files of the caller's
+class FilePageSource
+{
+private:
+    std::mutex lock; // the file and the chunk offsets
+    int fd;
+    size_t file_size;
+    char* heap_start;
+    char* heap_break;
+
+    bool openFile()
+    {
+        if (this->fd >= 0)
+        {
+            return true;
+        }
+        int new_fd = memfd_create("smalloc", MFD_CLOEXEC);
+        if (new_fd < 0)
+        {
+            return false;
+        }
+        if (ftruncate(new_fd, off_t(PAGE_SOURCE_RESERVE_SIZE)) != 0)
+        {
+            close(new_fd);
+            return false;
+        }
+        this->fd = new_fd;
+        this->file_size = PAGE_SOURCE_RESERVE_SIZE;
+        return true;
+    }
+public:
+    constexpr FilePageSource(): lock(), fd(-1), file_size(0), heap_start(nullptr), heap_break(nullptr) {}
+    void* moveBreak(long delta)
+    {
+        if (this->heap_start == nullptr)
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (!this->openFile())
+            {
+                return SBRK_FAILED;
+            }
+            void* mapped = mmap(nullptr, PAGE_SOURCE_RESERVE_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_NORESERVE, this->fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                return SBRK_FAILED;
+            }
+            this->heap_start = static_cast<char*>(mapped);
+            this->heap_break = this->heap_start;
+        }
+        if (delta > 0 && size_t(delta) > PAGE_SOURCE_RESERVE_SIZE - size_t(this->heap_break - this->heap_start))
+        {
+            return SBRK_FAILED;
+        }
+        char* old_break = this->heap_break;
+        this->heap_break += delta;
+        return old_break;
+    }
+    void* mapChunk(size_t size, size_t alignment, bool populate)
+    {
+        size = (size + getPageSize() - 1) & ~(getPageSize() - 1);
+        alignment = std::max(alignment, getPageSize());
+        std::unique_lock<std::mutex> guard(this->lock);
+        if (!this->openFile() || ftruncate(this->fd, off_t(this->file_size + size)) != 0)
+        {
+            return nullptr;
+        }
+        size_t offset = this->file_size;
+        this->file_size += size;
+        guard.unlock();
+        char* chunk = reserveAlignedRange(size, alignment);
+        if (chunk == nullptr)
+        {
+            return nullptr;
+        }
+        if (mmap(chunk, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | (populate ? MAP_POPULATE : 0),
+                 this->fd, off_t(offset)) == MAP_FAILED)
+        {
+            munmap(chunk, size);
+            return nullptr;
+        }
+        return chunk;
+    }
+    // the chunk's offset is found through the mapping itself, the file keeps its size
+    bool unmapChunk(void* chunk, size_t size)
+    {
+        size = (size + getPageSize() - 1) & ~(getPageSize() - 1);
+        if (madvise(chunk, size, MADV_REMOVE) != 0)
+        {
+            return false;
+        }
+        return munmap(chunk, size) == 0;
+    }
+    // MADV_DONTNEED would only drop the mapping's view of the pages, the file would keep them
+    void releasePages(void* start, size_t size)
+    {
+        madvise(start, size, MADV_REMOVE);
+    }
+};
+
+template <int BACKEND>
+struct PageSourceOf;
+
+template <>
+struct PageSourceOf<CHUNK_BACKEND_MMAP>
+{
+    typedef MMapPageSource type;
+};
+
+template <>
+struct PageSourceOf<CHUNK_BACKEND_SBRK>
+{
+    typedef SbrkPageSource type;
+};
+
+template <>
+struct PageSourceOf<CHUNK_BACKEND_FILE>
+{
+    typedef FilePageSource type;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ SMALL OBJECTS ~~~~~~~~~~~~~~~~~~~
+// a small object layer serves the requests fits() takes, before the mid engine sees them:
+//   allocate(pages, size)   NULL when it is out of room, the core then falls through to the mid engine
+//   owns(p)                 whether p is one of its objects, from the address alone
+//   free(p), usableSize(p), addStats(stats), getFootprint()
+
+class NoSmallObjects
+{
+public:
+    constexpr NoSmallObjects() {}
+    static bool fits(size_t size)
+    {
+        (void) size;
+        return false;
+    }
+    template <class PageSource>
+    void* allocate(PageSource* pages, size_t size)
+    {
+        (void) pages;
+        (void) size;
+        return nullptr;
+    }
+    bool owns(const void* p) const
+    {
+        (void) p;
+        return false;
+    }
+    void free(void* p)
+    {
+        (void) p;
+    }
+    size_t usableSize(const void* p) const
+    {
+        (void) p;
+        return 0;
+    }
+    void addStats(CoreStats* stats) const
+    {
+        (void) stats;
+    }
+    size_t getFootprint() const
+    {
+        return 0;
+    }
+};
+
+// what the slab layer asks before it carves a new slab. admit is false if the heap may not grow by
+// num_of_bytes, the reservation is dropped with the object (see malloc_3's heap limits)
+class UnlimitedGrowth
+{
+public:
+    bool admit(size_t num_of_bytes)
+    {
+        (void) num_of_bytes;
+        return true;
+    }
+};
+
+// one class per SLAB_GRANULE of size. objects have no header: a class's slabs are SLAB_SIZE pieces of one
+// reserved range, so an object's class is found from its slab's index. a free object's first word links it
+// into its class's free list. slabs are never given back, a class reuses its own freed objects.
+// every object a slab was cut into counts as a block (a free one as a free block), with no metadata
+template <class PageSource, class Growth = UnlimitedGrowth>
+class SlabSmallObjects
+{
+private:
+    struct SlabClass
+    {
+        mutable std::mutex lock;
+        void* free_list;
+        char* bump;     // the rest of the class's newest slab
+        char* bump_end;
+        BlockCounters counters;
+
+        constexpr SlabClass(): lock(), free_list(nullptr), bump(nullptr), bump_end(nullptr), counters() {}
+    };
+    std::mutex reserve_lock;
+    std::atomic<char*> arena_start;
+    std::atomic<size_t> num_of_slabs;
+    uint8_t slab_classes[SLAB_NUM_OF_SLABS];
+    SlabClass classes[SLAB_NUM_OF_CLASSES];
+
+    static int getClassIndex(size_t size)
+    {
+        return int((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+    }
+    static size_t getClassSize(int class_index)
+    {
+        return size_t(class_index + 1) * SLAB_GRANULE;
+    }
+    char* reserveArena(PageSource* pages)
+    {
+        char* start = this->arena_start.load(std::memory_order_acquire);
+        if (start != nullptr)
+        {
+            return start;
+        }
+        std::lock_guard<std::mutex> guard(this->reserve_lock);
+        start = this->arena_start.load(std::memory_order_relaxed);
+        if (start == nullptr)
+        {
+            start = static_cast<char*>(pages->mapChunk(SLAB_ARENA_SIZE, SLAB_SIZE, false));
+            this->arena_start.store(start, std::memory_order_release);
+        }
+        return start;
+    }
+    // called with the class's lock, false once the arena is used up
+    bool newSlab(PageSource* pages, int class_index)
+    {
+        char* start = this->reserveArena(pages);
+        if (start == nullptr)
+        {
+            return false;
+        }
+        Growth growth;
+        if (!growth.admit(SLAB_SIZE))
+        {
+            return false;
+        }
+        size_t slab = this->num_of_slabs.load(std::memory_order_relaxed);
+        do
+        {
+            if (slab == SLAB_NUM_OF_SLABS)
+            {
+                return false;
+            }
+        } while (!this->num_of_slabs.compare_exchange_weak(slab, slab + 1, std::memory_order_relaxed));
+        this->slab_classes[slab] = uint8_t(class_index);
+        SlabClass* slab_class = &(this->classes[class_index]);
+        slab_class->bump = start + slab * SLAB_SIZE;
+        slab_class->bump_end = slab_class->bump + SLAB_SIZE;
+        return true;
+    }
+public:
+    constexpr SlabSmallObjects(): reserve_lock(), arena_start(nullptr), num_of_slabs(0), slab_classes{},
+                                  classes{} {}
+    static bool fits(size_t size)
+    {
+        return size <= SLAB_MAX_SIZE;
+    }
+    void* allocate(PageSource* pages, size_t size)
+    {
+        int class_index = getClassIndex(size);
+        size_t class_size = getClassSize(class_index);
+        SlabClass* slab_class = &(this->classes[class_index]);
+        std::lock_guard<std::mutex> guard(slab_class->lock);
+        void* object = slab_class->free_list;
+        if (object != nullptr)
+        {
+            slab_class->free_list = *static_cast<void**>(object);
+            slab_class->counters.decNumOfAllocatedBlocksThatAreFreeBy(1);
+            slab_class->counters.decNumOfBytesInAllocatedBlocksThatAreFreeBy(class_size);
+            return object;
+        }
+        // SLAB_SIZE isn't a multiple of every class size, what is left of a slab after the last object is lost
+        if (size_t(slab_class->bump_end - slab_class->bump) < class_size && !this->newSlab(pages, class_index))
+        {
+            return nullptr;
+        }
+        object = slab_class->bump;
+        slab_class->bump += class_size;
+        slab_class->counters.incNumOfAllocatedBlocksBy(1);
+        slab_class->counters.incNumOfBytesInAllocatedBlocksBy(class_size);
+        return object;
+    }
+    bool owns(const void* p) const
+    {
+        const char* start = this->arena_start.load(std::memory_order_acquire);
+        return start != nullptr && static_cast<const char*>(p) >= start &&
+               static_cast<const char*>(p) < start + SLAB_ARENA_SIZE;
+    }
+    void free(void* p)
+    {
+        size_t offset = static_cast<char*>(p) - this->arena_start.load(std::memory_order_relaxed);
+        int class_index = this->slab_classes[offset / SLAB_SIZE];
+        SlabClass* slab_class = &(this->classes[class_index]);
+        std::lock_guard<std::mutex> guard(slab_class->lock);
+        *static_cast<void**>(p) = slab_class->free_list;
+        slab_class->free_list = p;
+        slab_class->counters.incNumOfAllocatedBlocksThatAreFreeBy(1);
+        slab_class->counters.incNumOfBytesInAllocatedBlocksThatAreFreeBy(getClassSize(class_index));
+    }
+    size_t usableSize(const void* p) const
+    {
+        const char* start = this->arena_start.load(std::memory_order_relaxed);
+        return getClassSize(this->slab_classes[(static_cast<const char*>(p) - start) / SLAB_SIZE]);
+    }
+    void addStats(CoreStats* stats) const
+    {
+        for (int i = 0; i < SLAB_NUM_OF_CLASSES; i++)
+        {
+            std::lock_guard<std::mutex> guard(this->classes[i].lock);
+            this->classes[i].counters.addStats(stats, 0);
+        }
+    }
+    // the slabs carved so far, taken by no lock so an admission under a class lock can ask
+    size_t getFootprint() const
+    {
+        return this->num_of_slabs.load(std::memory_order_relaxed) * SLAB_SIZE;
+    }
+};
+
+template <int LAYER, class PageSource, class Growth = UnlimitedGrowth>
+struct SmallObjectsOf;
+
+template <class PageSource, class Growth>
+struct SmallObjectsOf<SMALL_OBJECT_NONE, PageSource, Growth>
+{
+    typedef NoSmallObjects type;
+};
+
+template <class PageSource, class Growth>
+struct SmallObjectsOf<SMALL_OBJECT_SLAB, PageSource, Growth>
+{
+    typedef SlabSmallObjects<PageSource, Growth> type;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ LARGE OBJECTS ~~~~~~~~~~~~~~~~~~~
+// a large object layer takes the requests above the mid engine's MAX_REQUEST, when ENABLED:
+//   allocate(size, tag), free(p), freeSized(p, size), reallocate(p, size), expand(p, min_size, preferred_size),
+//   addStats(stats)
+// the core asks the mid engine's owns(p) to tell the two apart, the large layer needs no owns of its own
+
+class NoLargeObjects
+{
+public:
+    static const bool ENABLED = false;
+    constexpr NoLargeObjects() {}
+    void* allocate(size_t size, int tag)
+    {
+        (void) size;
+        (void) tag;
+        return nullptr;
+    }
+    void free(void* p)
+    {
+        (void) p;
+    }
+    void freeSized(void* p, size_t size)
+    {
+        (void) p;
+        (void) size;
+    }
+    void* reallocate(void* p, size_t size)
+    {
+        (void) p;
+        (void) size;
+        return nullptr;
+    }
+    size_t expand(void* p, size_t min_size, size_t preferred_size)
+    {
+        (void) p;
+        (void) min_size;
+        (void) preferred_size;
+        return 0;
+    }
+    void addStats(CoreStats* stats) const
+    {
+        (void) stats;
+    }
+};
+
+// every object is a mapping of its own with a LARGE_OBJECT_HEADER_SIZE header. CACHED keeps up to
+// LARGE_OBJECT_CACHE_SLOTS freed mappings and hands one out again for a request of the same page count
+template <bool CACHED>
+class MMapLargeObjects
+{
+private:
+    struct Header
+    {
+        size_t mapped_size;
+        size_t user_size;
+    };
+    mutable std::mutex lock;
+    BlockCounters counters;
+    Header* cache[LARGE_OBJECT_CACHE_SLOTS];
+
+    static Header* getHeader(void* p)
+    {
+        return reinterpret_cast<Header*>(static_cast<char*>(p) - LARGE_OBJECT_HEADER_SIZE);
+    }
+    static size_t getMappedSize(size_t size)
+    {
+        return (size + LARGE_OBJECT_HEADER_SIZE + getPageSize() - 1) & ~(getPageSize() - 1);
+    }
+    Header* takeCached(size_t mapped_size)
+    {
+        for (int i = 0; CACHED && i < LARGE_OBJECT_CACHE_SLOTS; i++)
+        {
+            Header* header = this->cache[i];
+            if (header != nullptr && header->mapped_size == mapped_size)
+            {
+                this->cache[i] = nullptr;
+                return header;
+            }
+        }
+        return nullptr;
+    }
+    bool putCached(Header* header)
+    {
+        for (int i = 0; CACHED && i < LARGE_OBJECT_CACHE_SLOTS; i++)
+        {
+            if (this->cache[i] == nullptr)
+            {
+                this->cache[i] = header;
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    static const bool ENABLED = true;
+    constexpr MMapLargeObjects(): lock(), counters(), cache{} {}
+    void* allocate(size_t size, int tag)
+    {
+        (void) tag;
+        size_t mapped_size = getMappedSize(size);
+        std::unique_lock<std::mutex> guard(this->lock);
+        Header* header = this->takeCached(mapped_size);
+        guard.unlock();
+        if (header == nullptr)
+        {
+            void* mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapped == MAP_FAILED)
+            {
+                return nullptr;
+            }
+            header = static_cast<Header*>(mapped);
+            header->mapped_size = mapped_size;
+        }
+        header->user_size = size;
+        guard.lock();
+        this->counters.incNumOfAllocatedBlocksBy(1);
+        this->counters.incNumOfBytesInAllocatedBlocksBy(size);
+        return reinterpret_cast<char*>(header) + LARGE_OBJECT_HEADER_SIZE;
+    }
+    void free(void* p)
+    {
+        Header* header = getHeader(p);
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->counters.decNumOfAllocatedBlocksBy(1);
+        this->counters.decNumOfBytesInAllocatedBlocksBy(header->user_size);
+        if (this->putCached(header))
+        {
+            return;
+        }
+        guard.unlock();
+        munmap(header, header->mapped_size);
+    }
+    void freeSized(void* p, size_t size)
+    {
+        (void) size;
+        this->free(p);
+    }
+    // a mapping that already has the pages is kept, otherwise mremap moves it if it has to
+    void* reallocate(void* p, size_t size)
+    {
+        Header* header = getHeader(p);
+        size_t mapped_size = getMappedSize(size);
+        size_t old_size = header->user_size;
+        if (mapped_size != header->mapped_size)
+        {
+            void* moved = mremap(header, header->mapped_size, mapped_size, MREMAP_MAYMOVE);
+            if (moved == MAP_FAILED)
+            {
+                return nullptr;
+            }
+            header = static_cast<Header*>(moved);
+            header->mapped_size = mapped_size;
+        }
+        header->user_size = size;
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->counters.decNumOfBytesInAllocatedBlocksBy(old_size);
+        this->counters.incNumOfBytesInAllocatedBlocksBy(size);
+        return reinterpret_cast<char*>(header) + LARGE_OBJECT_HEADER_SIZE;
+    }
+    void addStats(CoreStats* stats) const
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->counters.addStats(stats, LARGE_OBJECT_HEADER_SIZE);
+    }
+};
+
+template <int LAYER>
+struct LargeObjectsOf;
+
+template <>
+struct LargeObjectsOf<LARGE_OBJECT_CACHED>
+{
+    typedef MMapLargeObjects<true> type;
+};
+
+template <>
+struct LargeObjectsOf<LARGE_OBJECT_UNCACHED>
+{
+    typedef MMapLargeObjects<false> type;
+};
+
+template <>
+struct LargeObjectsOf<LARGE_OBJECT_NONE>
+{
+    typedef NoLargeObjects type;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ THE CORE ~~~~~~~~~~~~~~~~~~~
+// the mid engine is the file's. it takes every request up to its MAX_REQUEST (all of them without a large
+// layer) and has the same members as a large layer, plus owns(p), which may check p's header first.
+// requests are validated here, p is never NULL past the core. allocate's tag is malloc_3's. a small object
+// has none, so tagged requests skip the small layer and keep their tag's stats right
+
+template <class PageSource, class SmallObjects, class MidEngine, class LargeObjects>
+class AllocatorCore
+{
+private:
+    PageSource pages;
+    SmallObjects small_objects;
+    MidEngine mid_engine;
+    LargeObjects large_objects;
+
+    bool isLarge(void* p)
+    {
+        return LargeObjects::ENABLED && !this->mid_engine.owns(p);
+    }
+public:
+    constexpr AllocatorCore(): pages(), small_objects(), mid_engine(), large_objects() {}
+    PageSource* getPageSource()
+    {
+        return &(this->pages);
+    }
+    SmallObjects* getSmallObjects()
+    {
+        return &(this->small_objects);
+    }
+    MidEngine* getMidEngine()
+    {
+        return &(this->mid_engine);
+    }
+    LargeObjects* getLargeObjects()
+    {
+        return &(this->large_objects);
+    }
+
+    void* allocate(size_t size, int tag)
+    {
+        if (size == 0 || size > CORE_MAX_SIZE)
+        {
+            return nullptr;
+        }
+        if (tag == 0 && SmallObjects::fits(size))
+        {
+            void* object = this->small_objects.allocate(&(this->pages), size);
+            if (object != nullptr)
+            {
+                return object;
+            }
+        }
+        if (LargeObjects::ENABLED && size > MidEngine::MAX_REQUEST)
+        {
+            return this->large_objects.allocate(size, tag);
+        }
+        return this->mid_engine.allocate(size, tag);
+    }
+
+    void free(void* p)
+    {
+        if (p == nullptr)
+        {
+            return;
+        }
+        if (this->small_objects.owns(p))
+        {
+            this->small_objects.free(p);
+        }
+        else if (this->isLarge(p))
+        {
+            this->large_objects.free(p);
+        }
+        else
+        {
+            this->mid_engine.free(p);
+        }
+    }
+
+    // size is what p was allocated with, so the layer is known without reading p's header
+    void freeSized(void* p, size_t size)
+    {
+        if (p == nullptr)
+        {
+            return;
+        }
+        if (this->small_objects.owns(p))
+        {
+            this->small_objects.free(p);
+        }
+        else if (LargeObjects::ENABLED && size > MidEngine::MAX_REQUEST)
+        {
+            this->large_objects.freeSized(p, size);
+        }
+        else
+        {
+            this->mid_engine.freeSized(p, size);
+        }
+    }
+
+    // a small object stays if it is big enough, otherwise it moves with tag. the layers move their own
+    // blocks through the file's public entry points, which come back here
+    void* reallocate(void* p, size_t size, int tag)
+    {
+        if (p == nullptr)
+        {
+            return this->allocate(size, tag);
+        }
+        if (size == 0 || size > CORE_MAX_SIZE)
+        {
+            return nullptr;
+        }
+        if (this->small_objects.owns(p))
+        {
+            size_t usable_size = this->small_objects.usableSize(p);
+            if (size <= usable_size)
+            {
+                return p;
+            }
+            void* new_p = this->allocate(size, tag);
+            if (new_p == nullptr)
+            {
+                return nullptr;
+            }
+            std::memcpy(new_p, p, usable_size);
+            this->small_objects.free(p);
+            return new_p;
+        }
+        if (this->isLarge(p))
+        {
+            return this->large_objects.reallocate(p, size);
+        }
+        return this->mid_engine.reallocate(p, size);
+    }
+
+    // grows p in place to preferred_size, or at least min_size. returns p's usable size, 0 if it couldn't
+    size_t expand(void* p, size_t min_size, size_t preferred_size)
+    {
+        if (p == nullptr || min_size == 0 || min_size > CORE_MAX_SIZE)
+        {
+            return 0;
+        }
+        preferred_size = std::min(std::max(preferred_size, min_size), size_t(CORE_MAX_SIZE));
+        if (this->small_objects.owns(p))
+        {
+            size_t usable_size = this->small_objects.usableSize(p);
+            return (usable_size >= min_size) ? usable_size : 0;
+        }
+        if (this->isLarge(p))
+        {
+            return this->large_objects.expand(p, min_size, preferred_size);
+        }
+        return this->mid_engine.expand(p, min_size, preferred_size);
+    }
+
+    void fillStats(CoreStats* stats) const
+    {
+        *stats = CoreStats();
+        this->small_objects.addStats(stats);
+        this->mid_engine.addStats(stats);
+        this->large_objects.addStats(stats);
+    }
+
+    // ~~~~~~~~~~~~~ the _num_* functions ~~~~~~~~~~~~~~
+    size_t getNumOfFreeBlocks() const
+    {
+        CoreStats stats;
+        this->fillStats(&stats);
+        return stats.free_blocks;
+    }
+    size_t getNumOfFreeBytes() const
+    {
+        CoreStats stats;
+        this->fillStats(&stats);
+        return stats.free_bytes;
+    }
+    size_t getNumOfAllocatedBlocks() const
+    {
+        CoreStats stats;
+        this->fillStats(&stats);
+        return stats.allocated_blocks;
+    }
+    size_t getNumOfAllocatedBytes() const
+    {
+        CoreStats stats;
+        this->fillStats(&stats);
+        return stats.allocated_bytes;
+    }
+    size_t getNumOfMetaDataBytes() const
+    {
+        CoreStats stats;
+        this->fillStats(&stats);
+        return stats.meta_data_bytes;
+    }
+};
+
+#endif
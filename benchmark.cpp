@@ -0,0 +1,496 @@
+// benchmark.cpp - microbenchmarks for the allocators in this repo.
+//
+// the three malloc_*.cpp files all define smalloc, so every variant is linked into its own binary. the
+// Makefile builds every configuration below as lib<configuration>.a and bench_<configuration>, by hand:
+//   g++ -O2 -std=c++17 benchmark.cpp malloc_1.cpp -DBENCH_ALLOCATOR='"malloc_1"' -o bench_malloc_1
+//   g++ -O2 -std=c++17 benchmark.cpp malloc_2.cpp -DBENCH_ALLOCATOR='"malloc_2"' -o bench_malloc_2
+//   g++ -O2 -std=c++17 benchmark.cpp malloc_3.cpp -DBENCH_ALLOCATOR='"malloc_3"' -o bench_malloc_3
+//   g++ -O2 -std=c++17 benchmark.cpp -DBENCH_SYSTEM_MALLOC -o bench_glibc
+// each allocator instantiates the core of allocator_core.h with a page source, a small object layer, a mid
+// size engine and a large object layer, and the parts that have alternatives take them at compile time. a
+// configuration is a set of these flags (with its own BENCH_ALLOCATOR name, e.g.
+// -DBENCH_ALLOCATOR='"malloc_2_best_fit_mmap"'):
+//               page source                   small objects          mid size engine           large objects
+//   malloc_1    -DHEAP_BACKEND=               none                   per thread bump,          none, the bump
+//                 CHUNK_BACKEND_MMAP (default)                         no frees                  maps its own
+//                 CHUNK_BACKEND_FILE                                                             chunk
+//   malloc_2    -DHEAP_BACKEND=               -DSMALL_OBJECT_LAYER=  -DFIT_POLICY=             -DLARGE_OBJECT_LAYER=
+//                 CHUNK_BACKEND_SBRK (default)  SMALL_OBJECT_NONE      SEGREGATED_FIT (default)  LARGE_OBJECT_NONE
+//                 CHUNK_BACKEND_MMAP            (default)              FIRST_FIT, NEXT_FIT       (default)
+//                 CHUNK_BACKEND_FILE            SMALL_OBJECT_SLAB      BEST_FIT                  LARGE_OBJECT_CACHED
+//                                                                                                LARGE_OBJECT_UNCACHED
+//   malloc_3    -DBUDDY_CHUNK_BACKEND=        -DSMALL_OBJECT_LAYER=  buddy, per NUMA node      -DLARGE_OBJECT_LAYER=
+//                 CHUNK_BACKEND_MMAP (default)  SMALL_OBJECT_NONE                                LARGE_OBJECT_CACHED
+//                 CHUNK_BACKEND_SBRK            (default)                                        (default)
+//                 CHUNK_BACKEND_FILE            SMALL_OBJECT_SLAB                                LARGE_OBJECT_UNCACHED
+// malloc_3 can also run its background maintenance thread (default config) during the benchmarks, add
+//   -DBENCH_MAINTENANCE -DBENCH_ALLOCATOR='"malloc_3_maintenance"'
+//
+// every benchmark prints one JSON object per line:
+//   {"allocator":..., "benchmark":..., "ops":..., "failed_ops":..., "ops_per_sec":...,
+//    "p50_ns":..., "p99_ns":..., "p999_ns":..., "peak_rss_kb":..., "fragmentation":...}
+// fragmentation is the heap footprint divided by the bytes the benchmark had live at its checkpoint
+// (1.0 is perfect), and null for variants that can't report their footprint (malloc_1). benchmarks that
+// need a function the variant doesn't have (malloc_1 has no sfree, scalloc or srealloc) are skipped, only
+// the churn benchmark runs (without frees) for malloc_1.
+// build_then_discard drops its nodes with srelease where the variant has smark/srelease (malloc_1),
+// and frees them one by one otherwise.
+#include <unistd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#ifdef BENCH_SYSTEM_MALLOC
+#include <malloc.h>
+#endif
+#include "malloc_3.h"
+
+#ifndef BENCH_ALLOCATOR
+#ifdef BENCH_SYSTEM_MALLOC
+#define BENCH_ALLOCATOR "glibc"
+#else
+#define BENCH_ALLOCATOR "smalloc"
+#endif
+#endif
+
+#define CHURN_OPS 1000000
+#define CHURN_BATCH 64
+#define CHURN_SIZE 64
+#define RANDOM_OPS 500000
+#define RANDOM_LIVE_SLOTS 512
+#define RANDOM_MAX_SIZE 4096
+#define QUEUE_OPS 500000
+#define QUEUE_DEPTH 1024
+#define QUEUE_MAX_SIZE 512
+#define REALLOC_ROUNDS 200
+#define REALLOC_MAX_SIZE (1 << 20)
+#define CALLOC_ROUNDS 50
+#define CALLOC_ELEMENTS (1 << 17)
+#define FRAG_LIVE_BLOCKS 8192
+#define FRAG_ROUNDS 20
+#define DISCARD_ROUNDS 50
+#define DISCARD_NODES 20000
+#define DISCARD_MAX_SIZE 96
+#define FOOTPRINT_UNKNOWN SIZE_MAX
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ ALLOCATOR UNDER TEST ~~~~~~~~~~~~~~~~~~~
+#ifdef BENCH_SYSTEM_MALLOC
+void* smalloc(size_t size) { return malloc(size); }
+void* scalloc(size_t num, size_t size) { return calloc(num, size); }
+void* srealloc(void* oldp, size_t size) { return realloc(oldp, size); }
+void sfree(void* p) { free(p); }
+#else
+// malloc_3.h declares the interface, only smalloc is common to all variants. the rest are made weak here so
+// malloc_1 and malloc_2 link as well, smark and srelease are malloc_1's own
+void* scalloc(size_t num, size_t size) __attribute__((weak));
+void* srealloc(void* oldp, size_t size) __attribute__((weak));
+void sfree(void* p) __attribute__((weak));
+size_t _num_allocated_bytes() __attribute__((weak));
+size_t _num_meta_data_bytes() __attribute__((weak));
+bool smalloc_maintenance_start(const smalloc_maintenance_config* config) __attribute__((weak));
+void* smark() __attribute__((weak));
+void srelease(void* mark) __attribute__((weak));
+#endif
+
+// weak functions that the variant doesn't define resolve to nullptr
+template <class F>
+static bool isAvailable(F* function)
+{
+    return function != nullptr;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ MEASUREMENT ~~~~~~~~~~~~~~~~~~~
+class BenchResult
+{
+private:
+    const char* name;
+    std::vector<uint32_t> latencies_ns;
+    size_t failed_ops;
+    uint64_t total_ns;
+    size_t footprint_at_checkpoint;
+    size_t live_bytes_at_checkpoint;
+public:
+    explicit BenchResult(const char* name, size_t expected_ops);
+    ~BenchResult() = default;
+    void addSample(uint64_t ns, bool failed);
+    void checkpoint(size_t footprint, size_t live_bytes);
+    void print();
+};
+
+BenchResult::BenchResult(const char* name, size_t expected_ops): name(name), latencies_ns(), failed_ops(0),
+    total_ns(0), footprint_at_checkpoint(0), live_bytes_at_checkpoint(0)
+{
+    this->latencies_ns.reserve(expected_ops);
+}
+
+void BenchResult::addSample(uint64_t ns, bool failed)
+{
+    this->latencies_ns.push_back(static_cast<uint32_t>(std::min<uint64_t>(ns, UINT32_MAX)));
+    this->total_ns += ns;
+    if (failed)
+    {
+        this->failed_ops++;
+    }
+}
+
+void BenchResult::checkpoint(size_t footprint, size_t live_bytes)
+{
+    this->footprint_at_checkpoint = footprint;
+    this->live_bytes_at_checkpoint = live_bytes;
+}
+
+static long readPeakRssKb()
+{
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void BenchResult::print()
+{
+    std::vector<uint32_t>& samples = this->latencies_ns;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double q) -> uint32_t {
+        return samples.empty() ? 0 : samples[std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()))];
+    };
+    double seconds = this->total_ns / 1e9;
+    char fragmentation[32] = "null";
+    if (this->footprint_at_checkpoint != FOOTPRINT_UNKNOWN)
+    {
+        snprintf(fragmentation, sizeof(fragmentation), "%.3f", (this->live_bytes_at_checkpoint == 0) ? 0.0 :
+                 static_cast<double>(this->footprint_at_checkpoint) / this->live_bytes_at_checkpoint);
+    }
+    printf("{\"allocator\":\"%s\",\"benchmark\":\"%s\",\"ops\":%zu,\"failed_ops\":%zu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%ld,\"fragmentation\":%s}\n",
+           BENCH_ALLOCATOR, this->name, samples.size(), this->failed_ops,
+           (seconds > 0) ? samples.size() / seconds : 0.0,
+           percentile(0.50), percentile(0.99), percentile(0.999), readPeakRssKb(), fragmentation);
+    fflush(stdout);
+}
+
+static inline uint64_t nowNs()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// heap footprint as the allocator itself sees it. malloc_1 keeps no statistics, and the RSS growth
+// would also count the benchmark's own buffers and whatever earlier benchmarks left behind
+static size_t heapFootprint()
+{
+#ifdef BENCH_SYSTEM_MALLOC
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+#else
+    if (isAvailable(_num_allocated_bytes) && isAvailable(_num_meta_data_bytes))
+    {
+        return _num_allocated_bytes() + _num_meta_data_bytes();
+    }
+    return FOOTPRINT_UNKNOWN;
+#endif
+}
+
+static void resetPeakRss()
+{
+    // "5" resets VmHWM (and ru_maxrss) on linux >= 4.0, ignore failure on older kernels
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0)
+    {
+        ssize_t ignored = write(fd, "5", 1);
+        (void) ignored;
+        close(fd);
+    }
+}
+
+class Random
+{
+private:
+    uint64_t state;
+public:
+    explicit Random(uint64_t seed) : state(seed) {}
+    uint64_t next()
+    {
+        this->state ^= this->state << 13;
+        this->state ^= this->state >> 7;
+        this->state ^= this->state << 17;
+        return this->state;
+    }
+    size_t nextSize(size_t max_size) { return 1 + this->next() % max_size; }
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ TIMED OPERATIONS ~~~~~~~~~~~~~~~~~~~
+static void* timedMalloc(BenchResult& result, size_t size)
+{
+    uint64_t start = nowNs();
+    void* p = smalloc(size);
+    result.addSample(nowNs() - start, p == nullptr);
+    return p;
+}
+
+static void timedFree(BenchResult& result, void* p)
+{
+    if (!isAvailable(sfree) || p == nullptr)
+    {
+        return;
+    }
+    uint64_t start = nowNs();
+    sfree(p);
+    result.addSample(nowNs() - start, false);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ BENCHMARKS ~~~~~~~~~~~~~~~~~~~
+// allocate a batch of equal sized blocks and free it again
+static void benchSameSizeChurn()
+{
+    BenchResult result("same_size_churn", CHURN_OPS * 2);
+    void* batch[CHURN_BATCH];
+    for (int op = 0; op < CHURN_OPS; op += CHURN_BATCH)
+    {
+        for (int i = 0; i < CHURN_BATCH; i++)
+        {
+            batch[i] = timedMalloc(result, CHURN_SIZE);
+        }
+        if (op == 0)
+        {
+            result.checkpoint(heapFootprint(), CHURN_BATCH * CHURN_SIZE);
+        }
+        for (int i = 0; i < CHURN_BATCH; i++)
+        {
+            timedFree(result, batch[i]);
+        }
+    }
+    result.print();
+}
+
+// replace a random live slot with a block of random size
+static void benchRandomSizes()
+{
+    if (!isAvailable(sfree))
+    {
+        return;
+    }
+    BenchResult result("random_sizes", RANDOM_OPS * 2);
+    Random random(42);
+    std::vector<void*> slots(RANDOM_LIVE_SLOTS, nullptr);
+    std::vector<size_t> sizes(RANDOM_LIVE_SLOTS, 0);
+    size_t live_bytes = 0;
+    for (int op = 0; op < RANDOM_OPS; op++)
+    {
+        size_t slot = random.next() % RANDOM_LIVE_SLOTS;
+        timedFree(result, slots[slot]);
+        live_bytes -= sizes[slot];
+        sizes[slot] = random.nextSize(RANDOM_MAX_SIZE);
+        slots[slot] = timedMalloc(result, sizes[slot]);
+        sizes[slot] = (slots[slot] == nullptr) ? 0 : sizes[slot];
+        live_bytes += sizes[slot];
+        if (op == RANDOM_OPS / 2)
+        {
+            result.checkpoint(heapFootprint(), live_bytes);
+        }
+    }
+    for (void* p : slots)
+    {
+        timedFree(result, p);
+    }
+    result.print();
+}
+
+// blocks are released in the order they were allocated, like a queue between a producer and a consumer.
+// the allocators aren't thread safe, so both sides run on one thread and only the FIFO pattern is kept
+static void benchProducerConsumer()
+{
+    if (!isAvailable(sfree))
+    {
+        return;
+    }
+    BenchResult result("producer_consumer", QUEUE_OPS * 2);
+    Random random(7);
+    std::vector<void*> queue(QUEUE_DEPTH, nullptr);
+    std::vector<size_t> sizes(QUEUE_DEPTH, 0);
+    size_t live_bytes = 0;
+    for (int op = 0; op < QUEUE_OPS; op++)
+    {
+        size_t slot = op % QUEUE_DEPTH;
+        timedFree(result, queue[slot]);
+        live_bytes -= sizes[slot];
+        sizes[slot] = random.nextSize(QUEUE_MAX_SIZE);
+        queue[slot] = timedMalloc(result, sizes[slot]);
+        sizes[slot] = (queue[slot] == nullptr) ? 0 : sizes[slot];
+        live_bytes += sizes[slot];
+        if (op == QUEUE_OPS / 2)
+        {
+            result.checkpoint(heapFootprint(), live_bytes);
+        }
+    }
+    for (void* p : queue)
+    {
+        timedFree(result, p);
+    }
+    result.print();
+}
+
+// grow one buffer from 16 bytes to REALLOC_MAX_SIZE in 1.5x steps
+static void benchReallocGrowth()
+{
+    if (!isAvailable(srealloc))
+    {
+        return;
+    }
+    BenchResult result("realloc_growth", REALLOC_ROUNDS * 64);
+    for (int round = 0; round < REALLOC_ROUNDS; round++)
+    {
+        void* p = nullptr;
+        for (size_t size = 16; size <= REALLOC_MAX_SIZE; size += size / 2)
+        {
+            uint64_t start = nowNs();
+            void* newp = srealloc(p, size);
+            result.addSample(nowNs() - start, newp == nullptr);
+            if (newp == nullptr)
+            {
+                break;
+            }
+            p = newp;
+            if (round == 0 && size + size / 2 > REALLOC_MAX_SIZE)
+            {
+                result.checkpoint(heapFootprint(), size);
+            }
+        }
+        timedFree(result, p);
+    }
+    result.print();
+}
+
+static void benchLargeCalloc()
+{
+    if (!isAvailable(scalloc))
+    {
+        return;
+    }
+    BenchResult result("large_calloc", CALLOC_ROUNDS * 2);
+    for (int round = 0; round < CALLOC_ROUNDS; round++)
+    {
+        size_t elements = CALLOC_ELEMENTS + round * 1024;
+        uint64_t start = nowNs();
+        void* p = scalloc(elements, sizeof(uint64_t));
+        result.addSample(nowNs() - start, p == nullptr);
+        if (round == 0)
+        {
+            result.checkpoint(heapFootprint(), elements * sizeof(uint64_t));
+        }
+        timedFree(result, p);
+    }
+    result.print();
+}
+
+// keep a large live set, free every other block and refill the holes with slightly bigger blocks.
+// the checkpoint is taken after the last round, when the heap is as fragmented as it gets
+static void benchLongLivedFragmentation()
+{
+    if (!isAvailable(sfree))
+    {
+        return;
+    }
+    BenchResult result("long_lived_fragmentation", FRAG_LIVE_BLOCKS * (FRAG_ROUNDS + 2));
+    Random random(1234);
+    std::vector<void*> blocks(FRAG_LIVE_BLOCKS, nullptr);
+    std::vector<size_t> sizes(FRAG_LIVE_BLOCKS, 0);
+    size_t live_bytes = 0;
+    for (int i = 0; i < FRAG_LIVE_BLOCKS; i++)
+    {
+        sizes[i] = 16 + random.next() % 112;
+        blocks[i] = timedMalloc(result, sizes[i]);
+        sizes[i] = (blocks[i] == nullptr) ? 0 : sizes[i];
+        live_bytes += sizes[i];
+    }
+    for (int round = 0; round < FRAG_ROUNDS; round++)
+    {
+        for (int i = round % 2; i < FRAG_LIVE_BLOCKS; i += 2)
+        {
+            timedFree(result, blocks[i]);
+            live_bytes -= sizes[i];
+            sizes[i] = 16 + random.next() % (112 + round * 8);
+            blocks[i] = timedMalloc(result, sizes[i]);
+            sizes[i] = (blocks[i] == nullptr) ? 0 : sizes[i];
+            live_bytes += sizes[i];
+        }
+    }
+    result.checkpoint(heapFootprint(), live_bytes);
+    for (void* p : blocks)
+    {
+        timedFree(result, p);
+    }
+    result.print();
+}
+
+// build a tree's worth of small nodes, then throw all of them away at once, like a parser does
+static void benchBuildThenDiscard()
+{
+#ifdef BENCH_SYSTEM_MALLOC
+    bool has_release = false;
+#else
+    bool has_release = isAvailable(smark) && isAvailable(srelease);
+#endif
+    if (!has_release && !isAvailable(sfree))
+    {
+        return;
+    }
+    BenchResult result("build_then_discard", DISCARD_ROUNDS * (DISCARD_NODES + 1) * 2);
+    Random random(99);
+    std::vector<void*> nodes(DISCARD_NODES, nullptr);
+    for (int round = 0; round < DISCARD_ROUNDS; round++)
+    {
+#ifndef BENCH_SYSTEM_MALLOC
+        void* mark = has_release ? smark() : nullptr;
+#endif
+        size_t live_bytes = 0;
+        for (int i = 0; i < DISCARD_NODES; i++)
+        {
+            size_t size = random.nextSize(DISCARD_MAX_SIZE);
+            nodes[i] = timedMalloc(result, size);
+            live_bytes += (nodes[i] == nullptr) ? 0 : size;
+        }
+        if (round == 0)
+        {
+            result.checkpoint(heapFootprint(), live_bytes);
+        }
+#ifndef BENCH_SYSTEM_MALLOC
+        if (has_release)
+        {
+            uint64_t start = nowNs();
+            srelease(mark);
+            result.addSample(nowNs() - start, false);
+            continue;
+        }
+#endif
+        for (void* p : nodes)
+        {
+            timedFree(result, p);
+        }
+    }
+    result.print();
+}
+
+int main()
+{
+#if defined(BENCH_MAINTENANCE) && !defined(BENCH_SYSTEM_MALLOC)
+    if (isAvailable(smalloc_maintenance_start))
+    {
+        smalloc_maintenance_start(nullptr);
+    }
+#endif
+    void (*benchmarks[])() = {benchSameSizeChurn, benchRandomSizes, benchProducerConsumer,
+                              benchReallocGrowth, benchLargeCalloc, benchLongLivedFragmentation,
+                              benchBuildThenDiscard};
+    for (auto benchmark : benchmarks)
+    {
+        resetPeakRss();
+        benchmark();
+    }
+    return 0;
+}
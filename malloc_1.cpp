@@ -1,16 +1,235 @@
 #include <unistd.h>
-#define SBRK_FAILED (void *) (-1)
-#define MAX_SIZE 100000000
-void* smalloc (size_t size)
+#include <sys/mman.h>
+#include <cstdint>
+#include <atomic>
+#include "allocator_core.h"
+// where the chunks come from, choose with -DHEAP_BACKEND=CHUNK_BACKEND_FILE
+#ifndef HEAP_BACKEND
+#define HEAP_BACKEND CHUNK_BACKEND_MMAP
+#endif
+#if HEAP_BACKEND == CHUNK_BACKEND_SBRK
+#error "malloc_1 unmaps its large chunks, the program break can't give them back"
+#endif
+#define MAX_SIZE CORE_MAX_SIZE
+#define CHUNK_SIZE (1 << 20) // what a thread bumps in, bigger requests get a chunk of their own size
+#define RESERVOIR_BATCH 8    // chunks mapped at once when the reservoir runs dry
+#define RESERVOIR_POINTER_MASK ((uint64_t(1) << 48) - 1)
+#define RESERVOIR_TAG_UNIT (uint64_t(1) << 48)
+#define ALIGNMENT 16
+#define ALIGN_UP(s) (((s) + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1))
+
+// every chunk starts with this header. the chunks a thread has in use are a stack, the current one on top
+struct Chunk
+{
+    Chunk* prev; // also the link in the reservoir
+    size_t size; // including the header
+    bool is_large; // mapped for one big request, unmapped again on release
+};
+#define CHUNK_HEADER_SIZE ALIGN_UP(sizeof(Chunk))
+#define GET_CHUNK_START(c) ((char*)(c) + CHUNK_HEADER_SIZE)
+#define GET_CHUNK_END(c) ((char*)(c) + (c)->size)
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ THE CORE ~~~~~~~~~~~~~~~~~~~
+// the bump arenas below are the core's mid engine, there is nothing in front of them. the page source is
+// only asked for chunks, its break isn't used
+
+class BumpEngine
+{
+public:
+    static const size_t MAX_REQUEST = MAX_SIZE;
+    constexpr BumpEngine() {}
+    void* allocate(size_t size, int tag);
+};
+
+typedef AllocatorCore<PageSourceOf<HEAP_BACKEND>::type, NoSmallObjects, BumpEngine, NoLargeObjects> HeapCore;
+
+HeapCore heap;
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ CHUNK RESERVOIR ~~~~~~~~~~~~~~~~~~~
+// a lock free stack of free CHUNK_SIZE chunks shared by all threads. the head packs the chunk pointer
+// (user space pointers fit in 48 bits) with a counter bumped on every change, so a pop can't succeed
+// on a head that was popped and pushed back in between (ABA). chunks in the reservoir are never
+// unmapped, so reading the link of a chunk another thread just popped is harmless - its CAS fails.
+
+std::atomic<uint64_t> reservoir_head(0);
+
+static Chunk* getReservoirChunk(uint64_t head)
+{
+    return (Chunk*) uintptr_t(head & RESERVOIR_POINTER_MASK);
+}
+
+static uint64_t makeReservoirHead(Chunk* chunk, uint64_t old_head)
+{
+    return uint64_t(uintptr_t(chunk)) | ((old_head & ~RESERVOIR_POINTER_MASK) + RESERVOIR_TAG_UNIT);
+}
+
+static void pushToReservoir(Chunk* chunk)
+{
+    uint64_t head = reservoir_head.load(std::memory_order_relaxed);
+    do
+    {
+        __atomic_store_n(&chunk->prev, getReservoirChunk(head), __ATOMIC_RELAXED);
+    } while (!reservoir_head.compare_exchange_weak(head, makeReservoirHead(chunk, head),
+                                                   std::memory_order_release, std::memory_order_relaxed));
+}
+
+static Chunk* popFromReservoir()
+{
+    uint64_t head = reservoir_head.load(std::memory_order_acquire);
+    while (getReservoirChunk(head) != nullptr)
+    {
+        Chunk* next = __atomic_load_n(&getReservoirChunk(head)->prev, __ATOMIC_RELAXED);
+        if (reservoir_head.compare_exchange_weak(head, makeReservoirHead(next, head),
+                                                 std::memory_order_acquire, std::memory_order_acquire))
+        {
+            return getReservoirChunk(head);
+        }
+    }
+    return nullptr;
+}
+
+// takes a chunk from the reservoir, refilling it with a new batch if it is empty
+static Chunk* getChunk()
+{
+    Chunk* chunk = popFromReservoir();
+    if (chunk != nullptr)
+    {
+        return chunk;
+    }
+    void* batch = heap.getPageSource()->mapChunk(size_t(CHUNK_SIZE) * RESERVOIR_BATCH, ALIGNMENT, false);
+    if (batch == nullptr)
+    {
+        return nullptr;
+    }
+    for (int i = RESERVOIR_BATCH - 1; i >= 0; i--)
+    {
+        chunk = (Chunk*) ((char*) batch + size_t(i) * CHUNK_SIZE);
+        chunk->size = CHUNK_SIZE;
+        chunk->is_large = false;
+        if (i > 0)
+        {
+            pushToReservoir(chunk);
+        }
+    }
+    return chunk;
+}
+
+static Chunk* getLargeChunk(size_t size)
+{
+    size_t chunk_size = ALIGN_UP(CHUNK_HEADER_SIZE + size);
+    void* mapped = heap.getPageSource()->mapChunk(chunk_size, ALIGNMENT, false);
+    if (mapped == nullptr)
+    {
+        return nullptr;
+    }
+    Chunk* chunk = (Chunk*) mapped;
+    chunk->size = chunk_size;
+    chunk->is_large = true;
+    return chunk;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ BUMP ARENA ~~~~~~~~~~~~~~~~~~~
+// one per thread, so allocation needs no synchronization at all
+
+class BumpArena
+{
+private:
+    Chunk* current;
+    char* top; // next free byte in current
+
+    bool newChunk(size_t size);
+public:
+    constexpr BumpArena(): current(nullptr), top(nullptr) {}
+    void* allocate(size_t size);
+    void* mark() const;
+    void release(void* mark);
+};
+
+bool BumpArena::newChunk(size_t size)
+{
+    Chunk* chunk = (CHUNK_HEADER_SIZE + size > CHUNK_SIZE) ? getLargeChunk(size) : getChunk();
+    if (chunk == nullptr)
+    {
+        return false;
+    }
+    // atomic, a stale pop in another thread may still be reading this link
+    __atomic_store_n(&chunk->prev, this->current, __ATOMIC_RELAXED);
+    this->current = chunk;
+    this->top = GET_CHUNK_START(chunk);
+    return true;
+}
+
+void* BumpArena::allocate(size_t size)
 {
-    if (size == 0 || size > MAX_SIZE)
+    size = ALIGN_UP(size);
+    if (this->current == nullptr || size > size_t(GET_CHUNK_END(this->current) - this->top))
     {
-        return nullptr; //need to return NULL or nullptr?
+        if (!this->newChunk(size))
+        {
+            return nullptr;
+        }
     }
-    void* return_value = sbrk(long (size));
-    if(return_value == SBRK_FAILED)
+    void* block = this->top;
+    this->top += size;
+    return block;
+}
+
+void* BumpArena::mark() const
+{
+    return this->top;
+}
+
+// pops every chunk the mark isn't in, then rolls the top back to it
+void BumpArena::release(void* mark)
+{
+    char* mark_ptr = (char*) mark;
+    while (this->current != nullptr &&
+           !(GET_CHUNK_START(this->current) <= mark_ptr && mark_ptr <= GET_CHUNK_END(this->current)))
     {
-        return nullptr; //need to return NULL or nullptr?
+        Chunk* chunk = this->current;
+        this->current = chunk->prev;
+        if (chunk->is_large)
+        {
+            heap.getPageSource()->unmapChunk(chunk, chunk->size);
+        }
+        else
+        {
+            pushToReservoir(chunk);
+        }
     }
-    return return_value;
+    this->top = (this->current == nullptr) ? nullptr : mark_ptr;
+}
+
+// constant initialized, so using it costs no TLS guard. a thread's chunks aren't taken back when it
+// exits - the blocks may still be used by other threads - so call sreset first to recycle them
+thread_local BumpArena arena;
+
+void* BumpEngine::allocate(size_t size, int tag)
+{
+    (void) tag;
+    return arena.allocate(size);
+}
+
+void* smalloc (size_t size)
+{
+    return heap.allocate(size, 0);
+}
+
+// mark, srelease and sreset only apply to the calling thread's allocations.
+// a checkpoint for srelease. NULL if nothing was allocated yet
+void* smark()
+{
+    return arena.mark();
+}
+
+// frees everything allocated after mark was taken. marks taken after it become invalid
+void srelease(void* mark)
+{
+    arena.release(mark);
+}
+
+// frees everything
+void sreset()
+{
+    arena.release(nullptr);
 }
@@ -1,11 +1,43 @@
 #include <unistd.h>
+#include <sys/mman.h>
 #include <cstring>
-#define SBRK_FAILED (void *) (-1)
-#define MAX_SIZE 100000000
+#include <cstdint>
+#include <algorithm>
+#include "allocator_core.h"
+// where the heap's pages come from, choose with -DHEAP_BACKEND=CHUNK_BACKEND_MMAP or CHUNK_BACKEND_FILE
+#ifndef HEAP_BACKEND
+#define HEAP_BACKEND CHUNK_BACKEND_SBRK
+#endif
+#ifndef SMALL_OBJECT_LAYER
+#define SMALL_OBJECT_LAYER SMALL_OBJECT_NONE
+#endif
+#ifndef LARGE_OBJECT_LAYER
+#define LARGE_OBJECT_LAYER LARGE_OBJECT_NONE
+#endif
+#define MAX_SIZE CORE_MAX_SIZE
+// with a large object layer, bigger requests get a mapping of their own instead of a block (malloc_3's split)
+#define FIT_MAX_REQUEST ((LARGE_OBJECT_LAYER == LARGE_OBJECT_NONE) ? MAX_SIZE : 131072)
 #define META_DATA_SIZE sizeof(MallocMetadata)
 #define GET_METADATA(p) ((MallocMetadata *) ((char *) p - META_DATA_SIZE))
 #define GET_USER_PTR(p) ((void*)((char*)(p) + META_DATA_SIZE))
 #define ALLOC_SIZE(s) long(s + META_DATA_SIZE)
+#define NUM_OF_EXACT_BINS 256 // bin i holds free blocks of exactly i+1 bytes
+#define FIRST_POWER_BIN_LOG 8 // then one bin per power of two: [2^8, 2^9), [2^9, 2^10) ...
+#define MAX_SIZE_LOG 27       // MAX_SIZE < 2^27, the last bin also takes the bigger blocks coalescing makes
+#define NUM_OF_BINS (NUM_OF_EXACT_BINS + MAX_SIZE_LOG - FIRST_POWER_BIN_LOG)
+#define BITMAP_WORDS ((NUM_OF_BINS + 63) / 64)
+// how lookForAvailableBlock picks a free block, choose with -DFIT_POLICY=BEST_FIT etc.
+#define FIRST_FIT 0      // lowest address that fits, scans the whole block list
+#define NEXT_FIT 1       // like first fit, but starts where the last search stopped
+#define BEST_FIT 2       // smallest block that fits (lowest address on ties), from a size ordered treap
+#define SEGREGATED_FIT 3 // from size bins, exact for small sizes
+#ifndef FIT_POLICY
+#define FIT_POLICY SEGREGATED_FIT
+#endif
+#define MIN_SPLIT_SIZE 128 // a smaller leftover isn't worth a block of its own
+#define SPLIT_ALIGNMENT 8  // headers cut out of a block start on this boundary
+#define ALIGN_UP(s) (((s) + SPLIT_ALIGNMENT - 1) & ~size_t(SPLIT_ALIGNMENT - 1))
+#define GET_BLOCK_END(md) ((char*)GET_USER_PTR(md) + (md)->getUserSize())
 
 class MallocMetadata
 {
@@ -14,24 +46,36 @@ private:
     bool is_free;
     MallocMetadata* next;
     MallocMetadata* prev;
+    MallocMetadata* next_free; // links inside the free block's bin,
+    MallocMetadata* prev_free; // or its left and right children in the best fit treap
 public:
     explicit MallocMetadata(size_t user_size);
     ~MallocMetadata() = default;
     size_t getUserSize() const;
+    void setUserSize(size_t new_user_size);
     void setNext(MallocMetadata* new_next);
     MallocMetadata* getNext();
     void setPrev(MallocMetadata* new_prev);
+    MallocMetadata* getPrev();
     void setIsFree(bool new_is_free);
     bool isFree() const;
+    void setNextFree(MallocMetadata* new_next_free);
+    MallocMetadata* getNextFree();
+    void setPrevFree(MallocMetadata* new_prev_free);
+    MallocMetadata* getPrevFree();
 };
 
 MallocMetadata::MallocMetadata(size_t user_size): user_size(user_size), is_free(false),
-                                                  next(nullptr), prev(nullptr) {}
+                                                  next(nullptr), prev(nullptr), next_free(nullptr), prev_free(nullptr) {}
 
 size_t MallocMetadata::getUserSize() const {
     return this->user_size;
 }
 
+void MallocMetadata::setUserSize(size_t new_user_size) {
+    this->user_size = new_user_size;
+}
+
 void MallocMetadata::setNext(MallocMetadata *new_next) {
     this->next = new_next;
 }
@@ -44,6 +88,10 @@ void MallocMetadata::setPrev(MallocMetadata *new_prev) {
     this->prev = new_prev;
 }
 
+MallocMetadata *MallocMetadata::getPrev() {
+    return this->prev;
+}
+
 void MallocMetadata::setIsFree(bool new_is_free) {
     this->is_free = new_is_free;
 }
@@ -52,15 +100,33 @@ bool MallocMetadata::isFree() const {
     return this->is_free;
 }
 
-class MemoryManager
+void MallocMetadata::setNextFree(MallocMetadata *new_next_free) {
+    this->next_free = new_next_free;
+}
+
+MallocMetadata *MallocMetadata::getNextFree() {
+    return this->next_free;
+}
+
+void MallocMetadata::setPrevFree(MallocMetadata *new_prev_free) {
+    this->prev_free = new_prev_free;
+}
+
+MallocMetadata *MallocMetadata::getPrevFree() {
+    return this->prev_free;
+}
+
+// the fit engine's state. the stats count every block, free ones too (= num_of_meta_data_blocks)
+class MemoryManager : public BlockCounters
 {
 private:
     MallocMetadata* head;
     MallocMetadata* tail;
-    size_t num_of_allocated_blocks; // = num_of_meta_data_blocks
-    size_t num_of_bytes_in_allocated_blocks;
-    size_t num_of_allocated_blocks_that_are_free;
-    size_t num_of_bytes_in_allocated_blocks_that_are_free;
+    // free blocks only, segregated by size. a set bit in bins_bitmap means the bin isn't empty
+    MallocMetadata* bins[NUM_OF_BINS];
+    uint64_t bins_bitmap[BITMAP_WORDS];
+    MallocMetadata* tree_root; // best fit
+    MallocMetadata* rover;     // next fit
 
 public:
     MemoryManager();
@@ -69,21 +135,25 @@ public:
     MallocMetadata* getHead();
     void setTail(MallocMetadata* new_tail);
     MallocMetadata* getTail();
-    size_t getNumOfAllocatedBlocks() const;
-    void incNumOfAllocatedBlocks();
-    size_t getNumOfBytesInAllocatedBlocks() const;
-    void incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes);
-    size_t getNumOfAllocatedBlocksThatAreFree() const;
-    void incNumOfAllocatedBlocksThatAreFree();
-    void decNumOfAllocatedBlocksThatAreFree();
-    size_t getNumOfBytesInAllocatedBlocksThatAreFree() const;
-    void incNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes);
-    void decNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes);
+    // ~~~~~~~~~~~~~ free bins ~~~~~~~~~~~~~~
+    static int getBinIndex(size_t user_size);
+    int findNonEmptyBinFrom(int bin_index) const;
+    void insertToBin(MallocMetadata* block);
+    void removeFromBin(MallocMetadata* block);
+    MallocMetadata* getBinHead(int bin_index);
+    // ~~~~~~~~~~~~~ best fit treap ~~~~~~~~~~~~~~
+    void insertToTree(MallocMetadata* block);
+    void removeFromTree(MallocMetadata* block);
+    MallocMetadata* findBestFit(size_t user_size);
+    // ~~~~~~~~~~~~~ fit policy ~~~~~~~~~~~~~~
+    void insertFreeBlock(MallocMetadata* block);
+    void removeFreeBlock(MallocMetadata* block);
+    void setRover(MallocMetadata* new_rover);
+    MallocMetadata* getRover();
 };
 
-MemoryManager::MemoryManager(): head(nullptr), tail(nullptr), num_of_allocated_blocks(0),
-        num_of_bytes_in_allocated_blocks(0), num_of_allocated_blocks_that_are_free(0),
-                                num_of_bytes_in_allocated_blocks_that_are_free(0) {}
+MemoryManager::MemoryManager(): BlockCounters(), head(nullptr), tail(nullptr), bins{}, bins_bitmap{},
+                                tree_root(nullptr), rover(nullptr) {}
 
 MallocMetadata *MemoryManager::getHead() {
     return this->head;
@@ -101,51 +171,261 @@ void MemoryManager::setHead(MallocMetadata *new_head) {
     this->head = new_head;
 }
 
-size_t MemoryManager::getNumOfAllocatedBlocks() const {
-    return this->num_of_allocated_blocks;
+// ~~~~~~~~~~~~~ free bins ~~~~~~~~~~~~~~
+
+int MemoryManager::getBinIndex(size_t user_size) {
+    if (user_size <= NUM_OF_EXACT_BINS)
+    {
+        return int(user_size) - 1;
+    }
+    // free neighbours coalesce past MAX_SIZE, those blocks share the last bin
+    int log = std::min(63 - __builtin_clzll(user_size), MAX_SIZE_LOG - 1);
+    return NUM_OF_EXACT_BINS + log - FIRST_POWER_BIN_LOG;
+}
+
+// returns the first non empty bin with index >= bin_index, or -1
+int MemoryManager::findNonEmptyBinFrom(int bin_index) const {
+    int word = bin_index / 64;
+    uint64_t bits = this->bins_bitmap[word] & (~uint64_t(0) << (bin_index % 64));
+    while (bits == 0)
+    {
+        if (++word == BITMAP_WORDS)
+        {
+            return -1;
+        }
+        bits = this->bins_bitmap[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+void MemoryManager::insertToBin(MallocMetadata *block) {
+    int bin_index = getBinIndex(block->getUserSize());
+    MallocMetadata* bin_head = this->bins[bin_index];
+    block->setPrevFree(nullptr);
+    block->setNextFree(bin_head);
+    if (bin_head != nullptr)
+    {
+        bin_head->setPrevFree(block);
+    }
+    this->bins[bin_index] = block;
+    this->bins_bitmap[bin_index / 64] |= uint64_t(1) << (bin_index % 64);
 }
 
-void MemoryManager::incNumOfAllocatedBlocks()
+void MemoryManager::removeFromBin(MallocMetadata *block) {
+    int bin_index = getBinIndex(block->getUserSize());
+    if (block->getPrevFree() == nullptr)
+    {
+        this->bins[bin_index] = block->getNextFree();
+    }
+    else
+    {
+        block->getPrevFree()->setNextFree(block->getNextFree());
+    }
+    if (block->getNextFree() != nullptr)
+    {
+        block->getNextFree()->setPrevFree(block->getPrevFree());
+    }
+    block->setNextFree(nullptr);
+    block->setPrevFree(nullptr);
+    if (this->bins[bin_index] == nullptr)
+    {
+        this->bins_bitmap[bin_index / 64] &= ~(uint64_t(1) << (bin_index % 64));
+    }
+}
+
+MallocMetadata *MemoryManager::getBinHead(int bin_index) {
+    return this->bins[bin_index];
+}
+
+// ~~~~~~~~~~~~~ best fit treap ~~~~~~~~~~~~~~
+// ordered by (size, address), so every key is unique. the heap priority is a hash of the block's
+// address, so the tree is balanced in expectation without storing anything more in the metadata.
+
+static bool isBeforeInTree(MallocMetadata* a, MallocMetadata* b)
 {
-    this->num_of_allocated_blocks++;
+    return a->getUserSize() < b->getUserSize() ||
+           (a->getUserSize() == b->getUserSize() && a < b);
 }
 
-size_t MemoryManager::getNumOfBytesInAllocatedBlocks() const {
-    return num_of_bytes_in_allocated_blocks;
+static uint64_t getTreePriority(MallocMetadata* block)
+{
+    // splitmix64's finalizer, blocks at a fixed stride must still get unrelated priorities
+    uint64_t x = uint64_t(uintptr_t(block));
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
 }
 
-void MemoryManager::incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes) {
-    this->num_of_bytes_in_allocated_blocks += num_of_bytes;
+// splits tree into the blocks before key and the rest
+static void splitTree(MallocMetadata* tree, MallocMetadata* key, MallocMetadata** before, MallocMetadata** after)
+{
+    if (tree == nullptr)
+    {
+        *before = *after = nullptr;
+        return;
+    }
+    if (isBeforeInTree(tree, key))
+    {
+        MallocMetadata* right = tree->getPrevFree();
+        splitTree(right, key, &right, after);
+        tree->setPrevFree(right);
+        *before = tree;
+    }
+    else
+    {
+        MallocMetadata* left = tree->getNextFree();
+        splitTree(left, key, before, &left);
+        tree->setNextFree(left);
+        *after = tree;
+    }
 }
 
-size_t MemoryManager::getNumOfAllocatedBlocksThatAreFree() const {
-    return this->num_of_allocated_blocks_that_are_free;
+// every block in before comes before every block in after
+static MallocMetadata* joinTrees(MallocMetadata* before, MallocMetadata* after)
+{
+    if (before == nullptr) return after;
+    if (after == nullptr) return before;
+    if (getTreePriority(before) > getTreePriority(after))
+    {
+        before->setPrevFree(joinTrees(before->getPrevFree(), after));
+        return before;
+    }
+    after->setNextFree(joinTrees(before, after->getNextFree()));
+    return after;
 }
 
-void MemoryManager::incNumOfAllocatedBlocksThatAreFree() {
-    this->num_of_allocated_blocks_that_are_free++;
+static MallocMetadata* insertToSubtree(MallocMetadata* tree, MallocMetadata* block)
+{
+    if (tree == nullptr || getTreePriority(block) > getTreePriority(tree))
+    {
+        MallocMetadata* left;
+        MallocMetadata* right;
+        splitTree(tree, block, &left, &right);
+        block->setNextFree(left);
+        block->setPrevFree(right);
+        return block;
+    }
+    if (isBeforeInTree(block, tree))
+    {
+        tree->setNextFree(insertToSubtree(tree->getNextFree(), block));
+    }
+    else
+    {
+        tree->setPrevFree(insertToSubtree(tree->getPrevFree(), block));
+    }
+    return tree;
+}
+
+static MallocMetadata* removeFromSubtree(MallocMetadata* tree, MallocMetadata* block)
+{
+    if (tree == block)
+    {
+        MallocMetadata* joined = joinTrees(block->getNextFree(), block->getPrevFree());
+        block->setNextFree(nullptr);
+        block->setPrevFree(nullptr);
+        return joined;
+    }
+    if (isBeforeInTree(block, tree))
+    {
+        tree->setNextFree(removeFromSubtree(tree->getNextFree(), block));
+    }
+    else
+    {
+        tree->setPrevFree(removeFromSubtree(tree->getPrevFree(), block));
+    }
+    return tree;
+}
+
+void MemoryManager::insertToTree(MallocMetadata *block) {
+    this->tree_root = insertToSubtree(this->tree_root, block);
+}
+
+void MemoryManager::removeFromTree(MallocMetadata *block) {
+    this->tree_root = removeFromSubtree(this->tree_root, block);
+}
+
+MallocMetadata *MemoryManager::findBestFit(size_t user_size) {
+    MallocMetadata* best = nullptr;
+    MallocMetadata* itr = this->tree_root;
+    while (itr != nullptr)
+    {
+        if (itr->getUserSize() >= user_size)
+        {
+            best = itr;
+            itr = itr->getNextFree();
+        }
+        else
+        {
+            itr = itr->getPrevFree();
+        }
+    }
+    return best;
 }
 
-void MemoryManager::decNumOfAllocatedBlocksThatAreFree() {
-    this->num_of_allocated_blocks_that_are_free--;
+// ~~~~~~~~~~~~~ fit policy ~~~~~~~~~~~~~~
+// first and next fit scan the block list itself, they keep no index of the free blocks
+
+void MemoryManager::insertFreeBlock(MallocMetadata *block) {
+#if FIT_POLICY == SEGREGATED_FIT
+    insertToBin(block);
+#elif FIT_POLICY == BEST_FIT
+    insertToTree(block);
+#else
+    (void)block;
+#endif
 }
 
-size_t MemoryManager::getNumOfBytesInAllocatedBlocksThatAreFree() const {
-    return num_of_bytes_in_allocated_blocks_that_are_free;
+void MemoryManager::removeFreeBlock(MallocMetadata *block) {
+#if FIT_POLICY == SEGREGATED_FIT
+    removeFromBin(block);
+#elif FIT_POLICY == BEST_FIT
+    removeFromTree(block);
+#else
+    (void)block;
+#endif
 }
 
-void MemoryManager::incNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes) {
-    this->num_of_bytes_in_allocated_blocks_that_are_free += num_of_bytes;
+void MemoryManager::setRover(MallocMetadata *new_rover) {
+    this->rover = new_rover;
 }
 
-void MemoryManager::decNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes) {
-    this->num_of_bytes_in_allocated_blocks_that_are_free -= num_of_bytes;
+MallocMetadata *MemoryManager::getRover() {
+    return this->rover;
 }
 
 
 MemoryManager manager = MemoryManager();
 
+// ~~~~~~~~~~~~~ the core ~~~~~~~~~~~~~~
+// the block list is the core's mid engine. the heap is one contiguous range from the page source's break that
+// only grows, so the top block can always grow in place
+
+class FitEngine
+{
+public:
+    static const size_t MAX_REQUEST = FIT_MAX_REQUEST;
+    constexpr FitEngine() {}
+    void* allocate(size_t size, int tag);
+    void free(void* p);
+    void freeSized(void* p, size_t size);
+    void* reallocate(void* oldp, size_t size);
+    bool owns(const void* p) const;
+    void addStats(CoreStats* stats) const;
+};
+
+typedef PageSourceOf<HEAP_BACKEND>::type HeapPageSource;
+typedef AllocatorCore<HeapPageSource, SmallObjectsOf<SMALL_OBJECT_LAYER, HeapPageSource>::type, FitEngine,
+                      LargeObjectsOf<LARGE_OBJECT_LAYER>::type> HeapCore;
+
+HeapCore heap;
 
+static void* moveBreak(long delta)
+{
+    return heap.getPageSource()->moveBreak(delta);
+}
+
+
+#if FIT_POLICY == FIRST_FIT
 MallocMetadata* lookForAvailableBlock(size_t user_size)
 {
     MallocMetadata* itr = manager.getHead();
@@ -159,18 +439,195 @@ MallocMetadata* lookForAvailableBlock(size_t user_size)
     }
     return itr;
 }
+#elif FIT_POLICY == NEXT_FIT
+MallocMetadata* lookForAvailableBlock(size_t user_size)
+{
+    MallocMetadata* start = manager.getRover() != nullptr ? manager.getRover() : manager.getHead();
+    MallocMetadata* itr = start;
+    while(itr != nullptr)
+    {
+        if(itr->getUserSize() >= user_size && itr->isFree())
+        {
+            manager.setRover(itr);
+            return itr;
+        }
+        itr = (itr->getNext() != nullptr) ? itr->getNext() : manager.getHead();
+        if(itr == start)
+        {
+            break;
+        }
+    }
+    return nullptr;
+}
+#elif FIT_POLICY == BEST_FIT
+MallocMetadata* lookForAvailableBlock(size_t user_size)
+{
+    return manager.findBestFit(user_size);
+}
+#else
+MallocMetadata* lookForAvailableBlock(size_t user_size)
+{
+    int bin_index = MemoryManager::getBinIndex(user_size);
+    if (bin_index >= NUM_OF_EXACT_BINS)
+    {
+        // a power of two bin also holds blocks smaller than user_size, only this bin needs a scan
+        MallocMetadata* itr = manager.getBinHead(bin_index);
+        while(itr != nullptr)
+        {
+            if(itr->getUserSize() >= user_size)
+            {
+                return itr;
+            }
+            itr = itr->getNextFree();
+        }
+        bin_index++;
+    }
+    if (bin_index >= NUM_OF_BINS)
+    {
+        return nullptr;
+    }
+    // every block in a bigger bin is big enough
+    int non_empty_bin = manager.findNonEmptyBinFrom(bin_index);
+    return (non_empty_bin == -1) ? nullptr : manager.getBinHead(non_empty_bin);
+}
+#endif
 
-void* smalloc(size_t size)
+// ~~~~~~~~~~~~~ splitting and coalescing ~~~~~~~~~~~~~~
+// the block list is kept in address order and doubly linked, so it is our boundary tag - the physical
+// neighbours of a block are its next/prev, as long as no one else moved the program break in between
+// (with the mmap backend no one else can).
+
+bool arePhysicalNeighbours(MallocMetadata* first, MallocMetadata* second)
+{
+    return GET_BLOCK_END(first) == (char*)second;
+}
+
+bool isTopBlock(MallocMetadata* block)
+{
+    return block == manager.getTail() && GET_BLOCK_END(block) == (char*)moveBreak(0);
+}
+
+// next must be free and out of its bin. block takes over next's memory and its metadata
+void absorbNextBlock(MallocMetadata* block, MallocMetadata* next)
+{
+    if (manager.getRover() == next)
+    {
+        manager.setRover(block);
+    }
+    block->setUserSize(block->getUserSize() + META_DATA_SIZE + next->getUserSize());
+    block->setNext(next->getNext());
+    if (next->getNext() == nullptr)
+    {
+        manager.setTail(block);
+    }
+    else
+    {
+        next->getNext()->setPrev(block);
+    }
+    // stats - next's metadata became part of block
+    manager.decNumOfAllocatedBlocksBy(1);
+    manager.incNumOfBytesInAllocatedBlocksBy(META_DATA_SIZE);
+    manager.decNumOfAllocatedBlocksThatAreFreeBy(1);
+    manager.decNumOfBytesInAllocatedBlocksThatAreFreeBy(next->getUserSize());
+    if (block->isFree())
+    {
+        manager.incNumOfBytesInAllocatedBlocksThatAreFreeBy(META_DATA_SIZE + next->getUserSize());
+    }
+}
+
+// merges a free block that isn't in a bin with its free physical neighbours, returns the merged block
+MallocMetadata* coalesce(MallocMetadata* block)
 {
-    if (size == 0 || size > MAX_SIZE)
+    MallocMetadata* next = block->getNext();
+    if (next != nullptr && next->isFree() && arePhysicalNeighbours(block, next))
+    {
+        manager.removeFreeBlock(next);
+        absorbNextBlock(block, next);
+    }
+    MallocMetadata* prev = block->getPrev();
+    if (prev != nullptr && prev->isFree() && arePhysicalNeighbours(prev, block))
     {
-        return NULL; //need to return NULL or nullptr?
+        manager.removeFreeBlock(prev);
+        // block is absorbed as a free block, and prev stays free
+        absorbNextBlock(prev, block);
+        block = prev;
     }
+    return block;
+}
 
+// cuts the unneeded end of a used block into a new free block, if it is big enough to be worth it
+void splitBlock(MallocMetadata* block, size_t size)
+{
+    size_t used_size = ALIGN_UP(size);
+    if (block->getUserSize() < used_size + META_DATA_SIZE + MIN_SPLIT_SIZE)
+    {
+        return;
+    }
+    MallocMetadata* remainder = (MallocMetadata*) ((char*)GET_USER_PTR(block) + used_size);
+    *remainder = MallocMetadata(block->getUserSize() - used_size - META_DATA_SIZE);
+    block->setUserSize(used_size);
+    remainder->setPrev(block);
+    remainder->setNext(block->getNext());
+    if (block->getNext() == nullptr)
+    {
+        manager.setTail(remainder);
+    }
+    else
+    {
+        block->getNext()->setPrev(remainder);
+    }
+    block->setNext(remainder);
+    // stats - a new block was made out of block's bytes, and it is free
+    manager.incNumOfAllocatedBlocksBy(1);
+    manager.decNumOfBytesInAllocatedBlocksBy(META_DATA_SIZE);
+    remainder->setIsFree(true);
+    manager.incNumOfAllocatedBlocksThatAreFreeBy(1);
+    manager.incNumOfBytesInAllocatedBlocksThatAreFreeBy(remainder->getUserSize());
+    manager.insertFreeBlock(coalesce(remainder));
+}
+
+// grows the block at the top of the heap in place. block's stats must already be counted
+bool growTopBlock(MallocMetadata* block, size_t size)
+{
+    size_t delta = size - block->getUserSize();
+    if (moveBreak(long(delta)) == SBRK_FAILED)
+    {
+        return false;
+    }
+    block->setUserSize(size);
+    manager.incNumOfBytesInAllocatedBlocksBy(delta);
+    if (block->isFree())
+    {
+        manager.incNumOfBytesInAllocatedBlocksThatAreFreeBy(delta);
+    }
+    return true;
+}
+
+// ~~~~~~~~~~~~~ fit engine ~~~~~~~~~~~~~~
+// the core has checked the size and the pointer already
+
+void* FitEngine::allocate(size_t size, int tag)
+{
+    (void) tag;
     MallocMetadata* block_to_use = lookForAvailableBlock(size);
-    if(block_to_use == nullptr)
+    MallocMetadata* tail = manager.getTail();
+    if(block_to_use == nullptr && tail != nullptr && tail->isFree() && isTopBlock(tail))
+    {
+        // the top block is free but too small - grow it instead of appending a new block
+        manager.removeFreeBlock(tail);
+        if(!growTopBlock(tail, size))
+        {
+            manager.insertFreeBlock(tail);
+            return NULL;
+        }
+        tail->setIsFree(false);
+        manager.decNumOfAllocatedBlocksThatAreFreeBy(1);
+        manager.decNumOfBytesInAllocatedBlocksThatAreFreeBy(size);
+        block_to_use = tail;
+    }
+    else if(block_to_use == nullptr)
     {
-        block_to_use = (MallocMetadata*) (sbrk(ALLOC_SIZE(size)));
+        block_to_use = (MallocMetadata*) (moveBreak(ALLOC_SIZE(size)));
         if(block_to_use == SBRK_FAILED)
         {
             return NULL;
@@ -189,56 +646,41 @@ void* smalloc(size_t size)
         }
 
         // add to stats - new block was allocated successfully
-        manager.incNumOfAllocatedBlocks();
+        manager.incNumOfAllocatedBlocksBy(1);
         manager.incNumOfBytesInAllocatedBlocksBy(size);
     }
     else
     {
+        manager.removeFreeBlock(block_to_use);
         block_to_use->setIsFree(false);
         // add to stats - free block was retaken
-        manager.decNumOfAllocatedBlocksThatAreFree();
+        manager.decNumOfAllocatedBlocksThatAreFreeBy(1);
         manager.decNumOfBytesInAllocatedBlocksThatAreFreeBy(block_to_use->getUserSize());
+        splitBlock(block_to_use, size);
     }
     return GET_USER_PTR(block_to_use);
 }
 
-void sfree(void* p)
+void FitEngine::free(void* p)
 {
-    if(p == NULL)
-    {
-        return;
-    }
     MallocMetadata* metadata = GET_METADATA(p);
     if (metadata->isFree()) return;
     metadata->setIsFree(true);
 
     // add stats - block was successfully freed
-    manager.incNumOfAllocatedBlocksThatAreFree();
+    manager.incNumOfAllocatedBlocksThatAreFreeBy(1);
     manager.incNumOfBytesInAllocatedBlocksThatAreFreeBy(metadata->getUserSize());
+    manager.insertFreeBlock(coalesce(metadata));
 }
 
-void* scalloc(size_t num, size_t size)
+void FitEngine::freeSized(void* p, size_t size)
 {
-    void *free_block = smalloc(num * size);
-    if (free_block == nullptr) {
-        return NULL;
-    }
-    std::memset(free_block, 0, num * size);
-    return free_block;
-    // relevant stats are added inside smalloc
+    (void) size;
+    this->free(p);
 }
 
-void* srealloc(void* oldp, size_t size)
+void* FitEngine::reallocate(void* oldp, size_t size)
 {
-    if (size == 0 || size > MAX_SIZE)
-    {
-        return NULL; //need to return NULL or nullptr?
-    }
-    if(oldp == NULL)
-    {
-        return smalloc(size); // stats were added inside smalloc for this case
-    }
-
     MallocMetadata* oldp_md = GET_METADATA(oldp);
     if (oldp_md->isFree())
     {
@@ -246,42 +688,94 @@ void* srealloc(void* oldp, size_t size)
     }
     if(oldp_md->getUserSize() >= size)
     {
-        // stats hasn't changed in this case
+        splitBlock(oldp_md, size); // stats changed only if the block was split
         return oldp;
     }
-    void* newp = smalloc(size); // changed stats according to the block that was created
+    MallocMetadata* next = oldp_md->getNext();
+    if(next != nullptr && next->isFree() && arePhysicalNeighbours(oldp_md, next) &&
+       oldp_md->getUserSize() + META_DATA_SIZE + next->getUserSize() >= size)
+    {
+        // grow into the free block right after us, the data stays where it is
+        manager.removeFreeBlock(next);
+        absorbNextBlock(oldp_md, next);
+        splitBlock(oldp_md, size);
+        return oldp;
+    }
+    if(isTopBlock(oldp_md))
+    {
+        return growTopBlock(oldp_md, size) ? oldp : NULL;
+    }
+    void* newp = heap.allocate(size, 0); // changed stats according to the block that was created
     if(newp == nullptr)
     {
         return NULL;
     }
     std::memmove(newp, oldp, oldp_md->getUserSize());
-    sfree(oldp); // stats has changed as part of free
+    heap.free(oldp); // stats has changed as part of free
     return newp;
 }
 
+// only asked with a large object layer, whose mappings can't be inside the heap's range
+bool FitEngine::owns(const void* p) const
+{
+    return manager.getHead() != nullptr && (const char*)p > (const char*)manager.getHead() &&
+           (const char*)p < (const char*)moveBreak(0);
+}
+
+void FitEngine::addStats(CoreStats* stats) const
+{
+    manager.addStats(stats, META_DATA_SIZE);
+}
+
+void* smalloc(size_t size)
+{
+    return heap.allocate(size, 0);
+}
+
+void sfree(void* p)
+{
+    heap.free(p);
+}
+
+void* scalloc(size_t num, size_t size)
+{
+    void *free_block = smalloc(num * size);
+    if (free_block == nullptr) {
+        return NULL;
+    }
+    std::memset(free_block, 0, num * size);
+    return free_block;
+    // relevant stats are added inside smalloc
+}
+
+void* srealloc(void* oldp, size_t size)
+{
+    return heap.reallocate(oldp, size, 0);
+}
+
 size_t _num_free_blocks()
 {
-    return manager.getNumOfAllocatedBlocksThatAreFree();
+    return heap.getNumOfFreeBlocks();
 }
 
 size_t _num_free_bytes()
 {
-    return manager.getNumOfBytesInAllocatedBlocksThatAreFree();
+    return heap.getNumOfFreeBytes();
 }
 
 size_t _num_allocated_blocks()
 {
-    return manager.getNumOfAllocatedBlocks();
+    return heap.getNumOfAllocatedBlocks();
 }
 
 size_t _num_allocated_bytes()
 {
-    return manager.getNumOfBytesInAllocatedBlocks();
+    return heap.getNumOfAllocatedBytes();
 }
 
 size_t _num_meta_data_bytes()
 {
-    return manager.getNumOfAllocatedBlocks() * META_DATA_SIZE;
+    return heap.getNumOfMetaDataBytes();
 }
 
 size_t _size_meta_data()
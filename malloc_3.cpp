@@ -1,31 +1,431 @@
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <ctime>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 #include <iostream>
 #include <cstring>
+#include <cstdarg>
 #include <cmath>
-#define SBRK_FAILED (void *) (-1)
-#define MAX_SIZE 100000000
+#include <algorithm>
+#include <new>
+#include "malloc_3.h"
+#include "trace_format.h"
+#include "allocator_core.h"
+#define MAX_SIZE SMALLOC_MAX_SIZE
+#if SMALLOC_MAX_SIZE != CORE_MAX_SIZE
+#error "the core checks sizes against CORE_MAX_SIZE"
+#endif
 #define META_DATA_SIZE sizeof(MallocMetadata)
 #define GET_METADATA(p) ((MallocMetadata *) ((p==nullptr)? nullptr:(char *) p - META_DATA_SIZE))
 #define GET_USER_PTR(p) ((void*)((char*)(p) + META_DATA_SIZE))
-#define MAX_ORDER 10
+#define MAX_ORDER SMALLOC_MAX_ORDER
 #define ALIGNMENT 4194304
 #define INIT_BLOCK_SIZE 131072
 #define NUM_OF_FREE_BLOCKS_AT_INIT 32
+#define BUDDY_CHUNK_SIZE (INIT_BLOCK_SIZE * NUM_OF_FREE_BLOCKS_AT_INIT)
 #define MINIMAL_BLOCK_SIZE 128
 #define MAXIMAL_BUDDY_BLOCK 131072
+#define DEFAULT_USER_ALIGNMENT 8
+// where the buddy chunks come from. every chunk is its own aligned mapping, anonymous or of the memfd's, or
+// it is cut from the program break (kept for benchmarking, those chunks are never given back)
+#ifndef BUDDY_CHUNK_BACKEND
+#define BUDDY_CHUNK_BACKEND CHUNK_BACKEND_MMAP
+#endif
+#define COOKIE_CHUNK_SHIFT 22 // log2(ALIGNMENT), blocks in the same 4MB chunk share a cookie key
+#define HARDENING_OFF 0      // no cookie checks
+#define HARDENING_BOUNDARY 1 // check only the header of the block the user passes to sfree / srealloc
+#define HARDENING_FULL 2     // also check every header touched while walking the lists
+#ifndef MALLOC_HARDENING
+#define MALLOC_HARDENING HARDENING_FULL
+#endif
+#define REGION_BLOCK_ORDER MAX_ORDER
+#define REGION_LARGE_ALLOCATION (MAXIMAL_BUDDY_BLOCK / 4)
+#define TRACE_BUFFER_RECORDS 4096
+#define TRACE_ID_TABLE_SIZE (1 << 21)
+#define PROFILE_DEFAULT_SAMPLE_BYTES (512 * 1024) // mean distance between samples, like tcmalloc's
+#define PROFILE_IDLE_RECHECK_BYTES (1 << 20) // while off, a thread looks whether it was turned on this often
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SKIP_FRAMES 1 // recordAllocation itself
+#define PROFILE_SAMPLE_TABLE_SIZE (1 << 16) // live samples, half full at most
+#define PROFILE_BUCKET_TABLE_SIZE (1 << 12) // distinct stacks
+#define PROFILE_ORDER_MMAP (-1)
+#define PERSISTENT_MAGIC 0x50485353 // "SSHP"
+#define PERSISTENT_VERSION 2 // 2: headers carry a tag
+#define PERSISTENT_MAX_CHUNKS 16
+#define PERSISTENT_HEADER_SIZE ALIGNMENT // keeps the chunks after it aligned, only its first page is ever written
+#define LATENCY_SMALLOC_BUDDY_HIT 0
+#define LATENCY_SMALLOC_BUDDY_SPLIT 1
+#define LATENCY_SMALLOC_MMAP 2
+#define LATENCY_SMALLOC_FAILED 3
+#define LATENCY_SCALLOC 4
+#define LATENCY_SFREE_MMAP 5
+#define LATENCY_SREALLOC_IN_PLACE 6
+#define LATENCY_SREALLOC_MERGE 7
+#define LATENCY_SREALLOC_MOVE 8
+#define LATENCY_SREALLOC_MMAP 9
+#define LATENCY_SFREE_BUDDY 10 // + merge depth, up to MAX_ORDER
+#define LATENCY_NUM_OF_PATHS (LATENCY_SFREE_BUDDY + MAX_ORDER + 1)
+#define LATENCY_NUM_OF_BUCKETS 40 // bucket i counts samples in [2^i, 2^(i+1))
+#define LATENCY_MAX_THREADS 64
+#define STAT_BUDDY_BLOCKS 0
+#define STAT_BUDDY_BYTES 1
+#define STAT_BUDDY_FREE_BLOCKS 2
+#define STAT_BUDDY_FREE_BYTES 3
+#define STAT_BUDDY_REQUESTED_BYTES 4
+#define STAT_BUDDY_GRANTED_BYTES 5
+#define STAT_MMAP_BLOCKS 6
+#define STAT_MMAP_BYTES 7
+#define STAT_MMAP_REQUESTED_BYTES 8
+#define STAT_MMAP_GRANTED_BYTES 9
+#define STAT_FREE_BLOCKS_IN_ORDER 10 // + order
+#define STAT_USED_BLOCKS_IN_ORDER (STAT_FREE_BLOCKS_IN_ORDER + MAX_ORDER + 1) // + order
+#define STAT_TAG_BLOCKS (STAT_USED_BLOCKS_IN_ORDER + MAX_ORDER + 1) // + tag, used blocks
+#define STAT_TAG_BYTES (STAT_TAG_BLOCKS + SMALLOC_MAX_TAGS)          // + tag, their requested bytes
+#define NUM_OF_STATS (STAT_TAG_BYTES + SMALLOC_MAX_TAGS)
+#define MAX_STATS_SHARDS 64
+#define STATS_POOL_CHUNK_SIZE (64 * 1024) // mapped at once for new shards, shards are never given back
+#define SHEAP_DUMP_BUFFER_SIZE 4096
+#define MAX_ARENAS 8 // one buddy arena per NUMA node, nodes past this share arenas
+#define NUMA_MPOL_PREFERRED 1 // from linux/mempolicy.h
+#define MAINTENANCE_DEFAULT_INTERVAL_MS 100
+#define MAINTENANCE_DEFAULT_CPU_BUDGET_US 1000       // per wakeup
+#define MAINTENANCE_DEFAULT_MMAP_CACHE_BYTES (16 << 20)
+#define MAINTENANCE_STEP_BLOCKS 64       // pending blocks merged per arena lock hold
+#define MAINTENANCE_MIN_RELEASE_ORDER 7  // 16KB blocks and up, smaller ones have few pages past the header
+#define FREE_LISTED 0   // in its order's list since the last maintenance pass
+#define FREE_IDLE 1     // was in the list in the last pass too, the next one releases it
+#define FREE_RELEASED 2 // its pages past the header were given back with madvise
+#define FREE_PENDING 3  // freed while merges are deferred, on its order's pending stack
+// whether freed mmap regions are kept for reuse, choose with -DLARGE_OBJECT_LAYER=LARGE_OBJECT_UNCACHED. cached
+// ones are retained up to the retain threshold, and up to the maintenance budget
+#ifndef LARGE_OBJECT_LAYER
+#define LARGE_OBJECT_LAYER LARGE_OBJECT_CACHED
+#endif
+#if LARGE_OBJECT_LAYER == LARGE_OBJECT_NONE
+#error "malloc_3 needs its mmap regions, no buddy block is bigger than MAXIMAL_BUDDY_BLOCK"
+#endif
+#ifndef SMALL_OBJECT_LAYER
+#define SMALL_OBJECT_LAYER SMALL_OBJECT_NONE
+#endif
+#define MMAP_RETAIN_THRESHOLD_MAX (32 << 20) // like glibc's mmap threshold on 64 bit
+#define MMAP_CHURN_NS 1000000000ull   // a region size freed again within this is churning
+#define MMAP_CHURN_SLOTS 16
+#define SMALLOC_MAX_PRESSURE_CALLBACKS 8
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // linux 5.14
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000 // linux 4.17, older kernels take it as a hint
+#endif
 
+// ~~~~~~~~~~~~~~~~~~~~~~~ LATENCY HISTOGRAMS ~~~~~~~~~~~~~~~~~~~
+// compiled in only with -DMALLOC_LATENCY_HISTOGRAMS. every public entry point opens a LATENCY_SCOPE, the code
+// below it names the path that was taken with LATENCY_PATH, and when the outermost scope closes its duration
+// goes to a log2 bucket of that path in the histogram of the calling thread.
+#ifdef MALLOC_LATENCY_HISTOGRAMS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LATENCY_UNIT "cycles"
+static inline uint64_t latencyNow()
+{
+    return __rdtsc();
+}
+#else
+#define LATENCY_UNIT "ns"
+static inline uint64_t latencyNow()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+// one per thread and on its own cache lines. a thread only ever adds to its own histogram (threads past
+// LATENCY_MAX_THREADS share the last one), the relaxed atomics just make concurrent dumps well defined
+struct alignas(64) LatencyHistogram
+{
+    std::atomic<uint64_t> counts[LATENCY_NUM_OF_PATHS][LATENCY_NUM_OF_BUCKETS];
+};
+
+static LatencyHistogram latency_histograms[LATENCY_MAX_THREADS];
+static std::atomic<int> num_of_latency_histograms(0);
+
+class LatencyScope
+{
+private:
+    struct ThreadState
+    {
+        int depth;
+        int path;
+        int merge_depth;
+        LatencyHistogram* histogram;
+    };
+    static thread_local ThreadState state;
+    uint64_t start;
+public:
+    explicit LatencyScope(int default_path);
+    ~LatencyScope();
+    static void setPath(int path);
+    static void noteMerge();
+};
+
+thread_local LatencyScope::ThreadState LatencyScope::state = {0, 0, 0, nullptr};
+
+LatencyScope::LatencyScope(int default_path): start(0)
+{
+    if (state.depth++ == 0)
+    {
+        state.path = default_path;
+        state.merge_depth = 0;
+        this->start = latencyNow();
+    }
+}
+
+LatencyScope::~LatencyScope()
+{
+    if (--state.depth != 0)
+    {
+        return;
+    }
+    uint64_t elapsed = latencyNow() - this->start;
+    if (state.histogram == nullptr)
+    {
+        int index = num_of_latency_histograms.fetch_add(1, std::memory_order_relaxed);
+        state.histogram = &latency_histograms[std::min(index, LATENCY_MAX_THREADS - 1)];
+    }
+    int path = state.path;
+    if (path == LATENCY_SFREE_BUDDY)
+    {
+        path += std::min(state.merge_depth, MAX_ORDER);
+    }
+    int bucket = (elapsed == 0) ? 0 : 63 - __builtin_clzll(elapsed);
+    bucket = std::min(bucket, LATENCY_NUM_OF_BUCKETS - 1);
+    state.histogram->counts[path][bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyScope::setPath(int path)
+{
+    // nested entry points (smalloc inside srealloc) keep the path of the outermost one
+    if (state.depth == 1)
+    {
+        state.path = path;
+    }
+}
+
+void LatencyScope::noteMerge()
+{
+    state.merge_depth++;
+}
+
+#define LATENCY_SCOPE(default_path) LatencyScope latency_scope(default_path)
+#define LATENCY_PATH(path) LatencyScope::setPath(path)
+#define LATENCY_NOTE_MERGE() LatencyScope::noteMerge()
+#else
+#define LATENCY_SCOPE(default_path)
+#define LATENCY_PATH(path)
+#define LATENCY_NOTE_MERGE()
+#endif
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ SHARDED STATISTICS ~~~~~~~~~~~~~~~~~~~
+// every thread owns one shard (a set of cache line aligned counters) while it runs, so updating statistics
+// never writes to a line another thread writes. a shard holds the changes its threads made, which may be
+// "negative" (a block freed by another thread than the one that allocated it) - the unsigned wrap around
+// cancels out once all shards are summed. threads beyond MAX_STATS_SHARDS share an overflow shard.
+// a ShardedStats only has the shards of the threads that updated it: a shard is mapped the first time
+// a thread with its index writes, so the memory follows the number of threads that ran at once
+static std::atomic<bool> stats_shard_in_use[MAX_STATS_SHARDS];
+// trivially destructible, so reading it is a plain TLS load without the init guard of the handle
+static thread_local int stats_shard_index = -1;
+
+class StatsShardHandle
+{
+private:
+    int index;
+public:
+    StatsShardHandle();
+    ~StatsShardHandle();
+    int getIndex() const;
+};
+
+StatsShardHandle::StatsShardHandle(): index(MAX_STATS_SHARDS)
+{
+    for (int i = 0; i < MAX_STATS_SHARDS; i++)
+    {
+        bool expected = false;
+        if (stats_shard_in_use[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+        {
+            this->index = i;
+            break;
+        }
+    }
+}
+
+StatsShardHandle::~StatsShardHandle()
+{
+    // the shard keeps its counts, the next thread to take it keeps adding to them. frees made later in this
+    // thread's exit (by other thread_local destructors) go to the overflow shard
+    if (this->index < MAX_STATS_SHARDS)
+    {
+        stats_shard_in_use[this->index].store(false, std::memory_order_release);
+    }
+    this->index = MAX_STATS_SHARDS;
+    stats_shard_index = MAX_STATS_SHARDS;
+}
+
+int StatsShardHandle::getIndex() const
+{
+    return this->index;
+}
+
+static int currentStatsShard()
+{
+    if (stats_shard_index < 0)
+    {
+        static thread_local StatsShardHandle handle;
+        stats_shard_index = handle.getIndex();
+    }
+    return stats_shard_index;
+}
+
+struct alignas(64) StatsShard
+{
+    std::atomic<size_t> counters[NUM_OF_STATS];
+};
+
+// the shards of every ShardedStats are cut from these chunks. fresh anonymous pages are zero, so a new
+// shard starts at 0 without being written
+static std::mutex stats_pool_lock;
+static char* stats_pool_next = nullptr;
+static char* stats_pool_end = nullptr;
+
+static StatsShard* takePoolShard()
+{
+    if (stats_pool_next == stats_pool_end)
+    {
+        void* chunk = mmap(nullptr, STATS_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+        {
+            exit(1); // no memory left for the allocator's own bookkeeping
+        }
+        stats_pool_next = static_cast<char*>(chunk);
+        stats_pool_end = stats_pool_next + STATS_POOL_CHUNK_SIZE / sizeof(StatsShard) * sizeof(StatsShard);
+    }
+    StatsShard* shard = reinterpret_cast<StatsShard*>(stats_pool_next);
+    stats_pool_next += sizeof(StatsShard);
+    return shard;
+}
+
+class ShardedStats
+{
+private:
+    // index MAX_STATS_SHARDS is the shared overflow shard. nullptr until a thread of that index writes
+    std::atomic<StatsShard*> shards[MAX_STATS_SHARDS + 1];
+
+    StatsShard* makeShard(int index);
+public:
+    ShardedStats();
+    ~ShardedStats() = default;
+    void add(int stat, size_t delta);
+    void sub(int stat, size_t delta);
+    size_t get(int stat) const;
+    void snapshot(size_t values[NUM_OF_STATS]) const;
+};
+
+ShardedStats::ShardedStats(): shards{} {}
+
+// under the pool lock, two threads sharing the overflow shard may both get here for it
+StatsShard* ShardedStats::makeShard(int index)
+{
+    std::lock_guard<std::mutex> guard(stats_pool_lock);
+    StatsShard* shard = this->shards[index].load(std::memory_order_acquire);
+    if (shard == nullptr)
+    {
+        shard = takePoolShard();
+        this->shards[index].store(shard, std::memory_order_release);
+    }
+    return shard;
+}
+
+void ShardedStats::add(int stat, size_t delta)
+{
+    int index = currentStatsShard();
+    StatsShard* shard = this->shards[index].load(std::memory_order_acquire);
+    if (shard == nullptr)
+    {
+        shard = this->makeShard(index);
+    }
+    std::atomic<size_t>& counter = shard->counters[stat];
+    if (index == MAX_STATS_SHARDS)
+    {
+        counter.fetch_add(delta, std::memory_order_relaxed);
+        return;
+    }
+    // the owning thread is the only writer, a plain load and store is enough
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void ShardedStats::sub(int stat, size_t delta)
+{
+    this->add(stat, -delta);
+}
+
+size_t ShardedStats::get(int stat) const
+{
+    size_t sum = 0;
+    for (const std::atomic<StatsShard*>& shard : this->shards)
+    {
+        const StatsShard* counters = shard.load(std::memory_order_acquire);
+        if (counters != nullptr)
+        {
+            sum += counters->counters[stat].load(std::memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+void ShardedStats::snapshot(size_t values[NUM_OF_STATS]) const
+{
+    for (int stat = 0; stat < NUM_OF_STATS; stat++)
+    {
+        values[stat] = 0;
+    }
+    for (const std::atomic<StatsShard*>& shard : this->shards)
+    {
+        const StatsShard* counters = shard.load(std::memory_order_acquire);
+        if (counters == nullptr)
+        {
+            continue;
+        }
+        for (int stat = 0; stat < NUM_OF_STATS; stat++)
+        {
+            values[stat] += counters->counters[stat].load(std::memory_order_relaxed);
+        }
+    }
+}
 
 class MallocMetadata
 {
 private:
-    int cookie;
-    size_t total_block_size;
+    int cookie; // the chunk's key xored with the block size, see getCookieKey
     bool is_free;
+    uint8_t free_state; // FREE_*, only meaningful while the buddy block is free
+    bool is_sampled; // the heap profiler holds a sample of it, sfree drops it
+    uint8_t tag; // whose it is, see smalloc_set_tag
+    uint32_t requested_size; // what the user asked for, fits in the padding so the header stays 40 bytes
+    size_t total_block_size;
     MallocMetadata* next;
     MallocMetadata* prev;
 
-    MallocMetadata(int cookie, size_t size, bool is_free);
+    MallocMetadata(int key, size_t size, bool is_free);
+    static int foldSize(size_t size);
     friend class BuddyAllocator;
     friend class MMapAllocator;
 public:
@@ -38,14 +438,34 @@ public:
     MallocMetadata* getPrev();
     void setIsFree(bool new_is_free);
     bool isFree() const;
+    void setRequestedSize(size_t size);
+    size_t getRequestedSize() const;
+    void setFreeState(uint8_t state);
+    uint8_t getFreeState() const;
+    void setIsSampled(bool new_is_sampled);
+    bool isSampled() const;
+    void setTag(uint8_t new_tag);
+    uint8_t getTag() const;
+    bool isSealedWith(int key) const;
 };
 
-MallocMetadata::MallocMetadata(int cookie, size_t size, bool is_free):
-cookie(cookie), total_block_size(size), is_free(is_free), next(nullptr), prev(nullptr){}
+MallocMetadata::MallocMetadata(int key, size_t size, bool is_free):
+cookie(key ^ foldSize(size)), is_free(is_free), free_state(FREE_LISTED), is_sampled(false), tag(0), requested_size(0), total_block_size(size), next(nullptr), prev(nullptr){}
 
+int MallocMetadata::foldSize(size_t size)
+{
+    return static_cast<int>(static_cast<uint32_t>(size) ^ static_cast<uint32_t>(uint64_t(size) >> 32));
+}
+
+bool MallocMetadata::isSealedWith(int key) const
+{
+    return this->cookie == (key ^ foldSize(this->total_block_size));
+}
 
 void MallocMetadata::setBlockSize(size_t size)
 {
+    // swap the old size out of the cookie and the new one in, the key isn't needed for that
+    this->cookie ^= foldSize(this->total_block_size) ^ foldSize(size);
     this->total_block_size = size;
 }
 size_t MallocMetadata::getBlockSize() const
@@ -83,6 +503,169 @@ bool MallocMetadata::isFree() const
     return this->is_free;
 }
 
+void MallocMetadata::setRequestedSize(size_t size)
+{
+    this->requested_size = static_cast<uint32_t>(size);
+}
+
+size_t MallocMetadata::getRequestedSize() const
+{
+    return this->requested_size;
+}
+
+void MallocMetadata::setFreeState(uint8_t state)
+{
+    this->free_state = state;
+}
+
+uint8_t MallocMetadata::getFreeState() const
+{
+    return this->free_state;
+}
+
+void MallocMetadata::setIsSampled(bool new_is_sampled)
+{
+    this->is_sampled = new_is_sampled;
+}
+
+bool MallocMetadata::isSampled() const
+{
+    return this->is_sampled;
+}
+
+void MallocMetadata::setTag(uint8_t new_tag)
+{
+    this->tag = new_tag;
+}
+
+uint8_t MallocMetadata::getTag() const
+{
+    return this->tag;
+}
+
+// ~~~~~~~~~~~~~ header integrity ~~~~~~~~~~~~~~
+// a cookie is one xor away from the header fields it protects: an overflow that rewrites the size or
+// the cookie is caught, and so is a header copied into another chunk, since every 4MB chunk has its own key
+
+static int getCookieKey(int key, const void* block)
+{
+    return key ^ static_cast<int>(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(block) >> COOKIE_CHUNK_SHIFT));
+}
+
+static inline void checkCookie(const MallocMetadata* md, int key)
+{
+    if (md != nullptr && !md->isSealedWith(getCookieKey(key, md)))
+    {
+        exit(0xdeadbeef);
+    }
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ NUMA ~~~~~~~~~~~~~~~~~~~
+// no libnuma, the three calls we need go straight to the kernel
+
+// the highest online node + 1, from /sys/devices/system/node/online ("0", "0-1", "0,2-3"...). 1 if unknown
+static int readNumOfNumaNodes()
+{
+    char buffer[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd < 0)
+    {
+        return 1;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return 1;
+    }
+    buffer[length] = '\0';
+    int highest_node = 0;
+    int number = 0;
+    for (ssize_t i = 0; i <= length; i++)
+    {
+        if (buffer[i] >= '0' && buffer[i] <= '9')
+        {
+            number = number * 10 + (buffer[i] - '0');
+        }
+        else
+        {
+            highest_node = std::max(highest_node, number);
+            number = 0;
+        }
+    }
+    return highest_node + 1;
+}
+
+static int currentNumaNode()
+{
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    {
+        return 0;
+    }
+    return static_cast<int>(node);
+}
+
+// preferred and not strictly bound, so a full node falls back to another one instead of failing.
+// if mbind isn't allowed (containers, old kernels) first touch places the pages, as before
+static void bindToNumaNode(void* address, size_t length, int node)
+{
+    unsigned long node_mask = 1UL << node;
+    syscall(SYS_mbind, address, length, NUMA_MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8, 0);
+}
+
+static size_t roundUpToPage(size_t size)
+{
+    return (size + getPageSize() - 1) & ~(getPageSize() - 1);
+}
+
+static uint64_t monotonicNs()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ THE CORE ~~~~~~~~~~~~~~~~~~~
+// the buddy arenas are the core's mid engine and the mmap regions its large layer, both implemented with
+// malloc, free and realloc further down. the page source maps the buddy chunks. a small object layer, if one
+// is built in, serves sizes up to SLAB_MAX_SIZE without tags, samples or a place in the heap walk
+
+class BuddyEngine
+{
+public:
+    static const size_t MAX_REQUEST = MAXIMAL_BUDDY_BLOCK - sizeof(MallocMetadata);
+    constexpr BuddyEngine() {}
+    void* allocate(size_t size, int tag);
+    void free(void* p);
+    void freeSized(void* p, size_t size);
+    void* reallocate(void* oldp, size_t size);
+    size_t expand(void* p, size_t min_size, size_t preferred_size);
+    bool owns(const void* p) const;
+    void addStats(CoreStats* stats) const;
+};
+
+class MMapRegions
+{
+public:
+    static const bool ENABLED = true;
+    constexpr MMapRegions() {}
+    void* allocate(size_t size, int tag);
+    void free(void* p);
+    void freeSized(void* p, size_t size);
+    void* reallocate(void* oldp, size_t size);
+    size_t expand(void* p, size_t min_size, size_t preferred_size);
+    void addStats(CoreStats* stats) const;
+};
+
+class SlabGrowth; // the heap limits, see HeapGrowth
+
+typedef PageSourceOf<BUDDY_CHUNK_BACKEND>::type ChunkPageSource;
+typedef AllocatorCore<ChunkPageSource, SmallObjectsOf<SMALL_OBJECT_LAYER, ChunkPageSource, SlabGrowth>::type,
+                      BuddyEngine, MMapRegions> HeapCore;
+
+extern HeapCore heap;
 
 class BuddyAllocator
 {
@@ -91,14 +674,16 @@ private:
     MallocMetadata* ordersArray[MAX_ORDER+1];
     bool is_first_allocation;
     intptr_t free_blocks_start_address;
-    intptr_t offset;
-    size_t num_of_allocated_blocks; // = num_of_meta_data_blocks
-    size_t num_of_bytes_in_allocated_blocks;
-    size_t num_of_allocated_blocks_that_are_free;
-    size_t num_of_bytes_in_allocated_blocks_that_are_free;
+    ShardedStats* stats;
+    int numa_node; // the chunk's, -1 if it isn't bound
+    bool is_populated; // the chunk was mapped with MAP_POPULATE, prefault has nothing left to do
+    // while the maintenance thread runs, freed blocks go on these stacks unmerged and the thread merges them
+    MallocMetadata* pending[MAX_ORDER+1];
+    bool defer_merges;
 
-    explicit BuddyAllocator(int cookie);
+    BuddyAllocator(int cookie, ShardedStats* stats);
     friend class MemoryManager;
+    friend class Arena;
 public:
     ~BuddyAllocator() = default; // should we do here sbrk in order to delete all the space we allocated? return the pointer to where it was before? no  - no need to narrow down
                                 //might be a problem because someone might allocate after it
@@ -111,12 +696,25 @@ public:
     static size_t convertOrderToSize(int order);
 
     // ~~~~~~~~~~~~~ methods for malloc ~~~~~~~~~~~~~~
-    void initFirstFreeBlocks();
+    void initFirstFreeBlocks(int numa_node, bool populate);
+    bool reserveChunk(int numa_node, bool populate);
+#if BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK
+    bool reserveReleasedChunk();
+#endif
+    void layoutChunk(intptr_t chunk_start);
+    bool isValidPersistentChunk(intptr_t chunk_start, int old_cookie, intptr_t old_chunk_start) const;
+    void adoptChunk(intptr_t chunk_start);
+    void detachChunk();
+#if BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK
+    bool releaseChunkIfFree();
+#endif
     bool isFreeBlockInOrder(int order);
     MallocMetadata* removeFreeBlockFromStartOfOrder(int order);
     MallocMetadata* splitBlock(MallocMetadata *block_to_split);
     void insertBlockToOrder(MallocMetadata *block, int order);
     MallocMetadata* recFreeBlockLookup(int current_order, int desired_order);
+    MallocMetadata* allocateBlock(int order, size_t requested_size, uint8_t tag);
+    void freeBlock(MallocMetadata* block, int order);
 
     // ~~~~~~~~~~~~~ methods for free ~~~~~~~~~~~~~~
     MallocMetadata* getBuddyBlock(MallocMetadata *block, int current_order);
@@ -127,6 +725,7 @@ public:
     //MallocMetadata* recMergeBuddyBlocks2(MallocMetadata *block, int block_order, int requested_order);
     bool canReallocByMerging(MallocMetadata *block, int block_order, int requested_order);
     void* reallocByMerging(MallocMetadata *block, int block_order, int requested_order, void *oldp, size_t size_to_copy);
+    int getInPlaceOrder(MallocMetadata *block, int block_order, int max_order);
 
     // ~~~~~~~~~~~~~ statistic related ~~~~~~~~~~~~~~
     size_t getNumOfAllocatedBlocks() const;
@@ -141,14 +740,34 @@ public:
     size_t getNumOfBytesInAllocatedBlocksThatAreFree() const;
     void incNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes);
     void decNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes);
+    void accountUsedBlock(MallocMetadata* block, int order, size_t requested_size, uint8_t tag);
+    void unaccountUsedBlock(MallocMetadata* block, int order);
+    void fillFragmentationStats(smalloc_fragmentation_stats* stats) const;
+
+    // ~~~~~~~~~~~~~ warm start related ~~~~~~~~~~~~~~
+    void prefault(int mode) const;
+    bool presplit(int order, size_t num_of_blocks);
+
+    // ~~~~~~~~~~~~~ heap walk related ~~~~~~~~~~~~~~
+    intptr_t getChunkStart() const;
+    MallocMetadata* getFreeListHead(int order) const;
+    bool isValidBlock(const MallocMetadata* md, intptr_t chunk_start) const;
+    size_t walkBlocks(sheap_walk_callback callback, void* arg) const;
+
+    // ~~~~~~~~~~~~~ maintenance related ~~~~~~~~~~~~~~
+    void setDeferMerges(bool defer);
+    void pushPendingBlock(MallocMetadata* block, int order);
+    MallocMetadata* popPendingBlock(int order);
+    size_t mergePendingBlocks(size_t max_blocks);
+    size_t releaseIdleBlocks(size_t* released_bytes);
 
     void checkOverFlow(MallocMetadata* md) const;
 };
 
-BuddyAllocator::BuddyAllocator(int cookie) : cookie(cookie),ordersArray{}, is_first_allocation(true), free_blocks_start_address(0), offset(0),
-                                   num_of_allocated_blocks(0),
-                                   num_of_bytes_in_allocated_blocks(0), num_of_allocated_blocks_that_are_free(0),
-                                   num_of_bytes_in_allocated_blocks_that_are_free(0){
+BuddyAllocator::BuddyAllocator(int cookie, ShardedStats* stats) : cookie(cookie),ordersArray{}, is_first_allocation(true),
+                                   free_blocks_start_address(0), stats(stats), numa_node(-1),
+                                   is_populated(false), pending{},
+                                   defer_merges(false){
 }
 
 // ~~~~~~~~~~~ getters and setters ~~~~~~~~~~~~~~
@@ -186,22 +805,49 @@ size_t BuddyAllocator::convertOrderToSize(int order)
 
 // ~~~~~~~~~~~~~ methods for malloc ~~~~~~~~~~~~~~
 
-void BuddyAllocator::initFirstFreeBlocks()
+// numa_node is the node the chunk is bound to, or -1 to leave it to first touch. populate asks for the chunk
+// to be faulted in as it is mapped (SMALLOC_PREFAULT_POPULATE)
+void BuddyAllocator::initFirstFreeBlocks(int numa_node, bool populate)
 {
-    void* current_brk = sbrk(0);
-    auto current_address = reinterpret_cast<intptr_t>(current_brk);
-    this->free_blocks_start_address = current_address + (ALIGNMENT - (current_address % ALIGNMENT)) % ALIGNMENT;
-    this->offset = this->free_blocks_start_address - current_address;
-    void* return_value = sbrk(offset + INIT_BLOCK_SIZE * NUM_OF_FREE_BLOCKS_AT_INIT);
-    if(return_value == SBRK_FAILED)
+    if (!this->reserveChunk(numa_node, populate))
     {
         exit(1); //TODO: what to do in this case?
     }
+}
+
+// takes a new chunk and lays it out as NUM_OF_FREE_BLOCKS_AT_INIT free blocks of MAX_ORDER. only an mmapped
+// chunk that isn't bound to a node can be populated as it is mapped, the pages of a bound one have to wait
+// for the binding (prefault does them then). sbrk has no such flag
+bool BuddyAllocator::reserveChunk(int numa_node, bool populate)
+{
+    populate = populate && numa_node < 0 && BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK;
+    void* chunk = heap.getPageSource()->mapChunk(BUDDY_CHUNK_SIZE, ALIGNMENT, populate);
+    if (chunk == nullptr)
+    {
+        return false;
+    }
+    auto chunk_start = reinterpret_cast<intptr_t>(chunk);
+    this->numa_node = numa_node;
+    this->is_populated = populate;
+    if (numa_node >= 0)
+    {
+        // before the headers touch the pages
+        bindToNumaNode(reinterpret_cast<void*>(chunk_start), BUDDY_CHUNK_SIZE, numa_node);
+    }
+    this->layoutChunk(chunk_start);
+    return true;
+}
+
+// lays chunk_start out as NUM_OF_FREE_BLOCKS_AT_INIT free blocks of MAX_ORDER
+void BuddyAllocator::layoutChunk(intptr_t chunk_start)
+{
+    // atomic, getArenaOf reads it without the arena lock
+    __atomic_store_n(&this->free_blocks_start_address, chunk_start, __ATOMIC_RELEASE);
     MallocMetadata* prev = nullptr;
     for (int i = 0; i < NUM_OF_FREE_BLOCKS_AT_INIT ; i++)
     {
         auto* MD = reinterpret_cast<MallocMetadata*>(reinterpret_cast<char*>(this->free_blocks_start_address) + i*INIT_BLOCK_SIZE);
-        *MD = MallocMetadata(this->cookie,INIT_BLOCK_SIZE, true);
+        *MD = MallocMetadata(getCookieKey(this->cookie, MD),INIT_BLOCK_SIZE, true);
         //this->checkOverFlow(MD);
         //this->checkOverFlow(prev);
         MD->setPrev(prev);
@@ -221,42 +867,175 @@ void BuddyAllocator::initFirstFreeBlocks()
         }
     }
     this->is_first_allocation = false;
+    this->stats->add(STAT_FREE_BLOCKS_IN_ORDER + MAX_ORDER, NUM_OF_FREE_BLOCKS_AT_INIT);
     incNumOfAllocatedBlocksBy(NUM_OF_FREE_BLOCKS_AT_INIT);
     incNumOfBytesInAllocatedBlocksBy(NUM_OF_FREE_BLOCKS_AT_INIT* (INIT_BLOCK_SIZE - META_DATA_SIZE));
     incNumOfAllocatedBlocksThatAreFreeBy(NUM_OF_FREE_BLOCKS_AT_INIT);
     incNumOfBytesInAllocatedBlocksThatAreFreeBy(NUM_OF_FREE_BLOCKS_AT_INIT* (INIT_BLOCK_SIZE - META_DATA_SIZE));
 }
 
-bool BuddyAllocator::isFreeBlockInOrder(int order)
+// ~~~~~~~~~~~~~ persistent chunks ~~~~~~~~~~~~~~
+// a chunk of the persistent heap was sealed by an earlier process, with its key and where it had the chunk
+// mapped. every header has to carry the cookie it was given there, and the block sizes have to tile the chunk
+bool BuddyAllocator::isValidPersistentChunk(intptr_t chunk_start, int old_cookie, intptr_t old_chunk_start) const
 {
-    //this->checkOverFlow(this->ordersArray[order]);
-    return (this->ordersArray[order] != nullptr);
+    intptr_t curr = chunk_start;
+    while (curr < chunk_start + BUDDY_CHUNK_SIZE)
+    {
+        auto* md = reinterpret_cast<const MallocMetadata*>(curr);
+        auto* old_md = reinterpret_cast<const void*>(old_chunk_start + (curr - chunk_start));
+        size_t size = md->total_block_size;
+        if (!md->isSealedWith(getCookieKey(old_cookie, old_md)) || md->tag >= SMALLOC_MAX_TAGS || size < MINIMAL_BLOCK_SIZE ||
+            size > MAXIMAL_BUDDY_BLOCK || (size & (size - 1)) != 0 || (curr - chunk_start) % size != 0)
+        {
+            return false;
+        }
+        curr += size;
+    }
+    return true;
 }
 
-MallocMetadata* BuddyAllocator::removeFreeBlockFromStartOfOrder(int order)
+// takes over a valid persistent chunk: every header is sealed again for this process and the free lists
+// and stats are rebuilt by walking the block sizes, so no link from the last process is followed. the walk
+// goes up the chunk, so appending keeps the lists sorted. blocks that were freed while merges were deferred
+// may still have a free buddy, they go through the pending stacks and get merged here
+void BuddyAllocator::adoptChunk(intptr_t chunk_start)
 {
-    //this->checkOverFlow(this->ordersArray[order]);
-    MallocMetadata* block_to_return = this->ordersArray[order];
-    if (block_to_return == nullptr)
+    MallocMetadata* tails[MAX_ORDER+1] = {};
+    intptr_t curr = chunk_start;
+    while (curr < chunk_start + BUDDY_CHUNK_SIZE)
     {
-        return nullptr; // there are not any free blocks in this order
+        auto* md = reinterpret_cast<MallocMetadata*>(curr);
+        size_t size = md->total_block_size;
+        int order = convertSizeToOrder(size);
+        md->cookie = getCookieKey(this->cookie, md) ^ MallocMetadata::foldSize(size);
+        md->is_sampled = false;
+        md->setNext(nullptr);
+        md->setPrev(nullptr);
+        this->incNumOfAllocatedBlocksBy(1);
+        this->incNumOfBytesInAllocatedBlocksBy(size - META_DATA_SIZE);
+        if (!md->isFree())
+        {
+            this->accountUsedBlock(md, order, md->getRequestedSize(), md->getTag());
+        }
+        else if (md->getFreeState() == FREE_PENDING)
+        {
+            this->pushPendingBlock(md, order);
+        }
+        else
+        {
+            md->setPrev(tails[order]);
+            if (tails[order] == nullptr)
+            {
+                this->ordersArray[order] = md;
+            }
+            else
+            {
+                tails[order]->setNext(md);
+            }
+            tails[order] = md;
+            this->stats->add(STAT_FREE_BLOCKS_IN_ORDER + order, 1);
+            this->incNumOfAllocatedBlocksThatAreFreeBy(1);
+            this->incNumOfBytesInAllocatedBlocksThatAreFreeBy(size - META_DATA_SIZE);
+        }
+        curr += size;
     }
-    this->checkOverFlow(block_to_return);
-    this->checkOverFlow(block_to_return->getNext());
-    this->ordersArray[order] = block_to_return->getNext();
-    //this->checkOverFlow(this->ordersArray[order]);
-    if (this->ordersArray[order] != nullptr)
+    __atomic_store_n(&this->free_blocks_start_address, chunk_start, __ATOMIC_RELEASE);
+    this->is_first_allocation = false;
+    this->mergePendingBlocks(SIZE_MAX);
+}
+
+// forgets the chunk (the persistent heap is being unmapped), its stats go back to zero
+void BuddyAllocator::detachChunk()
+{
+    size_t values[NUM_OF_STATS];
+    this->stats->snapshot(values);
+    for (int stat = 0; stat < NUM_OF_STATS; stat++)
     {
-        //this->checkOverFlow(this->ordersArray[order]);
-        (this->ordersArray[order])->setPrev(nullptr);
+        this->stats->sub(stat, values[stat]);
     }
-    //this->checkOverFlow(block_to_return);
-    block_to_return->setNext(nullptr);
+    for (int order = 0; order <= MAX_ORDER; order++)
+    {
+        this->ordersArray[order] = nullptr;
+        this->pending[order] = nullptr;
+    }
+    __atomic_store_n(&this->free_blocks_start_address, intptr_t(0), __ATOMIC_RELEASE);
+    this->is_first_allocation = true;
+}
 
-    //update stats: act as the block is not allocated at all
-    this->decNumOfAllocatedBlocksBy(1);
-    //this->checkOverFlow(block_to_return);
-    this->decNumOfBytesInAllocatedBlocksBy(block_to_return->getBlockSize()-META_DATA_SIZE);
+#if BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK
+// unmaps the chunk if no block in it is used. the arena keeps working: its next allocation finds no free
+// block and maps a new chunk (see reserveReleasedChunk), so this costs nothing on the way to the lists
+bool BuddyAllocator::releaseChunkIfFree()
+{
+    if (this->is_first_allocation)
+    {
+        return false;
+    }
+    this->mergePendingBlocks(SIZE_MAX);
+    size_t num_of_free_blocks = 0;
+    for (MallocMetadata* curr = this->ordersArray[MAX_ORDER]; curr != nullptr; curr = curr->getNext())
+    {
+        num_of_free_blocks++;
+    }
+    if (num_of_free_blocks != NUM_OF_FREE_BLOCKS_AT_INIT)
+    {
+        return false;
+    }
+    void* chunk = reinterpret_cast<void*>(this->free_blocks_start_address);
+    if (!heap.getPageSource()->unmapChunk(chunk, BUDDY_CHUNK_SIZE))
+    {
+        exit(1);
+    }
+    this->ordersArray[MAX_ORDER] = nullptr;
+    __atomic_store_n(&this->free_blocks_start_address, intptr_t(0), __ATOMIC_RELEASE);
+    this->is_first_allocation = true;
+    this->stats->sub(STAT_FREE_BLOCKS_IN_ORDER + MAX_ORDER, NUM_OF_FREE_BLOCKS_AT_INIT);
+    decNumOfAllocatedBlocksBy(NUM_OF_FREE_BLOCKS_AT_INIT);
+    decNumOfBytesInAllocatedBlocksBy(NUM_OF_FREE_BLOCKS_AT_INIT* (INIT_BLOCK_SIZE - META_DATA_SIZE));
+    decNumOfAllocatedBlocksThatAreFreeBy(NUM_OF_FREE_BLOCKS_AT_INIT);
+    decNumOfBytesInAllocatedBlocksThatAreFreeBy(NUM_OF_FREE_BLOCKS_AT_INIT* (INIT_BLOCK_SIZE - META_DATA_SIZE));
+    return true;
+}
+
+// for an allocation that found no block: false unless the chunk was released and a new one is mapped
+bool BuddyAllocator::reserveReleasedChunk()
+{
+    return this->is_first_allocation && this->reserveChunk(this->numa_node, false);
+}
+#endif
+
+bool BuddyAllocator::isFreeBlockInOrder(int order)
+{
+    //this->checkOverFlow(this->ordersArray[order]);
+    return (this->ordersArray[order] != nullptr);
+}
+
+MallocMetadata* BuddyAllocator::removeFreeBlockFromStartOfOrder(int order)
+{
+    //this->checkOverFlow(this->ordersArray[order]);
+    MallocMetadata* block_to_return = this->ordersArray[order];
+    if (block_to_return == nullptr)
+    {
+        return nullptr; // there are not any free blocks in this order
+    }
+    this->checkOverFlow(block_to_return);
+    this->checkOverFlow(block_to_return->getNext());
+    this->ordersArray[order] = block_to_return->getNext();
+    //this->checkOverFlow(this->ordersArray[order]);
+    if (this->ordersArray[order] != nullptr)
+    {
+        //this->checkOverFlow(this->ordersArray[order]);
+        (this->ordersArray[order])->setPrev(nullptr);
+    }
+    //this->checkOverFlow(block_to_return);
+    block_to_return->setNext(nullptr);
+    this->stats->sub(STAT_FREE_BLOCKS_IN_ORDER + order, 1);
+
+    //update stats: act as the block is not allocated at all
+    this->decNumOfAllocatedBlocksBy(1);
+    //this->checkOverFlow(block_to_return);
+    this->decNumOfBytesInAllocatedBlocksBy(block_to_return->getBlockSize()-META_DATA_SIZE);
     this->decNumOfAllocatedBlocksThatAreFreeBy(1);
     //this->checkOverFlow(block_to_return);
     this->decNumOfBytesInAllocatedBlocksThatAreFreeBy(block_to_return->getBlockSize()-META_DATA_SIZE);
@@ -276,7 +1055,7 @@ MallocMetadata* BuddyAllocator::splitBlock(MallocMetadata* block_to_split)
     //this->checkOverFlow(block_to_split);
     block_to_split->setBlockSize(new_size);
     auto* second_block = reinterpret_cast<MallocMetadata*>(reinterpret_cast<char*>(block_to_split) + new_size); // don't sure that it's ok
-    *second_block = MallocMetadata(this->cookie,new_size, true);
+    *second_block = MallocMetadata(getCookieKey(this->cookie, second_block),new_size, true);
     //second_block->setBlockSize(new_size);
 
     //update stats
@@ -361,7 +1140,9 @@ void BuddyAllocator::insertBlockToOrder(MallocMetadata* block, int order)
     }
     //this->checkOverFlow(block);
     block->setIsFree(true);
+    block->setFreeState(FREE_LISTED);
     // update stats
+    this->stats->add(STAT_FREE_BLOCKS_IN_ORDER + order, 1);
     this->incNumOfAllocatedBlocksThatAreFreeBy(1);
     //this->checkOverFlow(block);
     this->incNumOfBytesInAllocatedBlocksThatAreFreeBy(block->getBlockSize()-META_DATA_SIZE);
@@ -378,6 +1159,7 @@ MallocMetadata* BuddyAllocator::recFreeBlockLookup(int current_order, int desire
         MallocMetadata* block_to_split = this->removeFreeBlockFromStartOfOrder(current_order); // update stats
         if (current_order != desired_order)
         {
+            LATENCY_PATH(LATENCY_SMALLOC_BUDDY_SPLIT);
             //this->checkOverFlow(block_to_split);
             MallocMetadata* second_block = splitBlock(block_to_split); // block_to_split becomes the first block
             //this->checkOverFlow(second_block);
@@ -414,6 +1196,42 @@ MallocMetadata* BuddyAllocator::recFreeBlockLookup(int current_order, int desire
 
 }
 
+MallocMetadata* BuddyAllocator::allocateBlock(int order, size_t requested_size, uint8_t tag)
+{
+    // a block freed with its merge deferred is the cheapest one to reuse
+    MallocMetadata* block = this->popPendingBlock(order);
+    if (block == nullptr)
+    {
+        block = this->recFreeBlockLookup(order, order);
+    }
+    if (block == nullptr && this->mergePendingBlocks(SIZE_MAX) > 0)
+    {
+        // the merges may have made a big enough block, try them before failing
+        block = this->recFreeBlockLookup(order, order);
+    }
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+    // update fields of block - size should already be updated
+    block->setIsFree(false);
+    block->setNext(nullptr);
+    block->setPrev(nullptr);
+    this->accountUsedBlock(block, order, requested_size, tag);
+    return block;
+}
+
+void BuddyAllocator::freeBlock(MallocMetadata* block, int order)
+{
+    this->unaccountUsedBlock(block, order);
+    if (this->defer_merges)
+    {
+        this->pushPendingBlock(block, order);
+        return;
+    }
+    this->recMergeBuddyBlocks(block, order);
+}
+
 // ~~~~~~~~~~~~~ methods for free ~~~~~~~~~~~~~~
 MallocMetadata* BuddyAllocator::getBuddyBlock(MallocMetadata* block, int current_order)
 {
@@ -477,6 +1295,7 @@ MallocMetadata* BuddyAllocator::mergeBuddies(MallocMetadata* block, MallocMetada
     }
 
     //2. update stats
+    this->stats->sub(STAT_FREE_BLOCKS_IN_ORDER + current_order, 1);
     this->decNumOfAllocatedBlocksThatAreFreeBy(1); // in recMerge - buddy and block was free and now merged is free. in relloc - only buddy was free and merged is not free
     //this->checkOverFlow(buddy);
     this->decNumOfBytesInAllocatedBlocksThatAreFreeBy(buddy->getBlockSize()-META_DATA_SIZE); // only the buddy
@@ -525,6 +1344,7 @@ void BuddyAllocator::recMergeBuddyBlocks(MallocMetadata* block, int current_orde
     //this->checkOverFlow(block);
     //this->checkOverFlow(buddy_block);
     MallocMetadata* merged_block = mergeBuddies(block, buddy_block, current_order);
+    LATENCY_NOTE_MERGE();
     //this->checkOverFlow(merged_block);
     merged_block->setIsFree(true);
     //this->checkOverFlow(merged_block);
@@ -578,72 +1398,327 @@ void* BuddyAllocator::reallocByMerging(MallocMetadata* block, int block_order, i
     return reallocByMerging(merged_block, block_order + 1, requested_order, oldp, size_to_copy);
 }
 
+// the highest order up to max_order block can grow to without moving: at every order on the way it has to be
+// the lower buddy, and its buddy free. reallocByMerging up to it then keeps the header where it is
+int BuddyAllocator::getInPlaceOrder(MallocMetadata* block, int block_order, int max_order)
+{
+    while (block_order < max_order)
+    {
+        MallocMetadata* buddy_block = getBuddyBlock(block, block_order);
+        if (buddy_block == nullptr || buddy_block < block)
+        {
+            break;
+        }
+        block_order++;
+    }
+    return block_order;
+}
+
 // ~~~~~~~~~~~~~ statistic related ~~~~~~~~~~~~~~
 
 size_t BuddyAllocator::getNumOfAllocatedBlocks() const
 {
-    return this->num_of_allocated_blocks;
+    return this->stats->get(STAT_BUDDY_BLOCKS);
 }
 
 void BuddyAllocator::incNumOfAllocatedBlocksBy(size_t num_of_blocks)
 {
-    this->num_of_allocated_blocks += num_of_blocks;
+    this->stats->add(STAT_BUDDY_BLOCKS, num_of_blocks);
 }
 
 void BuddyAllocator::decNumOfAllocatedBlocksBy(size_t num_of_blocks)
 {
-    this->num_of_allocated_blocks -= num_of_blocks;
+    this->stats->sub(STAT_BUDDY_BLOCKS, num_of_blocks);
 }
 
 size_t BuddyAllocator::getNumOfBytesInAllocatedBlocks() const
 {
-    return num_of_bytes_in_allocated_blocks;
+    return this->stats->get(STAT_BUDDY_BYTES);
 }
 
 void BuddyAllocator::incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes)
 {
-    this->num_of_bytes_in_allocated_blocks += num_of_bytes;
+    this->stats->add(STAT_BUDDY_BYTES, num_of_bytes);
 }
 
 void BuddyAllocator::decNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes)
 {
-    this->num_of_bytes_in_allocated_blocks -= num_of_bytes;
+    this->stats->sub(STAT_BUDDY_BYTES, num_of_bytes);
 }
 
 size_t BuddyAllocator::getNumOfAllocatedBlocksThatAreFree() const
 {
-    return this->num_of_allocated_blocks_that_are_free;
+    return this->stats->get(STAT_BUDDY_FREE_BLOCKS);
 }
 void BuddyAllocator::incNumOfAllocatedBlocksThatAreFreeBy(size_t num_of_blocks)
 {
-    this->num_of_allocated_blocks_that_are_free += num_of_blocks;
+    this->stats->add(STAT_BUDDY_FREE_BLOCKS, num_of_blocks);
 }
 
 void BuddyAllocator::decNumOfAllocatedBlocksThatAreFreeBy(size_t num_of_blocks)
 {
-    this->num_of_allocated_blocks_that_are_free -= num_of_blocks;
+    this->stats->sub(STAT_BUDDY_FREE_BLOCKS, num_of_blocks);
 }
 
 size_t BuddyAllocator::getNumOfBytesInAllocatedBlocksThatAreFree() const
 {
-    return num_of_bytes_in_allocated_blocks_that_are_free;
+    return this->stats->get(STAT_BUDDY_FREE_BYTES);
 }
 
 void BuddyAllocator::incNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes)
 {
-    this->num_of_bytes_in_allocated_blocks_that_are_free += num_of_bytes;
+    this->stats->add(STAT_BUDDY_FREE_BYTES, num_of_bytes);
 }
 
 void BuddyAllocator::decNumOfBytesInAllocatedBlocksThatAreFreeBy(size_t num_of_bytes)
 {
-    this->num_of_bytes_in_allocated_blocks_that_are_free -= num_of_bytes;
+    this->stats->sub(STAT_BUDDY_FREE_BYTES, num_of_bytes);
 }
 
-void BuddyAllocator::checkOverFlow(MallocMetadata *md) const {
-    if (md != nullptr && this->cookie != md->cookie)
+// ~~~~~~~~~~~~~ fragmentation related ~~~~~~~~~~~~~~
+void BuddyAllocator::accountUsedBlock(MallocMetadata* block, int order, size_t requested_size, uint8_t tag)
+{
+    block->setRequestedSize(requested_size);
+    block->setTag(tag);
+    this->stats->add(STAT_USED_BLOCKS_IN_ORDER + order, 1);
+    this->stats->add(STAT_BUDDY_REQUESTED_BYTES, requested_size);
+    this->stats->add(STAT_BUDDY_GRANTED_BYTES, convertOrderToSize(order) - META_DATA_SIZE);
+    this->stats->add(STAT_TAG_BLOCKS + tag, 1);
+    this->stats->add(STAT_TAG_BYTES + tag, requested_size);
+}
+
+void BuddyAllocator::unaccountUsedBlock(MallocMetadata* block, int order)
+{
+    this->stats->sub(STAT_USED_BLOCKS_IN_ORDER + order, 1);
+    this->stats->sub(STAT_BUDDY_REQUESTED_BYTES, block->getRequestedSize());
+    this->stats->sub(STAT_BUDDY_GRANTED_BYTES, convertOrderToSize(order) - META_DATA_SIZE);
+    this->stats->sub(STAT_TAG_BLOCKS + block->getTag(), 1);
+    this->stats->sub(STAT_TAG_BYTES + block->getTag(), block->getRequestedSize());
+}
+
+// adds this arena's numbers to stats, smalloc_fragmentation sums all the arenas
+void BuddyAllocator::fillFragmentationStats(smalloc_fragmentation_stats* stats) const
+{
+    size_t values[NUM_OF_STATS];
+    this->stats->snapshot(values);
+    for (int order = 0; order <= MAX_ORDER; order++)
     {
-        exit(0xdeadbeef);
+        stats->free_blocks_per_order[order] += values[STAT_FREE_BLOCKS_IN_ORDER + order];
+        stats->used_blocks_per_order[order] += values[STAT_USED_BLOCKS_IN_ORDER + order];
+        if (this->ordersArray[order] != nullptr || this->pending[order] != nullptr)
+        {
+            stats->largest_free_block = std::max(stats->largest_free_block, convertOrderToSize(order) - META_DATA_SIZE);
+        }
+    }
+    stats->buddy_requested_bytes += values[STAT_BUDDY_REQUESTED_BYTES];
+    stats->buddy_granted_bytes += values[STAT_BUDDY_GRANTED_BYTES];
+    stats->buddy_free_bytes += values[STAT_BUDDY_FREE_BYTES];
+}
+
+// ~~~~~~~~~~~~~ warm start related ~~~~~~~~~~~~~~
+// faults the whole chunk in now, so the first allocations don't pay for it
+void BuddyAllocator::prefault(int mode) const
+{
+    auto* chunk = reinterpret_cast<char*>(this->free_blocks_start_address);
+    if (mode == SMALLOC_PREFAULT_NONE || this->is_first_allocation || this->is_populated ||
+        (mode == SMALLOC_PREFAULT_POPULATE && madvise(chunk, BUDDY_CHUNK_SIZE, MADV_POPULATE_WRITE) == 0))
+    {
+        return;
+    }
+    size_t page_size = roundUpToPage(1);
+    for (size_t i = 0; i < BUDDY_CHUNK_SIZE; i += page_size)
+    {
+        // written back unchanged, the pages hold headers
+        volatile char* byte = chunk + i;
+        *byte = *byte;
+    }
+}
+
+// splits num_of_blocks blocks of order off ahead and keeps them on the order's pending stack, where the
+// first allocations of that order find them. like deferred frees they are merged back when an allocation
+// needs the room (or by the maintenance thread). false if the chunk runs out
+bool BuddyAllocator::presplit(int order, size_t num_of_blocks)
+{
+    for (size_t i = 0; i < num_of_blocks; i++)
+    {
+        MallocMetadata* block = this->recFreeBlockLookup(order, order);
+        if (block == nullptr)
+        {
+            return false;
+        }
+        this->pushPendingBlock(block, order);
+    }
+    return true;
+}
+
+// ~~~~~~~~~~~~~ heap walk related ~~~~~~~~~~~~~~
+intptr_t BuddyAllocator::getChunkStart() const
+{
+    return __atomic_load_n(&this->free_blocks_start_address, __ATOMIC_ACQUIRE);
+}
+
+MallocMetadata* BuddyAllocator::getFreeListHead(int order) const
+{
+    return this->ordersArray[order];
+}
+
+bool BuddyAllocator::isValidBlock(const MallocMetadata* md, intptr_t chunk_start) const
+{
+    auto address = reinterpret_cast<intptr_t>(md);
+    if (address < chunk_start || address >= chunk_start + BUDDY_CHUNK_SIZE ||
+        !md->isSealedWith(getCookieKey(this->cookie, md)))
+    {
+        return false;
+    }
+    size_t size = md->total_block_size;
+    return size >= MINIMAL_BLOCK_SIZE && size <= MAXIMAL_BUDDY_BLOCK && (size & (size - 1)) == 0 &&
+           (address - chunk_start) % size == 0;
+}
+
+// walks the chunk by block sizes (the boundary layout), not by the free lists, so blocks that fell out of
+// the lists are found too. every step moves at least MINIMAL_BLOCK_SIZE forward, which bounds the walk
+size_t BuddyAllocator::walkBlocks(sheap_walk_callback callback, void* arg) const
+{
+    if (this->is_first_allocation)
+    {
+        return 0;
+    }
+    intptr_t chunk_start = this->free_blocks_start_address;
+    // the free lists are sorted by address, so while walking up the chunk the next free block of an order
+    // has to be the one the cursor of that order points to
+    const MallocMetadata* list_cursors[MAX_ORDER+1];
+    for (int order = 0; order <= MAX_ORDER; order++)
+    {
+        list_cursors[order] = this->ordersArray[order];
+    }
+    size_t max_cursor_steps = BUDDY_CHUNK_SIZE / MINIMAL_BLOCK_SIZE;
+    size_t num_of_blocks = 0;
+    intptr_t curr = chunk_start;
+    while (curr < chunk_start + BUDDY_CHUNK_SIZE)
+    {
+        auto* md = reinterpret_cast<const MallocMetadata*>(curr);
+        sheap_block_info info{};
+        info.block = reinterpret_cast<void*>(curr);
+        num_of_blocks++;
+        if (!this->isValidBlock(md, chunk_start))
+        {
+            info.order = -1;
+            info.is_corrupt = true;
+            callback(&info, arg);
+            return num_of_blocks;
+        }
+        info.block_size = md->total_block_size;
+        info.order = convertSizeToOrder(info.block_size);
+        info.is_free = md->is_free;
+        info.requested_size = md->is_free ? 0 : md->requested_size;
+        const MallocMetadata*& cursor = list_cursors[info.order];
+        while (cursor != nullptr && cursor < md && max_cursor_steps-- > 0)
+        {
+            // entries below md that weren't met in the walk aren't block starts, skip them
+            cursor = this->isValidBlock(cursor, chunk_start) ? cursor->next : nullptr;
+        }
+        if (cursor == md)
+        {
+            info.in_free_list = true;
+            cursor = md->next;
+        }
+        else if (md->is_free && md->free_state == FREE_PENDING)
+        {
+            info.in_free_list = true;
+        }
+        callback(&info, arg);
+        curr += static_cast<intptr_t>(info.block_size);
+    }
+    return num_of_blocks;
+}
+
+// ~~~~~~~~~~~~~ maintenance related ~~~~~~~~~~~~~~
+void BuddyAllocator::setDeferMerges(bool defer)
+{
+    this->defer_merges = defer;
+}
+
+// a pending block counts as free, like a block in the lists
+void BuddyAllocator::pushPendingBlock(MallocMetadata* block, int order)
+{
+    block->setIsFree(true);
+    block->setFreeState(FREE_PENDING);
+    block->setPrev(nullptr);
+    block->setNext(this->pending[order]);
+    this->pending[order] = block;
+    this->stats->add(STAT_FREE_BLOCKS_IN_ORDER + order, 1);
+    this->incNumOfAllocatedBlocksThatAreFreeBy(1);
+    this->incNumOfBytesInAllocatedBlocksThatAreFreeBy(block->getBlockSize() - META_DATA_SIZE);
+}
+
+MallocMetadata* BuddyAllocator::popPendingBlock(int order)
+{
+    MallocMetadata* block = this->pending[order];
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+    this->checkOverFlow(block);
+    this->pending[order] = block->getNext();
+    block->setNext(nullptr);
+    this->stats->sub(STAT_FREE_BLOCKS_IN_ORDER + order, 1);
+    this->decNumOfAllocatedBlocksThatAreFreeBy(1);
+    this->decNumOfBytesInAllocatedBlocksThatAreFreeBy(block->getBlockSize() - META_DATA_SIZE);
+    return block;
+}
+
+// does the merges sfree deferred, up to max_blocks of them. returns how many blocks were merged back,
+// fewer than max_blocks means no pending block is left
+size_t BuddyAllocator::mergePendingBlocks(size_t max_blocks)
+{
+    size_t num_of_blocks = 0;
+    for (int order = 0; order <= MAX_ORDER; order++)
+    {
+        while (num_of_blocks < max_blocks && this->pending[order] != nullptr)
+        {
+            this->recMergeBuddyBlocks(this->popPendingBlock(order), order);
+            num_of_blocks++;
+        }
+    }
+    return num_of_blocks;
+}
+
+// a free block of MAINTENANCE_MIN_RELEASE_ORDER or up that was already free in the previous pass is idle,
+// its pages past the header page go back to the kernel. they read as zeros when the block is used again
+size_t BuddyAllocator::releaseIdleBlocks(size_t* released_bytes)
+{
+    size_t num_of_blocks = 0;
+    size_t header_page = roundUpToPage(META_DATA_SIZE);
+    for (int order = MAINTENANCE_MIN_RELEASE_ORDER; order <= MAX_ORDER; order++)
+    {
+        size_t block_size = convertOrderToSize(order);
+        for (MallocMetadata* curr = this->ordersArray[order]; curr != nullptr; curr = curr->getNext())
+        {
+            this->checkOverFlow(curr);
+            if (curr->getFreeState() == FREE_LISTED)
+            {
+                curr->setFreeState(FREE_IDLE);
+            }
+            else if (curr->getFreeState() == FREE_IDLE)
+            {
+                char* pages = reinterpret_cast<char*>(curr) + header_page;
+                heap.getPageSource()->releasePages(pages, block_size - header_page);
+                curr->setFreeState(FREE_RELEASED);
+                *released_bytes += block_size - header_page;
+                num_of_blocks++;
+            }
+        }
     }
+    return num_of_blocks;
+}
+
+// the checks inside the allocator, only at HARDENING_FULL
+void BuddyAllocator::checkOverFlow(MallocMetadata *md) const {
+#if MALLOC_HARDENING >= HARDENING_FULL
+    checkCookie(md, this->cookie);
+#else
+    (void) md;
+#endif
 }
 
 class MMapAllocator
@@ -652,10 +1727,21 @@ private:
     int cookie{};
     MallocMetadata* head{};
     MallocMetadata* tail{};
-    size_t num_of_allocated_blocks{}; // = num_of_meta_data_blocks
-    size_t num_of_bytes_in_allocated_blocks{};
+    ShardedStats* stats{};
+    // freed regions kept for reuse, newest first: the ones up to the retain threshold, and any while the
+    // maintenance thread runs
+    MallocMetadata* cache_head{};
+    MallocMetadata* cache_tail{};
+    std::atomic<size_t> cached_bytes{0};
+    size_t cache_budget{}; // the maintenance thread's, 0 while it doesn't run
+    // the adaptive retain threshold, see noteFreedSize. MAXIMAL_BUDDY_BLOCK retains nothing
+    std::atomic<size_t> retain_threshold{MAXIMAL_BUDDY_BLOCK};
+    size_t churn_sizes[MMAP_CHURN_SLOTS]{};
+    uint64_t churn_times[MMAP_CHURN_SLOTS]{};
+
+    MallocMetadata* detachOldestCachedRegion();
 
-    explicit MMapAllocator(int cookie);
+    MMapAllocator(int cookie, ShardedStats* stats);
     friend class MemoryManager;
 public:
     ~MMapAllocator() = default;
@@ -663,8 +1749,10 @@ public:
     MallocMetadata* getHead();
     void setTail(MallocMetadata* new_tail);
     MallocMetadata* getTail();
-    MallocMetadata CreateMallocMetaData(size_t user_size, bool is_free) const;
+    MallocMetadata CreateMallocMetaData(const void* block, size_t user_size, bool is_free) const;
     void RemoveFromList(MallocMetadata* md);
+    MallocMetadata* freeBlock(MallocMetadata* md, size_t block_size);
+    static void unmapRegions(MallocMetadata* regions);
     // ~~~~~~~~~~~~~ statistic related ~~~~~~~~~~~~~~
     size_t getNumOfAllocatedBlocks() const;
     void incNumOfAllocatedBlocksBy(size_t num_of_blocks);
@@ -672,12 +1760,27 @@ public:
     size_t getNumOfBytesInAllocatedBlocks() const;
     void incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes);
     void decNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes);
+    void accountBlock(MallocMetadata* md, size_t requested_size, uint8_t tag);
+    void unaccountBlock(MallocMetadata* md);
+    void fillFragmentationStats(smalloc_fragmentation_stats* stats) const;
+    size_t walkBlocks(sheap_walk_callback callback, void* arg) const;
+    // ~~~~~~~~~~~~~ region cache ~~~~~~~~~~~~~~
+    void setCacheBudget(size_t budget);
+    bool cacheRegion(MallocMetadata* md, size_t mapped_size, MallocMetadata** evicted);
+    MallocMetadata* takeCachedRegion(size_t block_size);
+    MallocMetadata* evictCachedRegion(size_t budget);
+    size_t getCachedBytes() const;
+    // ~~~~~~~~~~~~~ adaptive retention ~~~~~~~~~~~~~~
+    static MallocMetadata* mapRegion(size_t block_size);
+    size_t getRetainThreshold() const;
+    size_t getRetainLimit() const;
+    void noteFreedSize(size_t mapped_size);
+    MallocMetadata* onMemoryPressure();
 
     void checkOverFlow(MallocMetadata* md) const;
 };
 
-MMapAllocator::MMapAllocator(int cookie): cookie(cookie), head(nullptr), tail(nullptr),
-num_of_allocated_blocks(0), num_of_bytes_in_allocated_blocks(0){}
+MMapAllocator::MMapAllocator(int cookie, ShardedStats* stats): cookie(cookie), head(nullptr), tail(nullptr), stats(stats){}
 
 void MMapAllocator::setHead(MallocMetadata *new_head) {
     this->checkOverFlow(new_head);
@@ -701,8 +1804,8 @@ MallocMetadata *MMapAllocator::getTail() {
     return this->tail;
 }
 
-MallocMetadata MMapAllocator::CreateMallocMetaData(size_t user_size, bool is_free) const {
-    return {this->cookie, user_size + META_DATA_SIZE, is_free};
+MallocMetadata MMapAllocator::CreateMallocMetaData(const void* block, size_t user_size, bool is_free) const {
+    return {getCookieKey(this->cookie, block), user_size + META_DATA_SIZE, is_free};
 }
 
 void MMapAllocator::RemoveFromList(MallocMetadata *md) {
@@ -759,343 +1862,3317 @@ void MMapAllocator::RemoveFromList(MallocMetadata *md) {
     }
 }
 
+// returns the regions to unmap - md itself unless it was cached, and whatever caching it evicted - chained
+// through next. the caller unmaps them with unmapRegions once the mmap lock is dropped
+MallocMetadata* MMapAllocator::freeBlock(MallocMetadata *md, size_t block_size) {
+    // block_size is passed in by the caller so sized deallocation doesn't need to read it from the header
+    this->RemoveFromList(md);
+    this->unaccountBlock(md);
+
+    this->decNumOfAllocatedBlocksBy(1);
+    this->decNumOfBytesInAllocatedBlocksBy(block_size - META_DATA_SIZE);
+
+    MallocMetadata* to_unmap = nullptr;
+    size_t mapped_size = roundUpToPage(block_size);
+    this->noteFreedSize(mapped_size);
+#if LARGE_OBJECT_LAYER == LARGE_OBJECT_CACHED
+    if (this->cacheRegion(md, mapped_size, &to_unmap))
+    {
+        return to_unmap;
+    }
+#endif
+    md->setBlockSize(mapped_size);
+    md->setNext(to_unmap);
+    return md;
+}
+
+void MMapAllocator::unmapRegions(MallocMetadata *regions) {
+    while (regions != nullptr)
+    {
+        MallocMetadata* next = regions->getNext();
+        if (munmap(regions, regions->getBlockSize()) != 0)
+        {
+            exit(1);
+        }
+        regions = next;
+    }
+}
+
 size_t MMapAllocator::getNumOfAllocatedBlocks() const {
-    return this->num_of_allocated_blocks;
+    return this->stats->get(STAT_MMAP_BLOCKS);
 }
 
 void MMapAllocator::incNumOfAllocatedBlocksBy(size_t num_of_blocks) {
-    this->num_of_allocated_blocks += num_of_blocks;
+    this->stats->add(STAT_MMAP_BLOCKS, num_of_blocks);
 }
 
 void MMapAllocator::decNumOfAllocatedBlocksBy(size_t num_of_blocks) {
-    this->num_of_allocated_blocks -= num_of_blocks;
+    this->stats->sub(STAT_MMAP_BLOCKS, num_of_blocks);
 }
 
 size_t MMapAllocator::getNumOfBytesInAllocatedBlocks() const {
-    return this->num_of_bytes_in_allocated_blocks;
+    return this->stats->get(STAT_MMAP_BYTES);
 }
 
 void MMapAllocator::incNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes) {
-    this->num_of_bytes_in_allocated_blocks += num_of_bytes;
+    this->stats->add(STAT_MMAP_BYTES, num_of_bytes);
 }
 
 void MMapAllocator::decNumOfBytesInAllocatedBlocksBy(size_t num_of_bytes) {
-    this->num_of_bytes_in_allocated_blocks -= num_of_bytes;
-}
-
-void MMapAllocator::checkOverFlow(MallocMetadata *md) const {
-    if (md != nullptr && this->cookie != md->cookie)
-    {
-        exit(0xdeadbeef);
-    }
-}
-
-class MemoryManager
-{
-private:
-    int cookie;
-    BuddyAllocator buddy_allocator;
-    MMapAllocator mmap_allocator;
-public:
-    MemoryManager();
-    ~MemoryManager() = default;
-    BuddyAllocator* getBuddyAllocator();
-    MMapAllocator* getMMapAllocator();
-    size_t getNumOfAllocatedBlocks() const;
-    size_t getNumOfBytesInAllocatedBlocks() const;
-    size_t getNumOfAllocatedBlocksThatAreFree() const;
-    size_t getNumOfBytesInAllocatedBlocksThatAreFree() const;
-};
-
-MemoryManager::MemoryManager(): cookie(rand()), buddy_allocator(cookie), mmap_allocator(cookie){}
-
-BuddyAllocator* MemoryManager::getBuddyAllocator() {
-    return &(this->buddy_allocator);
+    this->stats->sub(STAT_MMAP_BYTES, num_of_bytes);
 }
 
-MMapAllocator* MemoryManager::getMMapAllocator() {
-    return &(this->mmap_allocator);
+void MMapAllocator::accountBlock(MallocMetadata *md, size_t requested_size, uint8_t tag) {
+    md->setRequestedSize(requested_size);
+    md->setTag(tag);
+    this->stats->add(STAT_MMAP_REQUESTED_BYTES, requested_size);
+    this->stats->add(STAT_MMAP_GRANTED_BYTES, roundUpToPage(md->getBlockSize()) - META_DATA_SIZE);
+    this->stats->add(STAT_TAG_BLOCKS + tag, 1);
+    this->stats->add(STAT_TAG_BYTES + tag, requested_size);
 }
 
-size_t MemoryManager::getNumOfAllocatedBlocks() const
-{
-    return this->buddy_allocator.getNumOfAllocatedBlocks() + this->mmap_allocator.getNumOfAllocatedBlocks();
+void MMapAllocator::unaccountBlock(MallocMetadata *md) {
+    this->stats->sub(STAT_MMAP_REQUESTED_BYTES, md->getRequestedSize());
+    this->stats->sub(STAT_MMAP_GRANTED_BYTES, roundUpToPage(md->getBlockSize()) - META_DATA_SIZE);
+    this->stats->sub(STAT_TAG_BLOCKS + md->getTag(), 1);
+    this->stats->sub(STAT_TAG_BYTES + md->getTag(), md->getRequestedSize());
 }
 
-size_t MemoryManager::getNumOfBytesInAllocatedBlocks() const
-{
-    return this->buddy_allocator.getNumOfBytesInAllocatedBlocks() + this->mmap_allocator.getNumOfBytesInAllocatedBlocks();
+void MMapAllocator::fillFragmentationStats(smalloc_fragmentation_stats *stats) const {
+    stats->mmap_requested_bytes = this->stats->get(STAT_MMAP_REQUESTED_BYTES);
+    stats->mmap_granted_bytes = this->stats->get(STAT_MMAP_GRANTED_BYTES);
 }
 
-size_t MemoryManager::getNumOfAllocatedBlocksThatAreFree() const
-{
-    return this->buddy_allocator.getNumOfAllocatedBlocksThatAreFree();
+size_t MMapAllocator::walkBlocks(sheap_walk_callback callback, void *arg) const {
+    size_t num_of_blocks = 0;
+    // a list longer than the block counter has a cycle, stop there
+    size_t num_of_allocated_blocks = this->getNumOfAllocatedBlocks();
+    for (const MallocMetadata* md = this->head; md != nullptr && num_of_blocks < num_of_allocated_blocks;
+         md = md->next)
+    {
+        sheap_block_info info{};
+        info.block = const_cast<MallocMetadata*>(md);
+        info.order = -1;
+        info.is_mmap = true;
+        num_of_blocks++;
+        if (!md->isSealedWith(getCookieKey(this->cookie, md)))
+        {
+            info.is_corrupt = true;
+            callback(&info, arg);
+            break;
+        }
+        info.block_size = md->total_block_size;
+        info.requested_size = md->requested_size;
+        callback(&info, arg);
+    }
+    return num_of_blocks;
 }
 
-size_t MemoryManager::getNumOfBytesInAllocatedBlocksThatAreFree() const
-{
-    return this->buddy_allocator.getNumOfBytesInAllocatedBlocksThatAreFree();
+// ~~~~~~~~~~~~~ region cache ~~~~~~~~~~~~~~
+void MMapAllocator::setCacheBudget(size_t budget) {
+    this->cache_budget = budget;
 }
 
-MemoryManager mem_man;
-//BuddyAllocator buddy_allocator = mem_man.getBuddyAllocator();
-// ~~~~~~~~~~~~~~ IMPLEMENT MALLOC, FREE, CALLOC, REALLOC ~~~~~~~~~~~~~~~~~~~~~~
-
-void* smalloc(size_t size)
-{
-    BuddyAllocator* buddy_allocator = mem_man.getBuddyAllocator();
-    if (buddy_allocator->isFirstAllocation())
+// regions up to the retain threshold are retained the way glibc keeps such chunks in its heap, up to twice
+// the threshold (glibc's trim threshold). while the maintenance thread runs any region is cached, up to twice
+// its budget, and the thread trims the cache back down to it. the oldest regions make room for the newest
+bool MMapAllocator::cacheRegion(MallocMetadata *md, size_t mapped_size, MallocMetadata** evicted) {
+    size_t limit = 2 * this->cache_budget;
+    if (mapped_size <= this->getRetainThreshold())
     {
-        buddy_allocator->initFirstFreeBlocks();
-        //buddy_allocator->printInfo();
+        limit = std::max(limit, this->getRetainLimit());
     }
-
-    if (size == 0 || size > MAX_SIZE)
+    if (mapped_size > limit)
+    {
+        return false;
+    }
+    while (this->cached_bytes + mapped_size > limit)
+    {
+        MallocMetadata* oldest = this->detachOldestCachedRegion();
+        oldest->setNext(*evicted);
+        *evicted = oldest;
+    }
+    md->setBlockSize(mapped_size);
+    md->setIsFree(true);
+    md->setPrev(nullptr);
+    md->setNext(this->cache_head);
+    if (this->cache_head != nullptr)
+    {
+        this->cache_head->setPrev(md);
+    }
+    else
     {
-        return NULL; //need to return NULL or nullptr?
+        this->cache_tail = md;
     }
-    MallocMetadata* block_to_use = nullptr;
-    if(size + META_DATA_SIZE > MAXIMAL_BUDDY_BLOCK)
+    this->cache_head = md;
+    this->cached_bytes += mapped_size;
+    return true;
+}
+
+// a cached region of exactly the pages block_size needs, so munmap of the header's size unmaps all of it
+MallocMetadata *MMapAllocator::takeCachedRegion(size_t block_size) {
+    size_t mapped_size = roundUpToPage(block_size);
+    for (MallocMetadata* curr = this->cache_head; curr != nullptr; curr = curr->getNext())
     {
-        //mmap
-        MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
-        block_to_use = (MallocMetadata*) (mmap(NULL, size + META_DATA_SIZE,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
-        if(block_to_use == MAP_FAILED)
+        this->checkOverFlow(curr);
+        if (curr->getBlockSize() != mapped_size)
         {
-            return NULL;
+            continue;
         }
-        *block_to_use = mmap_allocator->CreateMallocMetaData(size,false);
-
-        if(mmap_allocator->getHead() == nullptr)
+        if (curr->getPrev() == nullptr)
         {
-            //mmap_allocator->checkOverFlow(block_to_use);
-            //mmap_allocator->checkOverFlow(mmap_allocator->getHead());
-            mmap_allocator->setHead(block_to_use);
-
-            //mmap_allocator->checkOverFlow(block_to_use);
-            //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
-            mmap_allocator->setTail(block_to_use);
+            this->cache_head = curr->getNext();
         }
         else
         {
-            mmap_allocator->checkOverFlow(mmap_allocator->getHead());
-            mmap_allocator->checkOverFlow(mmap_allocator->getTail());
-            //mmap_allocator->checkOverFlow(block_to_use);
-            block_to_use->setPrev(mmap_allocator->getTail());
-
-            //mmap_allocator->checkOverFlow(block_to_use);
-            //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
-            mmap_allocator->getTail()->setNext(block_to_use);
-
-            //mmap_allocator->checkOverFlow(block_to_use);
-            //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
-            mmap_allocator->setTail(block_to_use);
+            curr->getPrev()->setNext(curr->getNext());
         }
-
-        // add to stats - new block was allocated successfully
-        mmap_allocator->incNumOfAllocatedBlocksBy(1);
-        mmap_allocator->incNumOfBytesInAllocatedBlocksBy(size);
-    }
-    else
-    {
-        //buddy_allocator
-        size_t block_size = buddy_allocator->next_power_of_two(size + META_DATA_SIZE);
-        int order = buddy_allocator->convertSizeToOrder(block_size);
-
-        // need to check what to do if there is no available size
-        block_to_use = buddy_allocator->recFreeBlockLookup(order, order);
-        //buddy_allocator->checkOverFlow(block_to_use);
-        if (block_to_use == nullptr)
+        if (curr->getNext() == nullptr)
         {
-            return NULL;
+            this->cache_tail = curr->getPrev();
+        }
+        else
+        {
+            curr->getNext()->setPrev(curr->getPrev());
         }
-        // update fields of block_to_use - size should already be updated
-        //buddy_allocator->checkOverFlow(block_to_use);
-        block_to_use->setIsFree(false);
-        //buddy_allocator->checkOverFlow(block_to_use);
-        block_to_use->setNext(nullptr);
-        //buddy_allocator->checkOverFlow(block_to_use);
-        block_to_use->setPrev(nullptr);
+        this->cached_bytes -= mapped_size;
+        return curr;
     }
-    //buddy_allocator->checkOverFlow(block_to_use);
-    return (block_to_use == nullptr)? NULL:GET_USER_PTR(block_to_use);
+    return nullptr;
 }
 
-
-void* scalloc(size_t num, size_t size)
-{
-    void* allocated_block = smalloc(num * size);
-    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
-    if (allocated_block == nullptr)
+// detaches the oldest region while the cache is over budget (the retained regions aside), the caller
+// unmaps it outside the lock
+MallocMetadata *MMapAllocator::evictCachedRegion(size_t budget) {
+    if (this->cached_bytes <= std::max(budget, this->getRetainLimit()))
     {
-        return NULL;
+        return nullptr;
     }
-    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
-    std::memset(allocated_block, 0, num * size); // TODO: should we set all bytes in the block to 0 or just the amount the user asked for
-    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
-    return allocated_block;
-    // relevant stats are added inside smalloc
+    return this->detachOldestCachedRegion();
 }
 
-void sfree(void* p)
+MallocMetadata *MMapAllocator::detachOldestCachedRegion() {
+    MallocMetadata* oldest = this->cache_tail;
+    if (oldest == nullptr)
+    {
+        return nullptr;
+    }
+    this->checkOverFlow(oldest);
+    this->cache_tail = oldest->getPrev();
+    if (this->cache_tail == nullptr)
+    {
+        this->cache_head = nullptr;
+    }
+    else
+    {
+        this->cache_tail->setNext(nullptr);
+    }
+    this->cached_bytes -= oldest->getBlockSize();
+    return oldest;
+}
+
+size_t MMapAllocator::getCachedBytes() const {
+    return this->cached_bytes.load(std::memory_order_relaxed);
+}
+
+// ~~~~~~~~~~~~~ adaptive retention ~~~~~~~~~~~~~~
+// glibc's adaptive mmap threshold decides which sizes are mmapped at all. here that split can't move, the
+// buddy has no order above MAXIMAL_BUDDY_BLOCK (and sfree_sized routes by size alone). what adapts is which
+// freed regions are kept mapped for reuse instead of unmapped, glibc's way of keeping such chunks in its heap
+MallocMetadata *MMapAllocator::mapRegion(size_t block_size) {
+    void* region = mmap(NULL, block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (region == MAP_FAILED) ? nullptr : static_cast<MallocMetadata*>(region);
+}
+
+size_t MMapAllocator::getRetainThreshold() const {
+    return this->retain_threshold.load(std::memory_order_relaxed);
+}
+
+size_t MMapAllocator::getRetainLimit() const {
+    size_t current_threshold = this->getRetainThreshold();
+    return (current_threshold > MAXIMAL_BUDDY_BLOCK) ? 2 * current_threshold : 0;
+}
+
+// like glibc's mmap threshold, a region that is freed raises the retain threshold to its size - but only once
+// that size churns, freed again within MMAP_CHURN_NS, so one off big buffers don't pin memory. the sizes are
+// remembered in a few slots by page count, a collision just forgets one
+void MMapAllocator::noteFreedSize(size_t mapped_size) {
+    uint64_t now = monotonicNs();
+    size_t slot = (mapped_size / roundUpToPage(1)) % MMAP_CHURN_SLOTS;
+    if (this->churn_sizes[slot] == mapped_size && now - this->churn_times[slot] < MMAP_CHURN_NS &&
+        mapped_size > this->getRetainThreshold() && mapped_size <= MMAP_RETAIN_THRESHOLD_MAX)
+    {
+        this->retain_threshold.store(mapped_size, std::memory_order_relaxed);
+    }
+    this->churn_sizes[slot] = mapped_size;
+    this->churn_times[slot] = now;
+}
+
+// mmap failed: detach every retained region and halve the retain threshold. the regions are returned chained
+// through next, for unmapRegions once the mmap lock is dropped
+MallocMetadata* MMapAllocator::onMemoryPressure() {
+    MallocMetadata* evicted = nullptr;
+    for (MallocMetadata* oldest = this->detachOldestCachedRegion(); oldest != nullptr;
+         oldest = this->detachOldestCachedRegion())
+    {
+        oldest->setNext(evicted);
+        evicted = oldest;
+    }
+    this->retain_threshold.store(std::max(this->getRetainThreshold() / 2, size_t(MAXIMAL_BUDDY_BLOCK)),
+                                 std::memory_order_relaxed);
+    return evicted;
+}
+
+void MMapAllocator::checkOverFlow(MallocMetadata *md) const {
+#if MALLOC_HARDENING >= HARDENING_FULL
+    checkCookie(md, this->cookie);
+#else
+    (void) md;
+#endif
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ ALLOCATION TRACE ~~~~~~~~~~~~~~~~~~~
+// the file format is in trace_format.h, which replay.cpp includes as well
+struct TraceIdEntry
+{
+    uintptr_t address;
+    uint32_t id;
+};
+
+// records the public entry points while a trace is open. nothing is allocated through smalloc: the
+// records are buffered in place and the pointer->id table is mmapped when the trace starts. the calls run
+// unserialized, only making a record takes the lock, so the file has the records in the order they were
+// made. a free is recorded before the block is released and an allocation once it is made, so the id of an
+// address is gone from the table before any thread can be handed that address again. a realloc detaches
+// the old id before the call for the same reason, and gives it back if the call failed
+class AllocationTracer
+{
+private:
+    std::atomic<int> fd; // written under lock, read without it by isTracing
+    std::mutex lock;     // held while a record is made
+    uint32_t next_id;
+    uint64_t start_ns;
+    TraceIdEntry* id_table;
+    size_t num_of_buffered_records;
+    TraceRecord buffer[TRACE_BUFFER_RECORDS];
+
+    uint32_t insertId(void* p, uint32_t id);
+    uint32_t removeId(void* p);
+    void appendRecord(uint8_t op, uint32_t ptr_id, uint32_t aux, size_t size);
+    void flush();
+    void closeTrace();
+public:
+    AllocationTracer();
+    ~AllocationTracer() = default;
+    bool start(const char* path);
+    void stop();
+    bool isTracing() const;
+    void recordMalloc(size_t size, void* result);
+    void recordCalloc(size_t num, size_t size, void* result);
+    uint32_t detachRealloc(void* oldp);
+    void recordRealloc(void* oldp, uint32_t old_id, size_t size, void* result);
+    void cancelRealloc(void* oldp, uint32_t old_id);
+    void recordFree(void* p);
+};
+
+AllocationTracer::AllocationTracer(): fd(-1), lock(), next_id(1), start_ns(0), id_table(nullptr),
+    num_of_buffered_records(0), buffer{} {}
+
+static uint16_t currentThreadId()
+{
+    static std::atomic<uint16_t> next_thread_id(0);
+    static thread_local uint16_t thread_id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+    return thread_id;
+}
+
+bool AllocationTracer::start(const char* path)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd >= 0)
+    {
+        return false;
+    }
+    void* table = mmap(NULL, TRACE_ID_TABLE_SIZE * sizeof(TraceIdEntry), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+    {
+        return false;
+    }
+    int trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+    {
+        munmap(table, TRACE_ID_TABLE_SIZE * sizeof(TraceIdEntry));
+        return false;
+    }
+    TraceFileHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), 0};
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header))
+    {
+        exit(1);
+    }
+    this->id_table = static_cast<TraceIdEntry*>(table);
+    this->next_id = 1;
+    this->start_ns = monotonicNs();
+    this->num_of_buffered_records = 0;
+    // last, a thread that sees the trace open finds the table ready once it takes the lock
+    this->fd.store(trace_fd, std::memory_order_relaxed);
+    return true;
+}
+
+void AllocationTracer::stop()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->closeTrace();
+}
+
+// with the lock taken
+void AllocationTracer::closeTrace()
 {
-    BuddyAllocator* buddy_allocator = mem_man.getBuddyAllocator();
-    //buddy_allocator->checkOverFlow(GET_METADATA(p));
-    if(p == NULL)
+    if (this->fd < 0)
     {
         return;
     }
-    MallocMetadata* metadata = GET_METADATA(p);
-    buddy_allocator->checkOverFlow(metadata);
-    //buddy_allocator->checkOverFlow(metadata);
-    if (metadata->isFree()) return;
-    //buddy_allocator->checkOverFlow(metadata);
-    if(metadata->getBlockSize() > MAXIMAL_BUDDY_BLOCK)
+    this->flush();
+    close(this->fd);
+    this->fd.store(-1, std::memory_order_relaxed);
+    munmap(this->id_table, TRACE_ID_TABLE_SIZE * sizeof(TraceIdEntry));
+    this->id_table = nullptr;
+}
+
+bool AllocationTracer::isTracing() const
+{
+    return this->fd.load(std::memory_order_relaxed) >= 0;
+}
+
+// open addressing with linear probing, removal shifts the following entries back so there are no tombstones.
+// id 0 takes the next one
+uint32_t AllocationTracer::insertId(void* p, uint32_t id)
+{
+    if (p == nullptr)
+    {
+        return 0;
+    }
+    auto address = reinterpret_cast<uintptr_t>(p);
+    size_t mask = TRACE_ID_TABLE_SIZE - 1;
+    size_t i = (address >> 3) & mask;
+    for (size_t probes = 0; this->id_table[i].address != 0; probes++)
     {
-        //mmap
-        MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
-        //mmap_allocator->checkOverFlow(metadata);
-        mmap_allocator->RemoveFromList(metadata);
+        if (probes == mask)
+        {
+            // more live pointers than the table can hold, stop tracing rather than recording wrong ids
+            this->closeTrace();
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    this->id_table[i].address = address;
+    this->id_table[i].id = (id != 0) ? id : this->next_id++;
+    return this->id_table[i].id;
+}
 
-        //mmap_allocator->checkOverFlow(metadata);
-        size_t block_size = metadata->getBlockSize();
+uint32_t AllocationTracer::removeId(void* p)
+{
+    if (p == nullptr)
+    {
+        return 0;
+    }
+    auto address = reinterpret_cast<uintptr_t>(p);
+    size_t mask = TRACE_ID_TABLE_SIZE - 1;
+    size_t i = (address >> 3) & mask;
+    while (this->id_table[i].address != address)
+    {
+        if (this->id_table[i].address == 0)
+        {
+            return 0; // allocated before the trace started
+        }
+        i = (i + 1) & mask;
+    }
+    uint32_t id = this->id_table[i].id;
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; this->id_table[j].address != 0; j = (j + 1) & mask)
+    {
+        size_t home = (this->id_table[j].address >> 3) & mask;
+        // move j into the hole unless its home slot lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            this->id_table[hole] = this->id_table[j];
+            hole = j;
+        }
+    }
+    this->id_table[hole].address = 0;
+    this->id_table[hole].id = 0;
+    return id;
+}
 
-        mmap_allocator->decNumOfAllocatedBlocksBy(1);
-        mmap_allocator->decNumOfBytesInAllocatedBlocksBy(block_size - META_DATA_SIZE);
+void AllocationTracer::appendRecord(uint8_t op, uint32_t ptr_id, uint32_t aux, size_t size)
+{
+    if (this->fd < 0)
+    {
+        return;
+    }
+    TraceRecord* record = &this->buffer[this->num_of_buffered_records++];
+    record->op = op;
+    record->reserved = 0;
+    record->thread_id = currentThreadId();
+    record->ptr_id = ptr_id;
+    record->aux = aux;
+    record->size = static_cast<uint32_t>(size);
+    record->timestamp_ns = monotonicNs() - this->start_ns;
+    if (this->num_of_buffered_records == TRACE_BUFFER_RECORDS)
+    {
+        this->flush();
+    }
+}
 
-        //mmap_allocator->checkOverFlow(metadata);
-        void* block_to_munmap = static_cast<void*>(metadata);
-        //mmap_allocator->checkOverFlow(static_cast<MallocMetadata*> (block_to_munmap));
-        if(munmap(block_to_munmap, block_size) != 0)
+void AllocationTracer::flush()
+{
+    size_t bytes = this->num_of_buffered_records * sizeof(TraceRecord);
+    const char* data = reinterpret_cast<const char*>(this->buffer);
+    while (bytes > 0)
+    {
+        ssize_t written = write(this->fd, data, bytes);
+        if (written <= 0)
         {
             exit(1);
         }
+        data += written;
+        bytes -= written;
     }
-    else
+    this->num_of_buffered_records = 0;
+}
+
+// the trace may have been stopped (or have filled its id table and closed) since the caller looked
+void AllocationTracer::recordMalloc(size_t size, void* result)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd >= 0)
     {
-        //buddy_allocator
-        //buddy_allocator->checkOverFlow(metadata);
-        int order = buddy_allocator->convertSizeToOrder(metadata->getBlockSize());
-        //buddy_allocator->checkOverFlow(metadata);
-        buddy_allocator->recMergeBuddyBlocks(metadata, order);
+        this->appendRecord(TRACE_MALLOC, this->insertId(result, 0), 0, size);
     }
+}
 
+void AllocationTracer::recordCalloc(size_t num, size_t size, void* result)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd >= 0)
+    {
+        this->appendRecord(TRACE_CALLOC, this->insertId(result, 0), static_cast<uint32_t>(num), size);
+    }
 }
 
-void* srealloc(void* oldp, size_t size)
+// before the realloc, which may release oldp for another thread to get
+uint32_t AllocationTracer::detachRealloc(void* oldp)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return (this->fd >= 0) ? this->removeId(oldp) : 0;
+}
+
+void AllocationTracer::recordRealloc(void* oldp, uint32_t old_id, size_t size, void* result)
 {
-    BuddyAllocator* buddy_allocator = mem_man.getBuddyAllocator();
-    //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-    if (oldp == NULL)
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd < 0)
     {
-        return smalloc(size); // stats were added inside smalloc for this case
+        return;
     }
-    // realloc
-    if (size == 0 || size > MAX_SIZE)
+    if (result == nullptr)
     {
-        return NULL; //need to return NULL or nullptr?
+        // a failed realloc leaves oldp allocated, so it keeps its id
+        if (old_id != 0)
+        {
+            this->insertId(oldp, old_id);
+        }
+        this->appendRecord(TRACE_REALLOC, 0, 0, size);
+        return;
     }
+    this->appendRecord(TRACE_REALLOC, this->insertId(result, 0), old_id, size);
+}
 
-    //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-    MallocMetadata* oldp_md = GET_METADATA(oldp);
-    if (oldp_md == NULL)
+// for a call that detached oldp's id and then didn't happen, it leaves no record
+void AllocationTracer::cancelRealloc(void* oldp, uint32_t old_id)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd >= 0 && old_id != 0)
     {
-        return NULL;
+        this->insertId(oldp, old_id);
     }
-    buddy_allocator->checkOverFlow(oldp_md);
-    if (oldp_md->isFree())
+}
+
+// before the free, p may be handed out again as soon as it is released
+void AllocationTracer::recordFree(void* p)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->fd >= 0)
     {
-        return NULL; // TODO: check if needed in tests and delete after
+        this->appendRecord(TRACE_FREE, this->removeId(p), 0, 0);
     }
-    //buddy_allocator->checkOverFlow(oldp_md);
-    if(oldp_md->getBlockSize() > MAXIMAL_BUDDY_BLOCK)
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ HEAP PROFILE ~~~~~~~~~~~~~~~~~~~
+// samples about one allocation per sample_bytes allocated: every thread counts down the bytes to its next
+// sample, which is drawn from an exponential distribution, so a block's chance of being sampled depends
+// only on its size. a sample holds the allocating stack, and the samples of one stack add up in its bucket.
+// like the tracer, the tables are mmapped and nothing is allocated through smalloc
+struct ProfileSample
+{
+    uintptr_t block; // the header address, 0 for an empty slot
+    uint32_t bucket;
+    int32_t order; // PROFILE_ORDER_MMAP for mmap regions
+    size_t size;   // what the user asked for
+};
+
+struct ProfileBucket
+{
+    uint64_t hash; // 0 for an empty slot
+    size_t depth;
+    void* stack[PROFILE_MAX_DEPTH];
+    size_t live_samples;
+    size_t live_bytes;
+    size_t total_samples;
+    size_t total_bytes;
+};
+
+// counts down to the thread's next sample. constant initialized, the first allocation of a thread takes
+// the slow path and draws the real distance
+thread_local int64_t bytes_until_sample = 0;
+
+class HeapProfiler
+{
+private:
+    std::atomic<size_t> sample_bytes; // 0 while stopped
+    size_t last_sample_bytes; // what the tables were sampled with, for the dump
+    size_t num_of_dropped_samples; // the tables were full
+    std::mutex lock;
+    ProfileSample* samples;
+    ProfileBucket* buckets;
+
+    static size_t nextSampleDistance(size_t mean);
+    ProfileBucket* findBucket(void* const* stack, size_t depth);
+    bool insertSample(MallocMetadata* block, uint32_t bucket, int order, size_t size);
+    ProfileSample removeSample(MallocMetadata* block);
+public:
+    HeapProfiler();
+    ~HeapProfiler() = default;
+    bool start(size_t new_sample_bytes);
+    void stop();
+    void recordAllocation(MallocMetadata* block, size_t size, int order);
+    void recordFree(MallocMetadata* block);
+    bool dump(int fd);
+};
+
+HeapProfiler::HeapProfiler(): sample_bytes(0), last_sample_bytes(0), num_of_dropped_samples(0), lock(),
+    samples(nullptr), buckets(nullptr) {}
+
+// -log(u) * mean for a uniform u in (0, 1], with a xorshift per thread
+size_t HeapProfiler::nextSampleDistance(size_t mean)
+{
+    static thread_local uint64_t state = 0;
+    if (state == 0)
     {
-        //mmap
-        //mmap_allocator->checkOverFlow(oldp_md);
-        if(oldp_md->getBlockSize() == size + META_DATA_SIZE)
+        state = (monotonicNs() ^ uint64_t(reinterpret_cast<uintptr_t>(&state))) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double u = static_cast<double>((state >> 11) + 1) / 9007199254740992.0; // 2^53
+    return static_cast<size_t>(-std::log(u) * static_cast<double>(mean)) + 1;
+}
+
+// both tables are mapped on the first start and cleared on the next ones. stop keeps them, so a profile can
+// still be dumped after it
+bool HeapProfiler::start(size_t new_sample_bytes)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->sample_bytes.load(std::memory_order_relaxed) != 0)
+    {
+        return false;
+    }
+    size_t samples_size = PROFILE_SAMPLE_TABLE_SIZE * sizeof(ProfileSample);
+    size_t buckets_size = PROFILE_BUCKET_TABLE_SIZE * sizeof(ProfileBucket);
+    if (this->samples == nullptr)
+    {
+        void* table = mmap(NULL, samples_size + buckets_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (table == MAP_FAILED)
         {
-            //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
-            return oldp;
+            return false;
         }
-        //mmap_allocator->checkOverFlow(oldp_md);
-        size_t bytes_to_copy = oldp_md->getBlockSize()-META_DATA_SIZE;
-        void* newp = smalloc(size);
-        //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
-        //mmap_allocator->checkOverFlow(GET_METADATA(newp));
-        std::memmove(newp, oldp, bytes_to_copy);
-        //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
-        sfree(oldp);
-        //mmap_allocator->checkOverFlow(GET_METADATA(newp));
-        return newp;
+        this->samples = static_cast<ProfileSample*>(table);
+        this->buckets = reinterpret_cast<ProfileBucket*>(static_cast<char*>(table) + samples_size);
     }
     else
     {
-        //buddy_allocator
-        //buddy_allocator->checkOverFlow(oldp_md);
-        if (oldp_md->getBlockSize() >= size+META_DATA_SIZE)
+        // blocks sampled by the last run stay marked, their frees find nothing to drop
+        std::memset(static_cast<void*>(this->samples), 0, samples_size);
+        std::memset(static_cast<void*>(this->buckets), 0, buckets_size);
+    }
+    this->num_of_dropped_samples = 0;
+    this->last_sample_bytes = new_sample_bytes;
+    this->sample_bytes.store(new_sample_bytes, std::memory_order_relaxed);
+    return true;
+}
+
+// the threads notice at their next sample, or after PROFILE_IDLE_RECHECK_BYTES if one was off till now
+void HeapProfiler::stop()
+{
+    this->sample_bytes.store(0, std::memory_order_relaxed);
+}
+
+// bucket lookup by stack hash, with linear probing. buckets are never removed, they keep the totals
+ProfileBucket* HeapProfiler::findBucket(void* const* stack, size_t depth)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < depth; i++)
+    {
+        hash = (hash ^ uint64_t(reinterpret_cast<uintptr_t>(stack[i]))) * 0x100000001b3ull;
+    }
+    hash |= 1;
+    size_t mask = PROFILE_BUCKET_TABLE_SIZE - 1;
+    size_t i = (hash >> 4) & mask;
+    for (size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask)
+    {
+        ProfileBucket* bucket = &this->buckets[i];
+        if (bucket->hash == 0)
         {
-            // stats hasn't changed in this case
-            //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-            return oldp;
+            bucket->hash = hash;
+            bucket->depth = depth;
+            std::memcpy(bucket->stack, stack, depth * sizeof(void*));
+            return bucket;
         }
-        //buddy_allocator->checkOverFlow(oldp_md);
-        int current_order = buddy_allocator->convertSizeToOrder(oldp_md->getBlockSize());
-        size_t requested_block_size = buddy_allocator->next_power_of_two(size+META_DATA_SIZE);
-        int requested_order = buddy_allocator->convertSizeToOrder(requested_block_size);
-        //buddy_allocator->checkOverFlow(oldp_md);
-        if (buddy_allocator->canReallocByMerging(oldp_md,current_order,requested_order))
+        if (bucket->hash == hash && bucket->depth == depth &&
+            std::memcmp(bucket->stack, stack, depth * sizeof(void*)) == 0)
         {
-            //buddy_allocator->checkOverFlow(oldp_md);
-            //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-            return buddy_allocator->reallocByMerging(oldp_md, current_order, requested_order, oldp, oldp_md->getBlockSize()-META_DATA_SIZE);
+            return bucket;
         }
-        else
+    }
+    return nullptr;
+}
+
+// same scheme as the tracer's id table: linear probing, removal shifts the following entries back
+bool HeapProfiler::insertSample(MallocMetadata* block, uint32_t bucket, int order, size_t size)
+{
+    auto address = reinterpret_cast<uintptr_t>(block);
+    size_t mask = PROFILE_SAMPLE_TABLE_SIZE - 1;
+    size_t i = (address >> 7) & mask;
+    for (size_t probes = 0; this->samples[i].block != 0; probes++)
+    {
+        if (probes == mask / 2)
         {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    this->samples[i].block = address;
+    this->samples[i].bucket = bucket;
+    this->samples[i].order = order;
+    this->samples[i].size = size;
+    return true;
+}
 
-            // TODO: can we assume that there is must be a different block in the required size
-            //TODO: what if first realloc before malloc, is it considered as malloc for init requirement
-            //buddy_allocator->checkOverFlow(oldp_md);
-            size_t bytes_to_copy = oldp_md->getBlockSize()-META_DATA_SIZE;
-            void* newp = smalloc(size);
-            //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-            //buddy_allocator->checkOverFlow(GET_METADATA(newp));
-            std::memmove(newp, oldp, bytes_to_copy);
-            //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
-            sfree(oldp);
-            //buddy_allocator->checkOverFlow(GET_METADATA(newp));
-            return newp;
+ProfileSample HeapProfiler::removeSample(MallocMetadata* block)
+{
+    auto address = reinterpret_cast<uintptr_t>(block);
+    size_t mask = PROFILE_SAMPLE_TABLE_SIZE - 1;
+    size_t i = (address >> 7) & mask;
+    while (this->samples[i].block != address)
+    {
+        if (this->samples[i].block == 0)
+        {
+            return ProfileSample{}; // sampled before the last start
+        }
+        i = (i + 1) & mask;
+    }
+    ProfileSample sample = this->samples[i];
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; this->samples[j].block != 0; j = (j + 1) & mask)
+    {
+        size_t home = (this->samples[j].block >> 7) & mask;
+        // move j into the hole unless its home slot lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            this->samples[hole] = this->samples[j];
+            hole = j;
         }
     }
+    this->samples[hole] = ProfileSample{};
+    return sample;
 }
-// ~~~~~~~~~~~~~~~~~~~~~~~ IMPLEMENT STATISTICS ~~~~~~~~~~~~~~~~~~~
-size_t _num_free_blocks()
+
+// the slow path of sampleAllocation, taken once the thread's countdown runs out. it also draws the next
+// distance, or only rechecks later while the profiler is off
+void HeapProfiler::recordAllocation(MallocMetadata* block, size_t size, int order)
+{
+    size_t mean = this->sample_bytes.load(std::memory_order_relaxed);
+    if (mean == 0)
+    {
+        bytes_until_sample = PROFILE_IDLE_RECHECK_BYTES;
+        return;
+    }
+    bytes_until_sample = static_cast<int64_t>(std::min<size_t>(nextSampleDistance(mean), INT64_MAX));
+    void* stack[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES); // outside the lock, it may load libgcc
+    if (depth <= PROFILE_SKIP_FRAMES)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    ProfileBucket* bucket = this->findBucket(stack + PROFILE_SKIP_FRAMES, depth - PROFILE_SKIP_FRAMES);
+    if (bucket == nullptr || !this->insertSample(block, static_cast<uint32_t>(bucket - this->buckets), order, size))
+    {
+        this->num_of_dropped_samples++;
+        return;
+    }
+    bucket->live_samples++;
+    bucket->live_bytes += size;
+    bucket->total_samples++;
+    bucket->total_bytes += size;
+    block->setIsSampled(true);
+}
+
+// only for blocks that were marked sampled, so unsampled frees don't pay for the lock. the header isn't
+// read, it may be gone already
+void HeapProfiler::recordFree(MallocMetadata* block)
 {
-    return mem_man.getNumOfAllocatedBlocksThatAreFree();
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->samples == nullptr)
+    {
+        return;
+    }
+    ProfileSample sample = this->removeSample(block);
+    if (sample.block != 0)
+    {
+        this->buckets[sample.bucket].live_samples--;
+        this->buckets[sample.bucket].live_bytes -= sample.size;
+    }
 }
 
-size_t _num_free_bytes()
+// ~~~~~~~~~~~~~~~~~~~~~~~ ARENAS ~~~~~~~~~~~~~~~~~~~
+// a buddy allocator with its own chunk, statistics and lock, bound to one NUMA node. a thread allocates from
+// the arena of the node it first ran on, a block is freed to the arena whose chunk it is in
+class Arena
 {
-    return mem_man.getNumOfBytesInAllocatedBlocksThatAreFree();
+private:
+    ShardedStats stats;
+    BuddyAllocator buddy_allocator;
+    std::mutex lock;
+    std::atomic<bool> is_initialized;
+    int node;
+
+    friend class MemoryManager;
+    friend class PersistentHeap;
+public:
+    Arena();
+    ~Arena() = default;
+    void setUp(int cookie, int new_node);
+    void initialize(bool bind_to_node, bool populate);
+    bool isInitialized() const;
+    BuddyAllocator* getBuddyAllocator();
+    std::mutex& getLock();
+    int getNode() const;
+    void fillNodeStats(smalloc_node_stats* node_stats) const;
+    void addStats(size_t values[NUM_OF_STATS]) const;
+    size_t getFootprint() const;
+};
+
+Arena::Arena(): stats(), buddy_allocator(0, &stats), lock(), is_initialized(false), node(0) {}
+
+void Arena::setUp(int cookie, int new_node)
+{
+    this->buddy_allocator.cookie = cookie;
+    this->node = new_node;
 }
 
-size_t _num_allocated_blocks()
+// reserves the chunk, once. the page source serializes the arenas' chunks itself (sbrk isn't thread safe)
+void Arena::initialize(bool bind_to_node, bool populate)
 {
-    return mem_man.getNumOfAllocatedBlocks();
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->is_initialized.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    this->buddy_allocator.initFirstFreeBlocks(bind_to_node ? this->node : -1, populate);
+    this->is_initialized.store(true, std::memory_order_release);
 }
 
-size_t _num_allocated_bytes()
+bool Arena::isInitialized() const
 {
-    return mem_man.getNumOfBytesInAllocatedBlocks();
+    return this->is_initialized.load(std::memory_order_acquire);
 }
 
-size_t _num_meta_data_bytes()
+BuddyAllocator* Arena::getBuddyAllocator()
 {
-    return mem_man.getNumOfAllocatedBlocks() * META_DATA_SIZE;
+    return &(this->buddy_allocator);
 }
 
-size_t _size_meta_data()
+std::mutex& Arena::getLock()
 {
-    return META_DATA_SIZE;
+    return this->lock;
+}
+
+int Arena::getNode() const
+{
+    return this->node;
+}
+
+void Arena::fillNodeStats(smalloc_node_stats* node_stats) const
+{
+    size_t values[NUM_OF_STATS];
+    this->stats.snapshot(values);
+    node_stats->node = this->node;
+    node_stats->reserved_bytes = (this->isInitialized() && !this->buddy_allocator.isFirstAllocation()) ? BUDDY_CHUNK_SIZE : 0;
+    node_stats->used_bytes = values[STAT_BUDDY_GRANTED_BYTES];
+    node_stats->requested_bytes = values[STAT_BUDDY_REQUESTED_BYTES];
+    node_stats->num_used_blocks = values[STAT_BUDDY_BLOCKS] - values[STAT_BUDDY_FREE_BLOCKS];
+}
+
+void Arena::addStats(size_t values[NUM_OF_STATS]) const
+{
+    size_t arena_values[NUM_OF_STATS];
+    this->stats.snapshot(arena_values);
+    for (int stat = 0; stat < NUM_OF_STATS; stat++)
+    {
+        values[stat] += arena_values[stat];
+    }
+}
+
+// the chunk while the arena holds one. every block of it is counted, free or not, so this is the chunk's size
+size_t Arena::getFootprint() const
+{
+    return this->stats.get(STAT_BUDDY_BYTES) + META_DATA_SIZE * this->stats.get(STAT_BUDDY_BLOCKS);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ PERSISTENT HEAP ~~~~~~~~~~~~~~~~~~~
+// buddy chunks in a shared mapping of a file or memfd, which outlive the process. the file is a header
+// region followed by the chunks:
+//   [PersistentHeapHeader ... PERSISTENT_HEADER_SIZE][chunk 0][chunk 1]...
+// the header region is ALIGNMENT long so the chunks stay aligned, the file is sparse so that costs nothing.
+// every chunk is an arena of its own, which getArenaOf finds like any other, so sfree and srealloc work on
+// persistent blocks unchanged. only buddy sizes fit, there are no mmap regions in the file, and the blocks
+// are counted in the arenas of the chunks, not in the smalloc stats
+struct PersistentHeapHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;   // sizeof(MallocMetadata), a build with another layout can't take the file over
+    int32_t cookie;         // the key of the process that sealed the headers last
+    uint64_t num_of_chunks;
+    uint64_t base;          // where that process had it mapped, the next one tries the same address
+    uint64_t root_offset;   // from base, 0 for no root
+};
+
+class PersistentHeap
+{
+private:
+    std::mutex lock; // open and close
+    std::atomic<size_t> num_of_chunks; // 0 while closed
+    char* base;
+    size_t length;
+    Arena chunks[PERSISTENT_MAX_CHUNKS];
+
+    static char* mapFile(int fd, size_t length, uintptr_t recorded_base);
+    PersistentHeapHeader* getHeader();
+public:
+    PersistentHeap();
+    ~PersistentHeap() = default;
+    void* open(int fd, size_t new_num_of_chunks, int cookie);
+    bool close();
+    Arena* getArenaOf(intptr_t chunk_start);
+    bool isPersistent(const Arena* arena) const;
+    MallocMetadata* allocateBlock(int order, size_t requested_size, uint8_t tag);
+    bool setRoot(void* root);
+    void* getRoot();
+};
+
+PersistentHeap::PersistentHeap(): lock(), num_of_chunks(0), base(nullptr), length(0), chunks() {}
+
+// at recorded_base if that range is free, so pointers stored in the heap stay valid. elsewhere over an
+// aligned reservation otherwise
+char* PersistentHeap::mapFile(int fd, size_t length, uintptr_t recorded_base)
+{
+    if (recorded_base != 0 && recorded_base % ALIGNMENT == 0)
+    {
+        void* mapped = mmap(reinterpret_cast<void*>(recorded_base), length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if (mapped == reinterpret_cast<void*>(recorded_base))
+        {
+            return static_cast<char*>(mapped);
+        }
+        if (mapped != MAP_FAILED)
+        {
+            munmap(mapped, length);
+        }
+    }
+    void* reserved = mmap(nullptr, length + ALIGNMENT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    auto start = reinterpret_cast<uintptr_t>(reserved);
+    uintptr_t aligned = (start + ALIGNMENT - 1) & ~uintptr_t(ALIGNMENT - 1);
+    void* mapped = mmap(reinterpret_cast<void*>(aligned), length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        munmap(reserved, length + ALIGNMENT);
+        return nullptr;
+    }
+    if (aligned > start)
+    {
+        munmap(reserved, aligned - start);
+    }
+    size_t tail = start + length + ALIGNMENT - (aligned + length);
+    if (tail > 0)
+    {
+        munmap(reinterpret_cast<void*>(aligned + length), tail);
+    }
+    return static_cast<char*>(mapped);
+}
+
+PersistentHeapHeader* PersistentHeap::getHeader()
+{
+    return reinterpret_cast<PersistentHeapHeader*>(this->base);
+}
+
+// an empty file is made a heap of new_num_of_chunks chunks, anything else has to be a heap already
+// (new_num_of_chunks is ignored then). returns where the heap is mapped, NULL on failure
+void* PersistentHeap::open(int fd, size_t new_num_of_chunks, int cookie)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    struct stat file_stat{};
+    if (this->num_of_chunks.load(std::memory_order_relaxed) != 0 || fstat(fd, &file_stat) != 0)
+    {
+        return NULL;
+    }
+    PersistentHeapHeader old_header{};
+    bool is_new = (file_stat.st_size == 0);
+    if (is_new)
+    {
+        if (new_num_of_chunks == 0 || new_num_of_chunks > PERSISTENT_MAX_CHUNKS ||
+            ftruncate(fd, PERSISTENT_HEADER_SIZE + new_num_of_chunks * BUDDY_CHUNK_SIZE) != 0)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        if (pread(fd, &old_header, sizeof(old_header), 0) != sizeof(old_header) ||
+            old_header.magic != PERSISTENT_MAGIC || old_header.version != PERSISTENT_VERSION ||
+            old_header.header_size != sizeof(MallocMetadata) || old_header.num_of_chunks == 0 ||
+            old_header.num_of_chunks > PERSISTENT_MAX_CHUNKS ||
+            static_cast<size_t>(file_stat.st_size) != PERSISTENT_HEADER_SIZE + old_header.num_of_chunks * BUDDY_CHUNK_SIZE)
+        {
+            return NULL;
+        }
+        new_num_of_chunks = old_header.num_of_chunks;
+    }
+    size_t new_length = PERSISTENT_HEADER_SIZE + new_num_of_chunks * BUDDY_CHUNK_SIZE;
+    char* new_base = mapFile(fd, new_length, old_header.base);
+    if (new_base == nullptr)
+    {
+        if (is_new && ftruncate(fd, 0) != 0)
+        {
+            // the file is left with a size and no header, later opens reject it
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < new_num_of_chunks && !is_new; i++)
+    {
+        Arena* arena = &this->chunks[i];
+        arena->setUp(cookie, -1);
+        intptr_t chunk_start = reinterpret_cast<intptr_t>(new_base + PERSISTENT_HEADER_SIZE + i * BUDDY_CHUNK_SIZE);
+        intptr_t old_chunk_start = old_header.base + PERSISTENT_HEADER_SIZE + i * BUDDY_CHUNK_SIZE;
+        if (!arena->buddy_allocator.isValidPersistentChunk(chunk_start, old_header.cookie, old_chunk_start))
+        {
+            munmap(new_base, new_length);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < new_num_of_chunks; i++)
+    {
+        Arena* arena = &this->chunks[i];
+        std::lock_guard<std::mutex> arena_guard(arena->getLock());
+        arena->setUp(cookie, -1);
+        intptr_t chunk_start = reinterpret_cast<intptr_t>(new_base + PERSISTENT_HEADER_SIZE + i * BUDDY_CHUNK_SIZE);
+        if (is_new)
+        {
+            arena->buddy_allocator.layoutChunk(chunk_start);
+        }
+        else
+        {
+            arena->buddy_allocator.adoptChunk(chunk_start);
+        }
+        arena->is_initialized.store(true, std::memory_order_release);
+    }
+    // written last: a process that dies while sealing leaves a file the next open rejects
+    auto* header = reinterpret_cast<PersistentHeapHeader*>(new_base);
+    header->magic = PERSISTENT_MAGIC;
+    header->version = PERSISTENT_VERSION;
+    header->header_size = sizeof(MallocMetadata);
+    header->cookie = cookie;
+    header->num_of_chunks = new_num_of_chunks;
+    header->base = reinterpret_cast<uintptr_t>(new_base);
+    header->root_offset = is_new ? 0 : old_header.root_offset;
+    this->base = new_base;
+    this->length = new_length;
+    this->num_of_chunks.store(new_num_of_chunks, std::memory_order_release);
+    return new_base;
+}
+
+// writes the heap back and unmaps it. pointers into it are dangling afterwards, and no other thread may
+// use the heap meanwhile
+bool PersistentHeap::close()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    size_t n = this->num_of_chunks.load(std::memory_order_relaxed);
+    if (n == 0)
+    {
+        return false;
+    }
+    this->num_of_chunks.store(0, std::memory_order_release);
+    for (size_t i = 0; i < n; i++)
+    {
+        Arena* arena = &this->chunks[i];
+        std::lock_guard<std::mutex> arena_guard(arena->getLock());
+        arena->is_initialized.store(false, std::memory_order_release);
+        arena->buddy_allocator.detachChunk();
+    }
+    bool synced = (msync(this->base, this->length, MS_SYNC) == 0);
+    munmap(this->base, this->length);
+    this->base = nullptr;
+    this->length = 0;
+    return synced;
+}
+
+Arena* PersistentHeap::getArenaOf(intptr_t chunk_start)
+{
+    size_t n = this->num_of_chunks.load(std::memory_order_acquire);
+    if (n == 0)
+    {
+        return nullptr;
+    }
+    intptr_t first_chunk = reinterpret_cast<intptr_t>(this->base + PERSISTENT_HEADER_SIZE);
+    if (chunk_start < first_chunk || chunk_start >= first_chunk + static_cast<intptr_t>(n * BUDDY_CHUNK_SIZE))
+    {
+        return nullptr;
+    }
+    return &this->chunks[(chunk_start - first_chunk) / BUDDY_CHUNK_SIZE];
+}
+
+bool PersistentHeap::isPersistent(const Arena* arena) const
+{
+    return arena >= this->chunks && arena < this->chunks + PERSISTENT_MAX_CHUNKS;
+}
+
+// first fit over the chunks
+MallocMetadata* PersistentHeap::allocateBlock(int order, size_t requested_size, uint8_t tag)
+{
+    size_t n = this->num_of_chunks.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; i++)
+    {
+        std::lock_guard<std::mutex> guard(this->chunks[i].getLock());
+        MallocMetadata* block = this->chunks[i].buddy_allocator.allocateBlock(order, requested_size, tag);
+        if (block != nullptr)
+        {
+            return block;
+        }
+    }
+    return nullptr;
+}
+
+// the root is kept as an offset, so it survives the heap being mapped somewhere else. NULL clears it
+bool PersistentHeap::setRoot(void* root)
+{
+    if (this->num_of_chunks.load(std::memory_order_acquire) == 0 ||
+        (root != NULL && (static_cast<char*>(root) < this->base || static_cast<char*>(root) >= this->base + this->length)))
+    {
+        return false;
+    }
+    this->getHeader()->root_offset = (root == NULL) ? 0 : static_cast<char*>(root) - this->base;
+    return true;
+}
+
+void* PersistentHeap::getRoot()
+{
+    if (this->num_of_chunks.load(std::memory_order_acquire) == 0 || this->getHeader()->root_offset == 0)
+    {
+        return NULL;
+    }
+    return this->base + this->getHeader()->root_offset;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ HEAP LIMITS ~~~~~~~~~~~~~~~~~~~
+// the heap only grows when an arena maps a chunk or a region is mapped, so the limits are checked there and
+// nowhere else. the footprint is summed from the sharded counters at that point, and while no limit is set
+// the check is a single load. threads growing the heap at the same moment don't see each other's growth, so
+// the hard limit can be passed by what they map together
+class HeapLimits
+{
+private:
+    std::atomic<size_t> soft_limit; // 0 for none
+    std::atomic<size_t> hard_limit;
+    std::atomic<bool> is_over_soft_limit; // from a crossing until the heap is seen under the limit again
+    // growths admitted and not yet settled may be missing from the footprint, they count as reserved - the
+    // difference of these two. both only grow, so a reservation can't mistake another's settling for nothing
+    // having changed
+    std::atomic<size_t> reserved_bytes;
+    std::atomic<size_t> settled_bytes;
+    std::mutex callbacks_lock;
+    smalloc_pressure_callback callbacks[SMALLOC_MAX_PRESSURE_CALLBACKS];
+    void* callback_args[SMALLOC_MAX_PRESSURE_CALLBACKS];
+    int num_of_callbacks;
+public:
+    HeapLimits();
+    ~HeapLimits() = default;
+    bool setLimits(size_t new_soft_limit, size_t new_hard_limit);
+    size_t getSoftLimit() const;
+    size_t getHardLimit() const;
+    bool isLimited() const;
+    bool admitGrowth(size_t footprint, size_t num_of_bytes);
+    size_t getReservedBytes() const;
+    size_t getSettledBytes() const;
+    bool reserveGrowth(size_t seen_reserved_bytes, size_t num_of_bytes);
+    void settleGrowth(size_t num_of_bytes);
+    void clearPressure();
+    bool addCallback(smalloc_pressure_callback callback, void* arg);
+    bool removeCallback(smalloc_pressure_callback callback, void* arg);
+    void runCallbacks(size_t footprint);
+};
+
+// a growth of the heap, admitted against the limits before it is mapped. its bytes stay reserved until the
+// object goes out of scope, by when the growth shows in the footprint (or didn't happen)
+class HeapGrowth
+{
+private:
+    size_t num_of_bytes;
+    void settle();
+public:
+    HeapGrowth();
+    ~HeapGrowth();
+    HeapGrowth(const HeapGrowth&) = delete;
+    HeapGrowth& operator=(const HeapGrowth&) = delete;
+    bool admit(size_t num_of_bytes, bool mmap_locked);
+};
+
+// what the small object layer admits a new slab with. it holds a class lock then, which no one takes after
+// the mmap lock, so reading the footprint is safe
+class SlabGrowth
+{
+private:
+    HeapGrowth growth;
+public:
+    bool admit(size_t num_of_bytes)
+    {
+        return this->growth.admit(num_of_bytes, false);
+    }
+};
+
+// set by a growth that crossed the soft limit, the thread relieves the pressure once it holds no lock
+thread_local bool heap_pressure_pending = false;
+
+HeapLimits::HeapLimits(): soft_limit(0), hard_limit(0), is_over_soft_limit(false), reserved_bytes(0),
+                          settled_bytes(0), callbacks_lock(), callbacks(), callback_args(), num_of_callbacks(0) {}
+
+// 0 turns a limit off. false (changing nothing) if the soft limit is above the hard one
+bool HeapLimits::setLimits(size_t new_soft_limit, size_t new_hard_limit)
+{
+    if (new_soft_limit != 0 && new_hard_limit != 0 && new_soft_limit > new_hard_limit)
+    {
+        return false;
+    }
+    this->soft_limit.store(new_soft_limit, std::memory_order_relaxed);
+    this->hard_limit.store(new_hard_limit, std::memory_order_relaxed);
+    this->is_over_soft_limit.store(false, std::memory_order_relaxed);
+    return true;
+}
+
+size_t HeapLimits::getSoftLimit() const
+{
+    return this->soft_limit.load(std::memory_order_relaxed);
+}
+
+size_t HeapLimits::getHardLimit() const
+{
+    return this->hard_limit.load(std::memory_order_relaxed);
+}
+
+bool HeapLimits::isLimited() const
+{
+    return this->getSoftLimit() != 0 || this->getHardLimit() != 0;
+}
+
+// footprint is the heap before growing by num_of_bytes. false if that would pass the hard limit. crossing the
+// soft limit marks the pressure pending for the calling thread, once per crossing
+bool HeapLimits::admitGrowth(size_t footprint, size_t num_of_bytes)
+{
+    size_t hard = this->getHardLimit();
+    if (hard != 0 && footprint + num_of_bytes > hard)
+    {
+        return false;
+    }
+    size_t soft = this->getSoftLimit();
+    if (soft == 0)
+    {
+        return true;
+    }
+    if (footprint <= soft)
+    {
+        this->clearPressure();
+    }
+    if (footprint + num_of_bytes > soft && !this->is_over_soft_limit.exchange(true, std::memory_order_relaxed))
+    {
+        heap_pressure_pending = true;
+    }
+    return true;
+}
+
+size_t HeapLimits::getReservedBytes() const
+{
+    return this->reserved_bytes.load();
+}
+
+size_t HeapLimits::getSettledBytes() const
+{
+    return this->settled_bytes.load();
+}
+
+// false if another growth was reserved since seen_reserved_bytes was read, the caller checks again
+bool HeapLimits::reserveGrowth(size_t seen_reserved_bytes, size_t num_of_bytes)
+{
+    return this->reserved_bytes.compare_exchange_strong(seen_reserved_bytes, seen_reserved_bytes + num_of_bytes);
+}
+
+void HeapLimits::settleGrowth(size_t num_of_bytes)
+{
+    this->settled_bytes.fetch_add(num_of_bytes);
+}
+
+void HeapLimits::clearPressure()
+{
+    if (this->is_over_soft_limit.load(std::memory_order_relaxed))
+    {
+        this->is_over_soft_limit.store(false, std::memory_order_relaxed);
+    }
+}
+
+bool HeapLimits::addCallback(smalloc_pressure_callback callback, void* arg)
+{
+    std::lock_guard<std::mutex> guard(this->callbacks_lock);
+    if (callback == nullptr || this->num_of_callbacks == SMALLOC_MAX_PRESSURE_CALLBACKS)
+    {
+        return false;
+    }
+    this->callbacks[this->num_of_callbacks] = callback;
+    this->callback_args[this->num_of_callbacks] = arg;
+    this->num_of_callbacks++;
+    return true;
+}
+
+bool HeapLimits::removeCallback(smalloc_pressure_callback callback, void* arg)
+{
+    std::lock_guard<std::mutex> guard(this->callbacks_lock);
+    for (int i = 0; i < this->num_of_callbacks; i++)
+    {
+        if (this->callbacks[i] == callback && this->callback_args[i] == arg)
+        {
+            // keeps the registration order
+            for (int j = i + 1; j < this->num_of_callbacks; j++)
+            {
+                this->callbacks[j - 1] = this->callbacks[j];
+                this->callback_args[j - 1] = this->callback_args[j];
+            }
+            this->num_of_callbacks--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the callbacks run on a copy, so they may allocate, free and (un)register callbacks themselves
+void HeapLimits::runCallbacks(size_t footprint)
+{
+    smalloc_pressure_callback callbacks_copy[SMALLOC_MAX_PRESSURE_CALLBACKS];
+    void* args_copy[SMALLOC_MAX_PRESSURE_CALLBACKS];
+    int num_of_callbacks_copy;
+    {
+        std::lock_guard<std::mutex> guard(this->callbacks_lock);
+        num_of_callbacks_copy = this->num_of_callbacks;
+        std::copy(this->callbacks, this->callbacks + num_of_callbacks_copy, callbacks_copy);
+        std::copy(this->callback_args, this->callback_args + num_of_callbacks_copy, args_copy);
+    }
+    for (int i = 0; i < num_of_callbacks_copy; i++)
+    {
+        callbacks_copy[i](footprint, this->getSoftLimit(), args_copy[i]);
+    }
+}
+
+// the arena of this thread, set (to an initialized arena) on its first allocation
+thread_local Arena* thread_arena = nullptr;
+
+class MemoryManager
+{
+private:
+    int cookie;
+    int num_of_arenas;
+    ShardedStats stats; // the mmap allocator's, every arena keeps its own
+    Arena arenas[MAX_ARENAS];
+    std::mutex mmap_lock;
+    MMapAllocator mmap_allocator;
+    AllocationTracer tracer;
+    HeapProfiler profiler;
+    PersistentHeap persistent_heap;
+    HeapLimits heap_limits;
+public:
+    MemoryManager();
+    ~MemoryManager() = default;
+    Arena* getThreadArena();
+    Arena* initializeArena(int index, int prefault);
+    Arena* getArenaOf(const MallocMetadata* block);
+    Arena* getArena(int index);
+    int getNumOfArenas() const;
+    std::mutex& getMMapLock();
+    MMapAllocator* getMMapAllocator();
+    AllocationTracer* getTracer();
+    HeapProfiler* getProfiler();
+    PersistentHeap* getPersistentHeap();
+    HeapLimits* getHeapLimits();
+    size_t getFootprint();
+    size_t getFootprintMMapLocked() const;
+    size_t releaseFreeChunks();
+    void addBuddyStats(CoreStats* core_stats) const;
+    void addMMapStats(CoreStats* core_stats) const;
+    void fillStatsSnapshot(smalloc_stats_snapshot* snapshot) const;
+    void fillTagUsage(smalloc_tag_usage* usage, size_t max_tags) const;
+    int getCookie() const;
+};
+
+// rand() isn't seeded, it would give every process the same key
+static int makeCookieKey()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t x = uint64_t(ts.tv_nsec) ^ (uint64_t(ts.tv_sec) << 32) ^ uint64_t(reinterpret_cast<uintptr_t>(&ts));
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return static_cast<int>(x ^ (x >> 32));
+}
+
+MemoryManager::MemoryManager(): cookie(makeCookieKey()), num_of_arenas(std::min(readNumOfNumaNodes(), MAX_ARENAS)),
+                                stats(), arenas(), mmap_lock(), mmap_allocator(cookie, &stats), tracer(), profiler(), persistent_heap(), heap_limits()
+{
+    for (int i = 0; i < MAX_ARENAS; i++)
+    {
+        this->arenas[i].setUp(this->cookie, i);
+    }
+}
+
+// the arena of the calling thread's node. the thread only looks at its own pointer after the first call,
+// that arena is initialized by then. nullptr while the heap limits don't admit the arena's chunk
+Arena* MemoryManager::getThreadArena() {
+    if (thread_arena == nullptr)
+    {
+        thread_arena = this->initializeArena(currentNumaNode() % this->num_of_arenas, SMALLOC_PREFAULT_NONE);
+    }
+    return thread_arena;
+}
+
+// reserves the arena's chunk unless that was done already, nullptr if the heap limits don't admit it. prefault
+// is the smalloc_init mode, a chunk reserved with SMALLOC_PREFAULT_POPULATE is faulted in as it is mapped
+Arena* MemoryManager::initializeArena(int index, int prefault) {
+    Arena* arena = &(this->arenas[index]);
+    if (!arena->isInitialized())
+    {
+        HeapGrowth growth;
+        if (!growth.admit(BUDDY_CHUNK_SIZE, false))
+        {
+            return nullptr;
+        }
+        // with a single node there is nothing to bind to
+        arena->initialize(this->num_of_arenas > 1, prefault == SMALLOC_PREFAULT_POPULATE);
+    }
+    return arena;
+}
+
+// every chunk is ALIGNMENT aligned and ALIGNMENT long, so the chunk of a block is its address rounded down
+Arena* MemoryManager::getArenaOf(const MallocMetadata* block) {
+    intptr_t chunk_start = reinterpret_cast<intptr_t>(block) & ~static_cast<intptr_t>(ALIGNMENT - 1);
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        if (this->arenas[i].isInitialized() && this->arenas[i].getBuddyAllocator()->getChunkStart() == chunk_start)
+        {
+            return &(this->arenas[i]);
+        }
+    }
+    return this->persistent_heap.getArenaOf(chunk_start);
+}
+
+Arena* MemoryManager::getArena(int index) {
+    return &(this->arenas[index]);
+}
+
+int MemoryManager::getNumOfArenas() const {
+    return this->num_of_arenas;
+}
+
+std::mutex& MemoryManager::getMMapLock() {
+    return this->mmap_lock;
+}
+
+MMapAllocator* MemoryManager::getMMapAllocator() {
+    return &(this->mmap_allocator);
+}
+
+AllocationTracer* MemoryManager::getTracer() {
+    return &(this->tracer);
+}
+
+HeapProfiler* MemoryManager::getProfiler() {
+    return &(this->profiler);
+}
+
+PersistentHeap* MemoryManager::getPersistentHeap() {
+    return &(this->persistent_heap);
+}
+
+int MemoryManager::getCookie() const {
+    return this->cookie;
+}
+
+// the core's stats of the buddy engine, every arena's blocks with their headers
+void MemoryManager::addBuddyStats(CoreStats* core_stats) const
+{
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        const BuddyAllocator* buddy_allocator = &(this->arenas[i].buddy_allocator);
+        core_stats->free_blocks += buddy_allocator->getNumOfAllocatedBlocksThatAreFree();
+        core_stats->free_bytes += buddy_allocator->getNumOfBytesInAllocatedBlocksThatAreFree();
+        core_stats->allocated_blocks += buddy_allocator->getNumOfAllocatedBlocks();
+        core_stats->allocated_bytes += buddy_allocator->getNumOfBytesInAllocatedBlocks();
+        core_stats->meta_data_bytes += buddy_allocator->getNumOfAllocatedBlocks() * META_DATA_SIZE;
+    }
+}
+
+// the mmap regions never count as free, the retained ones aren't blocks
+void MemoryManager::addMMapStats(CoreStats* core_stats) const
+{
+    core_stats->allocated_blocks += this->mmap_allocator.getNumOfAllocatedBlocks();
+    core_stats->allocated_bytes += this->mmap_allocator.getNumOfBytesInAllocatedBlocks();
+    core_stats->meta_data_bytes += this->mmap_allocator.getNumOfAllocatedBlocks() * META_DATA_SIZE;
+}
+
+void MemoryManager::fillStatsSnapshot(smalloc_stats_snapshot* snapshot) const
+{
+    size_t values[NUM_OF_STATS];
+    this->stats.snapshot(values);
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        this->arenas[i].addStats(values);
+    }
+    snapshot->num_free_blocks = values[STAT_BUDDY_FREE_BLOCKS];
+    snapshot->num_free_bytes = values[STAT_BUDDY_FREE_BYTES];
+    snapshot->num_allocated_blocks = values[STAT_BUDDY_BLOCKS] + values[STAT_MMAP_BLOCKS];
+    snapshot->num_allocated_bytes = values[STAT_BUDDY_BYTES] + values[STAT_MMAP_BYTES];
+    snapshot->num_meta_data_bytes = snapshot->num_allocated_blocks * META_DATA_SIZE;
+    snapshot->num_mmap_blocks = values[STAT_MMAP_BLOCKS];
+    snapshot->num_mmap_bytes = values[STAT_MMAP_BYTES];
+    snapshot->requested_bytes = values[STAT_BUDDY_REQUESTED_BYTES] + values[STAT_MMAP_REQUESTED_BYTES];
+    snapshot->mmap_retain_threshold = this->mmap_allocator.getRetainThreshold();
+    snapshot->mmap_retained_bytes = this->mmap_allocator.getCachedBytes();
+}
+
+HeapLimits* MemoryManager::getHeapLimits() {
+    return &(this->heap_limits);
+}
+
+// what the heap has mapped: the arenas' chunks, the mmap regions, cached ones included, and the small objects'
+// slabs. the persistent heap is the caller's file and isn't counted
+// takes the mmap lock, after the arena lock when the buddy's allocateBuddyBlock asks
+size_t MemoryManager::getFootprint()
+{
+    std::lock_guard<std::mutex> guard(this->mmap_lock);
+    return this->getFootprintMMapLocked();
+}
+
+// a freed region moves from the granted bytes to the cached ones (and an evicted one leaves the cache) under
+// the mmap lock, so the caller holds it and the region is counted exactly once
+size_t MemoryManager::getFootprintMMapLocked() const
+{
+    size_t footprint = this->stats.get(STAT_MMAP_GRANTED_BYTES) + META_DATA_SIZE * this->stats.get(STAT_MMAP_BLOCKS) +
+                       this->mmap_allocator.getCachedBytes() + heap.getSmallObjects()->getFootprint();
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        footprint += this->arenas[i].getFootprint();
+    }
+    return footprint;
+}
+
+// unmaps the chunk of every arena that has no used block left, returns the bytes that went back
+size_t MemoryManager::releaseFreeChunks()
+{
+    size_t num_of_bytes = 0;
+#if BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        Arena* arena = &(this->arenas[i]);
+        if (!arena->isInitialized())
+        {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(arena->getLock());
+        if (arena->getBuddyAllocator()->releaseChunkIfFree())
+        {
+            num_of_bytes += BUDDY_CHUNK_SIZE;
+        }
+    }
+#endif
+    return num_of_bytes;
+}
+
+void MemoryManager::fillTagUsage(smalloc_tag_usage* usage, size_t max_tags) const
+{
+    size_t values[NUM_OF_STATS];
+    this->stats.snapshot(values);
+    for (int i = 0; i < this->num_of_arenas; i++)
+    {
+        this->arenas[i].addStats(values);
+    }
+    for (size_t tag = 0; tag < max_tags && tag < SMALLOC_MAX_TAGS; tag++)
+    {
+        usage[tag].live_blocks = values[STAT_TAG_BLOCKS + tag];
+        usage[tag].live_bytes = values[STAT_TAG_BYTES + tag];
+    }
+}
+
+MemoryManager mem_man;
+HeapCore heap;
+//BuddyAllocator buddy_allocator = mem_man.getBuddyAllocator();
+
+// the check on the header of a block the user handed back, from HARDENING_BOUNDARY up
+static void checkBoundary(MallocMetadata* md)
+{
+#if MALLOC_HARDENING >= HARDENING_BOUNDARY
+    checkCookie(md, mem_man.getCookie());
+#else
+    (void) md;
+#endif
+}
+
+// sfree_sized's size has to be the block's, a wrong one would free a block of the wrong order or unmap the
+// wrong length. aborts like a bad cookie
+static void checkSizedBlock(const MallocMetadata* md, size_t block_size)
+{
+#if MALLOC_HARDENING >= HARDENING_BOUNDARY
+    if (md->getBlockSize() != block_size)
+    {
+        exit(0xdeadbeef);
+    }
+#else
+    (void) md;
+    (void) block_size;
+#endif
+}
+
+// what smalloc tags its blocks with, see smalloc_set_tag
+thread_local uint8_t current_tag = 0;
+
+HeapGrowth::HeapGrowth(): num_of_bytes(0) {}
+
+HeapGrowth::~HeapGrowth()
+{
+    this->settle();
+}
+
+void HeapGrowth::settle()
+{
+    if (this->num_of_bytes != 0)
+    {
+        mem_man.getHeapLimits()->settleGrowth(this->num_of_bytes);
+        this->num_of_bytes = 0;
+    }
+}
+
+// every growth of the heap asks here first. false if it would pass the hard limit. the footprint is read
+// between reading the reservations and reserving, so two growths racing each other can't both fit in the
+// room left for one. settled is read before the footprint: a growth settled by then is in the footprint, one
+// settled after is still counted as reserved (twice at worst, which only errs on the safe side). mmap_locked
+// is whether the caller holds the mmap lock already. admitting again first settles what was admitted before
+bool HeapGrowth::admit(size_t new_num_of_bytes, bool mmap_locked)
+{
+    this->settle();
+    HeapLimits* limits = mem_man.getHeapLimits();
+    if (!limits->isLimited())
+    {
+        return true;
+    }
+    while (true)
+    {
+        size_t reserved = limits->getReservedBytes();
+        size_t settled = limits->getSettledBytes();
+        if (settled > reserved)
+        {
+            // a growth reserved after reserved was read has settled already
+            continue;
+        }
+        size_t footprint = mmap_locked ? mem_man.getFootprintMMapLocked() : mem_man.getFootprint();
+        if (!limits->admitGrowth(footprint + (reserved - settled), new_num_of_bytes))
+        {
+            return false;
+        }
+        if (limits->reserveGrowth(reserved, new_num_of_bytes))
+        {
+            this->num_of_bytes = new_num_of_bytes;
+            return true;
+        }
+    }
+}
+
+// the soft limit was crossed: trim what the allocator holds for reuse, and if that isn't enough ask the
+// callbacks. called without any lock held, the callbacks may well free
+static void relieveHeapPressure()
+{
+    heap_pressure_pending = false;
+    MallocMetadata* evicted;
+    {
+        std::lock_guard<std::mutex> guard(mem_man.getMMapLock());
+        evicted = mem_man.getMMapAllocator()->onMemoryPressure();
+    }
+    MMapAllocator::unmapRegions(evicted);
+    mem_man.releaseFreeChunks();
+    HeapLimits* limits = mem_man.getHeapLimits();
+    size_t footprint = mem_man.getFootprint();
+    if (footprint <= limits->getSoftLimit())
+    {
+        limits->clearPressure();
+        return;
+    }
+    limits->runCallbacks(footprint);
+}
+
+static inline void relieveHeapPressureIfPending()
+{
+    if (heap_pressure_pending)
+    {
+        relieveHeapPressure();
+    }
+}
+
+// the buddy calls with the arena lock taken. allocations come from the calling thread's arena
+static MallocMetadata* allocateBuddyBlock(int order, size_t requested_size, uint8_t tag)
+{
+    Arena* arena = mem_man.getThreadArena();
+    if (arena == nullptr)
+    {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> guard(arena->getLock());
+    BuddyAllocator* buddy_allocator = arena->getBuddyAllocator();
+    MallocMetadata* block = buddy_allocator->allocateBlock(order, requested_size, tag);
+#if BUDDY_CHUNK_BACKEND != CHUNK_BACKEND_SBRK
+    // only an allocation that found nothing asks whether the chunk was released, and maps a new one
+    HeapGrowth growth;
+    if (block == nullptr && buddy_allocator->isFirstAllocation() && growth.admit(BUDDY_CHUNK_SIZE, false) &&
+        buddy_allocator->reserveReleasedChunk())
+    {
+        block = buddy_allocator->allocateBlock(order, requested_size, tag);
+    }
+#endif
+    return block;
+}
+
+// frees go back to the arena the block came from. a block in none of the chunks isn't ours and is ignored
+static void freeBuddyBlock(MallocMetadata* block, int order)
+{
+    Arena* arena = mem_man.getArenaOf(block);
+    if (arena == nullptr)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(arena->getLock());
+    arena->getBuddyAllocator()->freeBlock(block, order);
+}
+
+// a block of the persistent heap, only buddy sizes fit there
+static void* allocatePersistent(size_t size, uint8_t tag)
+{
+    if (size == 0 || size + META_DATA_SIZE > MAXIMAL_BUDDY_BLOCK)
+    {
+        return NULL;
+    }
+    int order = BuddyAllocator::convertSizeToOrder(BuddyAllocator::next_power_of_two(size + META_DATA_SIZE));
+    MallocMetadata* block = mem_man.getPersistentHeap()->allocateBlock(order, size, tag);
+    return (block == nullptr) ? NULL : GET_USER_PTR(block);
+}
+
+// all the heap profiler costs an allocation while it's off is this decrement
+static inline void sampleAllocation(MallocMetadata* block, size_t size, int order)
+{
+    bytes_until_sample -= static_cast<int64_t>(size);
+    if (bytes_until_sample < 0)
+    {
+        mem_man.getProfiler()->recordAllocation(block, size, order);
+    }
+}
+
+static inline void dropSample(MallocMetadata* block)
+{
+    if (block->isSampled())
+    {
+        block->setIsSampled(false);
+        mem_man.getProfiler()->recordFree(block);
+    }
+}
+// ~~~~~~~~~~~~~~ IMPLEMENT MALLOC, FREE, CALLOC, REALLOC ~~~~~~~~~~~~~~~~~~~~~~
+
+// the public smalloc, scalloc, sfree and srealloc after these implementations record the call in the trace and
+// then run the pressure relief, with no lock held. the implementations only call each other, so a call is
+// recorded once and the callbacks' frees are recorded like any other
+static void* allocateUserBlock(size_t size, int tag)
+{
+    LATENCY_SCOPE(LATENCY_SMALLOC_BUDDY_HIT);
+    void* p = (tag < 0 || tag >= SMALLOC_MAX_TAGS) ? NULL : heap.allocate(size, tag);
+    if (p == nullptr)
+    {
+        LATENCY_PATH(LATENCY_SMALLOC_FAILED);
+    }
+    return p;
+}
+
+static void* allocateZeroedBlock(size_t num, size_t size)
+{
+    LATENCY_SCOPE(LATENCY_SCALLOC);
+    void* allocated_block = allocateUserBlock(num * size, current_tag);
+    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
+    if (allocated_block == nullptr)
+    {
+        return NULL;
+    }
+    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
+    std::memset(allocated_block, 0, num * size); // TODO: should we set all bytes in the block to 0 or just the amount the user asked for
+    //buddy_allocator->checkOverFlow(GET_METADATA(allocated_block));
+    return allocated_block;
+    // relevant stats are added inside smalloc
+}
+
+static void freeUserBlock(void* p)
+{
+    LATENCY_SCOPE(LATENCY_SFREE_BUDDY);
+    heap.free(p);
+}
+
+static void* reallocateUserBlock(void* oldp, size_t size)
+{
+    LATENCY_SCOPE(LATENCY_SREALLOC_IN_PLACE);
+    return heap.reallocate(oldp, size, current_tag);
+}
+
+// ~~~~~~~~~~~~~~ BUDDY ENGINE ~~~~~~~~~~~~~~~~~~~~~~
+// the core has validated the size, the tag and that p isn't NULL. what it hands to the buddy engine and the
+// mmap regions is told apart by owns, which checks the header before anything else reads it
+
+bool BuddyEngine::owns(const void* p) const
+{
+    MallocMetadata* md = GET_METADATA(p);
+    checkBoundary(md);
+    return md->getBlockSize() <= MAXIMAL_BUDDY_BLOCK;
+}
+
+void* BuddyEngine::allocate(size_t size, int tag)
+{
+    size_t block_size = BuddyAllocator::next_power_of_two(size + META_DATA_SIZE);
+    int order = BuddyAllocator::convertSizeToOrder(block_size);
+
+    // need to check what to do if there is no available size
+    MallocMetadata* block_to_use = allocateBuddyBlock(order, size, static_cast<uint8_t>(tag));
+    if (block_to_use == nullptr)
+    {
+        return NULL;
+    }
+    //buddy_allocator->checkOverFlow(block_to_use);
+    sampleAllocation(block_to_use, size, order);
+    return GET_USER_PTR(block_to_use);
+}
+
+void BuddyEngine::free(void* p)
+{
+    MallocMetadata* metadata = GET_METADATA(p);
+    if (metadata->isFree()) return;
+    dropSample(metadata);
+    //buddy_allocator->checkOverFlow(metadata);
+    int order = BuddyAllocator::convertSizeToOrder(metadata->getBlockSize());
+    //buddy_allocator->checkOverFlow(metadata);
+    freeBuddyBlock(metadata, order);
+}
+
+// the caller told us the size, so the block size and order are computed instead of read from the header.
+// hardened builds still make sure they match it
+void BuddyEngine::freeSized(void* p, size_t size)
+{
+    MallocMetadata* metadata = GET_METADATA(p);
+    checkBoundary(metadata);
+    if (metadata->isFree()) return;
+    size_t block_size = BuddyAllocator::next_power_of_two(size + META_DATA_SIZE);
+    checkSizedBlock(metadata, block_size);
+    dropSample(metadata);
+    freeBuddyBlock(metadata, BuddyAllocator::convertSizeToOrder(block_size));
+}
+
+void* BuddyEngine::reallocate(void* oldp, size_t size)
+{
+    MallocMetadata* oldp_md = GET_METADATA(oldp);
+    if (oldp_md->isFree())
+    {
+        return NULL; // TODO: check if needed in tests and delete after
+    }
+    Arena* arena = mem_man.getArenaOf(oldp_md);
+    if (arena == nullptr)
+    {
+        return NULL;
+    }
+    BuddyAllocator* buddy_allocator = arena->getBuddyAllocator();
+    std::unique_lock<std::mutex> guard(arena->getLock());
+    //buddy_allocator->checkOverFlow(oldp_md);
+    if (oldp_md->getBlockSize() >= size+META_DATA_SIZE)
+    {
+        // stats hasn't changed in this case, only the requested size did
+        int order = buddy_allocator->convertSizeToOrder(oldp_md->getBlockSize());
+        buddy_allocator->unaccountUsedBlock(oldp_md, order);
+        buddy_allocator->accountUsedBlock(oldp_md, order, size, oldp_md->getTag());
+        return oldp;
+    }
+    //buddy_allocator->checkOverFlow(oldp_md);
+    int current_order = buddy_allocator->convertSizeToOrder(oldp_md->getBlockSize());
+    size_t requested_block_size = buddy_allocator->next_power_of_two(size+META_DATA_SIZE);
+    int requested_order = buddy_allocator->convertSizeToOrder(requested_block_size);
+    //buddy_allocator->checkOverFlow(oldp_md);
+    // sizes above MAXIMAL_BUDDY_BLOCK have no order to merge up to, they always move to mmap
+    if (requested_order <= MAX_ORDER && buddy_allocator->canReallocByMerging(oldp_md,current_order,requested_order))
+    {
+        //buddy_allocator->checkOverFlow(oldp_md);
+        //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
+        LATENCY_PATH(LATENCY_SREALLOC_MERGE);
+        buddy_allocator->unaccountUsedBlock(oldp_md, current_order);
+        bool was_sampled = oldp_md->isSampled();
+        uint8_t tag = oldp_md->getTag();
+        void* newp = buddy_allocator->reallocByMerging(oldp_md, current_order, requested_order, oldp, oldp_md->getBlockSize()-META_DATA_SIZE);
+        buddy_allocator->accountUsedBlock(GET_METADATA(newp), requested_order, size, tag);
+        guard.unlock();
+        if (was_sampled)
+        {
+            // the header may have moved down to the buddy's and the old one be user data now. the sample
+            // is dropped by the old address, and the merged block is counted like a new allocation
+            GET_METADATA(newp)->setIsSampled(false);
+            mem_man.getProfiler()->recordFree(oldp_md);
+        }
+        sampleAllocation(GET_METADATA(newp), size, requested_order);
+        return newp;
+    }
+    else
+    {
+
+        // TODO: can we assume that there is must be a different block in the required size
+        //TODO: what if first realloc before malloc, is it considered as malloc for init requirement
+        LATENCY_PATH(LATENCY_SREALLOC_MOVE);
+        //buddy_allocator->checkOverFlow(oldp_md);
+        size_t bytes_to_copy = oldp_md->getBlockSize()-META_DATA_SIZE;
+        guard.unlock(); // smalloc and sfree take the arena locks themselves
+        // a persistent block moves within the persistent heap
+        uint8_t tag = oldp_md->getTag();
+        void* newp = mem_man.getPersistentHeap()->isPersistent(arena) ? allocatePersistent(size, tag) : allocateUserBlock(size, tag);
+        if (newp == nullptr)
+        {
+            return NULL;
+        }
+        //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
+        //buddy_allocator->checkOverFlow(GET_METADATA(newp));
+        std::memmove(newp, oldp, bytes_to_copy);
+        //buddy_allocator->checkOverFlow(GET_METADATA(oldp));
+        freeUserBlock(oldp);
+        //buddy_allocator->checkOverFlow(GET_METADATA(newp));
+        return newp;
+    }
+}
+
+void BuddyEngine::addStats(CoreStats* stats) const
+{
+    mem_man.addBuddyStats(stats);
+}
+
+// ~~~~~~~~~~~~~~ MMAP REGIONS ~~~~~~~~~~~~~~~~~~~~~~
+
+void* MMapRegions::allocate(size_t size, int tag)
+{
+    LATENCY_PATH(LATENCY_SMALLOC_MMAP);
+    mem_man.getThreadArena(); // the first allocation of the thread's node reserves its chunk, whatever the size
+    MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
+    HeapGrowth growth;
+    std::unique_lock<std::mutex> guard(mem_man.getMMapLock());
+    MallocMetadata* block_to_use = mmap_allocator->takeCachedRegion(size + META_DATA_SIZE);
+    if (block_to_use == nullptr && !growth.admit(roundUpToPage(size + META_DATA_SIZE), true))
+    {
+        // past the hard limit. the cached regions count too, give them back before failing
+        MallocMetadata* evicted = mmap_allocator->onMemoryPressure();
+        guard.unlock();
+        MMapAllocator::unmapRegions(evicted);
+        guard.lock();
+        if (!growth.admit(roundUpToPage(size + META_DATA_SIZE), true))
+        {
+            return NULL;
+        }
+    }
+    if (block_to_use == nullptr)
+    {
+        guard.unlock();
+        block_to_use = MMapAllocator::mapRegion(size + META_DATA_SIZE);
+        guard.lock();
+    }
+    if (block_to_use == nullptr)
+    {
+        // memory pressure, the retained regions go back and the retain threshold comes down before a retry
+        MallocMetadata* evicted = mmap_allocator->onMemoryPressure();
+        guard.unlock();
+        MMapAllocator::unmapRegions(evicted);
+        block_to_use = MMapAllocator::mapRegion(size + META_DATA_SIZE);
+        if(block_to_use == nullptr)
+        {
+            return NULL;
+        }
+        guard.lock();
+    }
+    *block_to_use = mmap_allocator->CreateMallocMetaData(block_to_use, size, false);
+    mmap_allocator->accountBlock(block_to_use, size, static_cast<uint8_t>(tag));
+
+    if(mmap_allocator->getHead() == nullptr)
+    {
+        //mmap_allocator->checkOverFlow(block_to_use);
+        //mmap_allocator->checkOverFlow(mmap_allocator->getHead());
+        mmap_allocator->setHead(block_to_use);
+
+        //mmap_allocator->checkOverFlow(block_to_use);
+        //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
+        mmap_allocator->setTail(block_to_use);
+    }
+    else
+    {
+        mmap_allocator->checkOverFlow(mmap_allocator->getHead());
+        mmap_allocator->checkOverFlow(mmap_allocator->getTail());
+        //mmap_allocator->checkOverFlow(block_to_use);
+        block_to_use->setPrev(mmap_allocator->getTail());
+
+        //mmap_allocator->checkOverFlow(block_to_use);
+        //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
+        mmap_allocator->getTail()->setNext(block_to_use);
+
+        //mmap_allocator->checkOverFlow(block_to_use);
+        //mmap_allocator->checkOverFlow(mmap_allocator->getTail());
+        mmap_allocator->setTail(block_to_use);
+    }
+
+    // add to stats - new block was allocated successfully
+    mmap_allocator->incNumOfAllocatedBlocksBy(1);
+    mmap_allocator->incNumOfBytesInAllocatedBlocksBy(size);
+    guard.unlock();
+    sampleAllocation(block_to_use, size, PROFILE_ORDER_MMAP);
+    return GET_USER_PTR(block_to_use);
+}
+
+void MMapRegions::free(void* p)
+{
+    MallocMetadata* metadata = GET_METADATA(p);
+    if (metadata->isFree()) return;
+    dropSample(metadata);
+    LATENCY_PATH(LATENCY_SFREE_MMAP);
+    MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
+    //mmap_allocator->checkOverFlow(metadata);
+    MallocMetadata* to_unmap;
+    {
+        std::lock_guard<std::mutex> guard(mem_man.getMMapLock());
+        to_unmap = mmap_allocator->freeBlock(metadata, metadata->getBlockSize());
+    }
+    MMapAllocator::unmapRegions(to_unmap);
+}
+
+void MMapRegions::freeSized(void* p, size_t size)
+{
+    MallocMetadata* metadata = GET_METADATA(p);
+    checkBoundary(metadata);
+    if (metadata->isFree()) return;
+    checkSizedBlock(metadata, size + META_DATA_SIZE);
+    dropSample(metadata);
+    MallocMetadata* to_unmap;
+    {
+        std::lock_guard<std::mutex> guard(mem_man.getMMapLock());
+        to_unmap = mem_man.getMMapAllocator()->freeBlock(metadata, size + META_DATA_SIZE);
+    }
+    MMapAllocator::unmapRegions(to_unmap);
+}
+
+void* MMapRegions::reallocate(void* oldp, size_t size)
+{
+    MallocMetadata* oldp_md = GET_METADATA(oldp);
+    if (oldp_md->isFree())
+    {
+        return NULL; // TODO: check if needed in tests and delete after
+    }
+    LATENCY_PATH(LATENCY_SREALLOC_MMAP);
+    //mmap_allocator->checkOverFlow(oldp_md);
+    if(oldp_md->getBlockSize() == size + META_DATA_SIZE)
+    {
+        //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
+        return oldp;
+    }
+    //mmap_allocator->checkOverFlow(oldp_md);
+    // the new block may be smaller than the old one
+    size_t bytes_to_copy = std::min(oldp_md->getBlockSize()-META_DATA_SIZE, size);
+    void* newp = allocateUserBlock(size, oldp_md->getTag()); // the block keeps its tag wherever it goes
+    if (newp == nullptr)
+    {
+        return NULL;
+    }
+    //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
+    //mmap_allocator->checkOverFlow(GET_METADATA(newp));
+    std::memmove(newp, oldp, bytes_to_copy);
+    //mmap_allocator->checkOverFlow(GET_METADATA(oldp));
+    freeUserBlock(oldp);
+    //mmap_allocator->checkOverFlow(GET_METADATA(newp));
+    return newp;
+}
+
+void MMapRegions::addStats(CoreStats* stats) const
+{
+    mem_man.addMMapStats(stats);
+}
+
+// smalloc for a given tag instead of the thread's current one
+void* smalloc_tagged(size_t size, int tag)
+{
+    void* result = allocateUserBlock(size, tag);
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (tracer->isTracing())
+    {
+        tracer->recordMalloc(size, result);
+    }
+    relieveHeapPressureIfPending();
+    return result;
+}
+
+void* smalloc(size_t size)
+{
+    return smalloc_tagged(size, current_tag);
+}
+
+void* scalloc(size_t num, size_t size)
+{
+    void* result = allocateZeroedBlock(num, size);
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (tracer->isTracing())
+    {
+        tracer->recordCalloc(num, size, result);
+    }
+    relieveHeapPressureIfPending();
+    return result;
+}
+
+void sfree(void* p)
+{
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (tracer->isTracing())
+    {
+        tracer->recordFree(p);
+    }
+    freeUserBlock(p);
+}
+
+void* srealloc(void* oldp, size_t size)
+{
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (!tracer->isTracing())
+    {
+        void* result = reallocateUserBlock(oldp, size);
+        relieveHeapPressureIfPending();
+        return result;
+    }
+    uint32_t old_id = tracer->detachRealloc(oldp);
+    void* result = reallocateUserBlock(oldp, size);
+    tracer->recordRealloc(oldp, old_id, size, result);
+    relieveHeapPressureIfPending();
+    return result;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ IMPLEMENT STATISTICS ~~~~~~~~~~~~~~~~~~~
+size_t _num_free_blocks()
+{
+    return heap.getNumOfFreeBlocks();
+}
+
+size_t _num_free_bytes()
+{
+    return heap.getNumOfFreeBytes();
+}
+
+size_t _num_allocated_blocks()
+{
+    return heap.getNumOfAllocatedBlocks();
+}
+
+size_t _num_allocated_bytes()
+{
+    return heap.getNumOfAllocatedBytes();
+}
+
+size_t _num_meta_data_bytes()
+{
+    return heap.getNumOfMetaDataBytes();
+}
+
+size_t _size_meta_data()
+{
+    return META_DATA_SIZE;
+}
+
+#ifdef MALLOC_LATENCY_HISTOGRAMS
+// ~~~~~~~~~~~~~~~~~~~~~~~ LATENCY HISTOGRAMS DUMP ~~~~~~~~~~~~~~~~~~~
+static const char* const latency_path_names[LATENCY_SFREE_BUDDY] = {
+    "smalloc_buddy_hit", "smalloc_buddy_split", "smalloc_mmap", "smalloc_failed", "scalloc",
+    "sfree_mmap", "srealloc_in_place", "srealloc_merge", "srealloc_move", "srealloc_mmap"
+};
+
+// writes one line per path that has samples, all threads summed:
+//   <path> count=<n> p50<=<t> p99<=<t> p999<=<t> buckets=<count of [2^i, 2^(i+1)) for every i>
+// the percentiles are the upper bound of the bucket they fall in. only stack buffers and write(2) are used
+void smalloc_latency_dump(int fd)
+{
+    char line[1024];
+    int length = snprintf(line, sizeof(line), "# smalloc latency histograms, unit=%s\n", LATENCY_UNIT);
+    if (write(fd, line, length) != length)
+    {
+        return;
+    }
+    int num_of_threads = std::min(num_of_latency_histograms.load(std::memory_order_relaxed), LATENCY_MAX_THREADS);
+    for (int path = 0; path < LATENCY_NUM_OF_PATHS; path++)
+    {
+        uint64_t buckets[LATENCY_NUM_OF_BUCKETS] = {};
+        uint64_t total = 0;
+        for (int thread = 0; thread < num_of_threads; thread++)
+        {
+            for (int bucket = 0; bucket < LATENCY_NUM_OF_BUCKETS; bucket++)
+            {
+                buckets[bucket] += latency_histograms[thread].counts[path][bucket].load(std::memory_order_relaxed);
+            }
+        }
+        for (uint64_t count : buckets)
+        {
+            total += count;
+        }
+        if (total == 0)
+        {
+            continue;
+        }
+        uint64_t percentile_bounds[3] = {};
+        const double quantiles[3] = {0.5, 0.99, 0.999};
+        for (int q = 0; q < 3; q++)
+        {
+            uint64_t seen = 0;
+            for (int bucket = 0; bucket < LATENCY_NUM_OF_BUCKETS; bucket++)
+            {
+                seen += buckets[bucket];
+                if (seen >= quantiles[q] * total)
+                {
+                    percentile_bounds[q] = 2ull << bucket;
+                    break;
+                }
+            }
+        }
+        if (path < LATENCY_SFREE_BUDDY)
+        {
+            length = snprintf(line, sizeof(line), "%s", latency_path_names[path]);
+        }
+        else
+        {
+            length = snprintf(line, sizeof(line), "sfree_buddy_merge_depth_%d", path - LATENCY_SFREE_BUDDY);
+        }
+        length += snprintf(line + length, sizeof(line) - length, " count=%llu p50<=%llu p99<=%llu p999<=%llu buckets=",
+                           (unsigned long long) total, (unsigned long long) percentile_bounds[0],
+                           (unsigned long long) percentile_bounds[1], (unsigned long long) percentile_bounds[2]);
+        for (int bucket = 0; bucket < LATENCY_NUM_OF_BUCKETS; bucket++)
+        {
+            length += snprintf(line + length, sizeof(line) - length, (bucket == 0) ? "%llu" : ",%llu",
+                               (unsigned long long) buckets[bucket]);
+        }
+        length += snprintf(line + length, sizeof(line) - length, "\n");
+        if (write(fd, line, length) != length)
+        {
+            return;
+        }
+    }
+}
+
+void smalloc_latency_reset()
+{
+    for (LatencyHistogram& histogram : latency_histograms)
+    {
+        for (auto& path_counts : histogram.counts)
+        {
+            for (std::atomic<uint64_t>& count : path_counts)
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+#endif
+
+void smalloc_stats(smalloc_stats_snapshot* snapshot)
+{
+    if (snapshot == NULL)
+    {
+        return;
+    }
+    mem_man.fillStatsSnapshot(snapshot);
+    CoreStats small_objects_stats = CoreStats();
+    heap.getSmallObjects()->addStats(&small_objects_stats);
+    snapshot->num_free_blocks += small_objects_stats.free_blocks;
+    snapshot->num_free_bytes += small_objects_stats.free_bytes;
+    snapshot->num_allocated_blocks += small_objects_stats.allocated_blocks;
+    snapshot->num_allocated_bytes += small_objects_stats.allocated_bytes;
+}
+
+void smalloc_fragmentation(smalloc_fragmentation_stats* stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    *stats = smalloc_fragmentation_stats{};
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        mem_man.getArena(i)->getBuddyAllocator()->fillFragmentationStats(stats);
+    }
+    mem_man.getMMapAllocator()->fillFragmentationStats(stats);
+    stats->external_fragmentation = (stats->buddy_free_bytes == 0) ? 0.0 :
+            1.0 - static_cast<double>(stats->largest_free_block) / static_cast<double>(stats->buddy_free_bytes);
+}
+
+// fills up to max_nodes entries, one per arena (= per NUMA node), and returns how many arenas there are
+size_t smalloc_numa_stats(smalloc_node_stats* stats, size_t max_nodes)
+{
+    size_t num_of_arenas = mem_man.getNumOfArenas();
+    for (size_t i = 0; stats != NULL && i < num_of_arenas && i < max_nodes; i++)
+    {
+        mem_man.getArena(static_cast<int>(i))->fillNodeStats(&stats[i]);
+    }
+    return num_of_arenas;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ TAGS ~~~~~~~~~~~~~~~~~~~
+// every used block carries the tag of the allocation that made it, and the live blocks and bytes of every tag
+// are kept with the other sharded counters, so reading them needs no profiler and allocating no shared line.
+// the tag of the calling thread's smalloc, scalloc, smalloc_aligned and region allocations. returns the
+// previous one, or -1 (keeping it) if tag is out of range
+int smalloc_set_tag(int tag)
+{
+    if (tag < 0 || tag >= SMALLOC_MAX_TAGS)
+    {
+        return -1;
+    }
+    int previous_tag = current_tag;
+    current_tag = static_cast<uint8_t>(tag);
+    return previous_tag;
+}
+
+int smalloc_get_tag()
+{
+    return current_tag;
+}
+
+// fills usage for up to max_tags tags, returns SMALLOC_MAX_TAGS. persistent blocks aren't counted
+size_t smalloc_tag_stats(smalloc_tag_usage* usage, size_t max_tags)
+{
+    if (usage != NULL)
+    {
+        mem_man.fillTagUsage(usage, max_tags);
+    }
+    return SMALLOC_MAX_TAGS;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ WARM START ~~~~~~~~~~~~~~~~~~~
+// optional, call it before the first allocation to take the chunk reservation, the page faults and the
+// first splits off the first requests. false if an arena has no room for the presplit blocks, or the heap
+// limits don't admit its chunk
+bool smalloc_init(const smalloc_init_options* options)
+{
+    smalloc_init_options defaults{};
+    if (options == NULL)
+    {
+        options = &defaults;
+    }
+    bool has_room = true;
+    if (options->all_nodes)
+    {
+        for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+        {
+            has_room = mem_man.initializeArena(i, options->prefault) != nullptr && has_room;
+        }
+    }
+    has_room = mem_man.initializeArena(currentNumaNode() % mem_man.getNumOfArenas(), options->prefault) != nullptr &&
+               has_room;
+    mem_man.getThreadArena();
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        Arena* arena = mem_man.getArena(i);
+        if (!arena->isInitialized())
+        {
+            continue;
+        }
+        std::lock_guard<std::mutex> guard(arena->getLock());
+        BuddyAllocator* buddy_allocator = arena->getBuddyAllocator();
+        buddy_allocator->prefault(options->prefault);
+        for (int order = 0; order <= MAX_ORDER; order++)
+        {
+            has_room = buddy_allocator->presplit(order, options->presplit[order]) && has_room;
+        }
+    }
+    return has_room;
+}
+
+// the other way round: unmaps the chunk of every arena that has no used block left and returns how many
+// bytes went back. an arena maps a new chunk when it is allocated from again. with the sbrk backend a
+// chunk can't be given back on its own, so this does nothing
+size_t smalloc_release_free_chunks()
+{
+    return mem_man.releaseFreeChunks();
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ HEAP LIMIT ENTRY POINTS ~~~~~~~~~~~~~~~~~~~
+// limits on the heap's footprint (smalloc_heap_footprint), 0 for none. past the soft limit the allocator
+// returns its cached regions and free chunks and then calls the pressure callbacks, once per crossing. past
+// the hard limit smalloc, scalloc, srealloc and sexpand fail instead of mapping more, the first chunk of a
+// node's arena included. false (changing nothing) if soft_limit is above hard_limit
+bool smalloc_set_heap_limits(size_t soft_limit, size_t hard_limit)
+{
+    return mem_man.getHeapLimits()->setLimits(soft_limit, hard_limit);
+}
+
+// the bytes the heap has mapped: the arenas' chunks and the mmap regions, also the ones kept for reuse
+size_t smalloc_heap_footprint()
+{
+    return mem_man.getFootprint();
+}
+
+// callback runs on the thread whose allocation crossed the soft limit, after that allocation and with no
+// allocator lock held. false if callback is NULL or SMALLOC_MAX_PRESSURE_CALLBACKS are registered already
+bool smalloc_add_pressure_callback(smalloc_pressure_callback callback, void* arg)
+{
+    return mem_man.getHeapLimits()->addCallback(callback, arg);
+}
+
+bool smalloc_remove_pressure_callback(smalloc_pressure_callback callback, void* arg)
+{
+    return mem_man.getHeapLimits()->removeCallback(callback, arg);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ HEAP WALK ~~~~~~~~~~~~~~~~~~~
+// calls callback for every buddy block (arena by arena, in address order) and then every mmap region, returns
+// how many blocks were reported. nothing is allocated and the walk is bounded even if the heap is corrupt.
+// no lock is taken, so it works from a crash handler, but other threads allocating meanwhile make it racy
+size_t sheap_walk(sheap_walk_callback callback, void* arg)
+{
+    if (callback == NULL)
+    {
+        return 0;
+    }
+    size_t num_of_blocks = 0;
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        num_of_blocks += mem_man.getArena(i)->getBuddyAllocator()->walkBlocks(callback, arg);
+    }
+    return num_of_blocks + mem_man.getMMapAllocator()->walkBlocks(callback, arg);
+}
+
+// formats into a stack buffer and writes it to fd when it fills up, so dumping never allocates
+class HeapDumpWriter
+{
+private:
+    int fd;
+    int format;
+    bool first_in_array;
+    size_t length;
+    char buffer[SHEAP_DUMP_BUFFER_SIZE];
+public:
+    HeapDumpWriter(int fd, int format);
+    ~HeapDumpWriter();
+    void append(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    void flush();
+    int getFormat() const;
+    // json arrays need a comma before every element but the first
+    void startArray();
+    void appendSeparator();
+};
+
+HeapDumpWriter::HeapDumpWriter(int fd, int format): fd(fd), format(format), first_in_array(true), length(0), buffer{} {}
+
+HeapDumpWriter::~HeapDumpWriter()
+{
+    this->flush();
+}
+
+void HeapDumpWriter::append(const char* fmt, ...)
+{
+    // a single entry is far shorter than the buffer
+    if (this->length > SHEAP_DUMP_BUFFER_SIZE / 2)
+    {
+        this->flush();
+    }
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(this->buffer + this->length, SHEAP_DUMP_BUFFER_SIZE - this->length, fmt, args);
+    va_end(args);
+    if (written > 0)
+    {
+        this->length = std::min(this->length + written, static_cast<size_t>(SHEAP_DUMP_BUFFER_SIZE - 1));
+    }
+}
+
+void HeapDumpWriter::flush()
+{
+    const char* data = this->buffer;
+    while (this->length > 0)
+    {
+        ssize_t written = write(this->fd, data, this->length);
+        if (written <= 0)
+        {
+            break;
+        }
+        data += written;
+        this->length -= written;
+    }
+    this->length = 0;
+}
+
+int HeapDumpWriter::getFormat() const
+{
+    return this->format;
+}
+
+void HeapDumpWriter::startArray()
+{
+    this->first_in_array = true;
+}
+
+void HeapDumpWriter::appendSeparator()
+{
+    if (!this->first_in_array)
+    {
+        this->append(",");
+    }
+    this->first_in_array = false;
+}
+
+static void dumpBlock(const sheap_block_info* block, void* arg)
+{
+    auto* writer = static_cast<HeapDumpWriter*>(arg);
+    if (writer->getFormat() == SHEAP_DUMP_JSON)
+    {
+        writer->appendSeparator();
+        writer->append("{\"address\":\"%p\",\"size\":%zu,\"requested\":%zu,\"order\":%d,\"free\":%s,"
+                       "\"in_free_list\":%s,\"corrupt\":%s}",
+                       block->block, block->block_size, block->requested_size, block->order,
+                       block->is_free ? "true" : "false", block->in_free_list ? "true" : "false",
+                       block->is_corrupt ? "true" : "false");
+        return;
+    }
+    if (block->is_corrupt)
+    {
+        writer->append("  %p CORRUPT, walk stopped\n", block->block);
+        return;
+    }
+    if (block->is_mmap)
+    {
+        writer->append("  %p size %zu requested %zu\n", block->block, block->block_size, block->requested_size);
+        return;
+    }
+    const char* state = block->is_free ? (block->in_free_list ? "free" : "free LOST") :
+                                         (block->in_free_list ? "used IN FREE LIST" : "used");
+    writer->append("  %p order %d size %zu requested %zu %s\n", block->block, block->order, block->block_size,
+                   block->requested_size, state);
+}
+
+static void dumpFreeLists(HeapDumpWriter* writer, BuddyAllocator* buddy_allocator, bool json)
+{
+    writer->startArray();
+    for (int order = 0; order <= MAX_ORDER; order++)
+    {
+        if (json)
+        {
+            writer->appendSeparator();
+            writer->append("{\"order\":%d,\"blocks\":[", order);
+        }
+        else
+        {
+            writer->append("  order %d:", order);
+        }
+        size_t max_steps = BUDDY_CHUNK_SIZE / MINIMAL_BLOCK_SIZE;
+        const char* separator = "";
+        for (MallocMetadata* curr = buddy_allocator->getFreeListHead(order); curr != nullptr && max_steps-- > 0;
+             curr = curr->getNext())
+        {
+            if (!buddy_allocator->isValidBlock(curr, buddy_allocator->getChunkStart()))
+            {
+                writer->append(json ? "%s\"%p (corrupt)\"" : "%s %p (corrupt)", separator, static_cast<void*>(curr));
+                break;
+            }
+            writer->append(json ? "%s\"%p\"" : "%s %p", separator, static_cast<void*>(curr));
+            separator = json ? "," : "";
+        }
+        writer->append(json ? "]}" : "\n");
+    }
+}
+
+// dumps every arena's chunk block by block with its ordersArray free lists, and then the mmap regions,
+// to fd as text or (with SHEAP_DUMP_JSON) as a single json object
+void sheap_dump(int fd, int format)
+{
+    MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
+    HeapDumpWriter writer(fd, format);
+    bool json = (format == SHEAP_DUMP_JSON);
+
+    writer.append(json ? "{\"buddy_chunks\":[" : "");
+    const char* chunk_separator = "";
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        Arena* arena = mem_man.getArena(i);
+        if (!arena->isInitialized())
+        {
+            continue;
+        }
+        BuddyAllocator* buddy_allocator = arena->getBuddyAllocator();
+        void* chunk = reinterpret_cast<void*>(buddy_allocator->getChunkStart());
+        if (chunk == nullptr)
+        {
+            continue; // released
+        }
+        writer.append(json ? "%s{\"node\":%d,\"address\":\"%p\",\"size\":%zu,\"blocks\":[" :
+                             "%sbuddy chunk of node %d at %p size %zu\n",
+                      chunk_separator, arena->getNode(), chunk, static_cast<size_t>(BUDDY_CHUNK_SIZE));
+        chunk_separator = json ? "," : "";
+        writer.startArray();
+        buddy_allocator->walkBlocks(dumpBlock, &writer);
+        writer.append(json ? "],\"free_lists\":[" : "free lists\n");
+        dumpFreeLists(&writer, buddy_allocator, json);
+        writer.append(json ? "]}" : "");
+    }
+
+    writer.append(json ? "],\"mmap_regions\":[" : "mmap regions\n");
+    writer.startArray();
+    mmap_allocator->walkBlocks(dumpBlock, &writer);
+    writer.append(json ? "]}\n" : "");
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ HEAP PROFILE DUMP ~~~~~~~~~~~~~~~~~~~
+// the legacy heap profile text format of gperftools, which pprof reads (pprof <binary> <file>). the
+// counts are the raw samples, pprof scales them back up using the sampling distance in the header
+bool HeapProfiler::dump(int fd)
+{
+    HeapDumpWriter writer(fd, SHEAP_DUMP_TEXT);
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->buckets == nullptr)
+        {
+            return false;
+        }
+        size_t live_samples = 0;
+        size_t live_bytes = 0;
+        size_t total_samples = 0;
+        size_t total_bytes = 0;
+        for (size_t i = 0; i < PROFILE_BUCKET_TABLE_SIZE; i++)
+        {
+            live_samples += this->buckets[i].live_samples;
+            live_bytes += this->buckets[i].live_bytes;
+            total_samples += this->buckets[i].total_samples;
+            total_bytes += this->buckets[i].total_bytes;
+        }
+        writer.append("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_samples, live_bytes,
+                      total_samples, total_bytes, this->last_sample_bytes);
+        for (size_t i = 0; i < PROFILE_BUCKET_TABLE_SIZE; i++)
+        {
+            const ProfileBucket* bucket = &this->buckets[i];
+            if (bucket->hash == 0)
+            {
+                continue;
+            }
+            writer.append("%zu: %zu [%zu: %zu] @", bucket->live_samples, bucket->live_bytes,
+                          bucket->total_samples, bucket->total_bytes);
+            for (size_t j = 0; j < bucket->depth; j++)
+            {
+                writer.append(" %p", bucket->stack[j]);
+            }
+            writer.append("\n");
+        }
+    }
+    // pprof maps the addresses to symbols with these
+    writer.append("\nMAPPED_LIBRARIES:\n");
+    writer.flush();
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0)
+    {
+        char buffer[SHEAP_DUMP_BUFFER_SIZE];
+        ssize_t length;
+        while ((length = read(maps, buffer, sizeof(buffer))) > 0 && write(fd, buffer, length) == length)
+        {
+        }
+        close(maps);
+    }
+    return true;
+}
+
+// samples about one allocation per sample_bytes allocated (0 for PROFILE_DEFAULT_SAMPLE_BYTES) until
+// smalloc_profile_stop. a new start drops the samples of the last one. false if it is already running
+bool smalloc_profile_start(size_t sample_bytes)
+{
+    return mem_man.getProfiler()->start((sample_bytes == 0) ? PROFILE_DEFAULT_SAMPLE_BYTES : sample_bytes);
+}
+
+// frees still drop their samples after a stop, so the live part of a later dump stays right
+void smalloc_profile_stop()
+{
+    mem_man.getProfiler()->stop();
+}
+
+// writes the live and the total sampled allocations by stack, false if the profiler never started
+bool smalloc_profile_dump(int fd)
+{
+    return mem_man.getProfiler()->dump(fd);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ TRACING ~~~~~~~~~~~~~~~~~~~
+// writes every smalloc/scalloc/srealloc/sfree to path until smalloc_trace_stop, see replay.cpp
+bool smalloc_trace_start(const char* path)
+{
+    return mem_man.getTracer()->start(path);
+}
+
+void smalloc_trace_stop()
+{
+    mem_man.getTracer()->stop();
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ SIZED AND ALIGNED ENTRY POINTS ~~~~~~~~~~~~~~~~~~~
+// smalloc only guarantees DEFAULT_USER_ALIGNMENT (the header is 40 bytes, so user pointers are 8 aligned).
+// stronger alignments are served by over allocating and keeping the original pointer right before the
+// aligned one, therefore memory from smalloc_aligned must be released with sfree_sized and the same alignment.
+void* smalloc_aligned(size_t size, size_t alignment)
+{
+    if (alignment <= DEFAULT_USER_ALIGNMENT)
+    {
+        return smalloc(size);
+    }
+    if ((alignment & (alignment - 1)) != 0 || size > MAX_SIZE - alignment)
+    {
+        return NULL;
+    }
+    void* raw_block = smalloc(size + alignment);
+    if (raw_block == nullptr)
+    {
+        return NULL;
+    }
+    // raw_block is 8 aligned, so there are at least 8 bytes between it and the aligned pointer
+    uintptr_t aligned_address = (reinterpret_cast<uintptr_t>(raw_block) + alignment) & ~(alignment - 1);
+    reinterpret_cast<void**>(aligned_address)[-1] = raw_block;
+    return reinterpret_cast<void*>(aligned_address);
+}
+
+void sfree_sized(void* p, size_t size, size_t alignment)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+    if (alignment > DEFAULT_USER_ALIGNMENT)
+    {
+        p = reinterpret_cast<void**>(p)[-1];
+        size += alignment;
+    }
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (tracer->isTracing())
+    {
+        // replayed as a plain free of the pointer smalloc returned
+        tracer->recordFree(p);
+    }
+    heap.freeSized(p, size);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ IN PLACE GROWTH ~~~~~~~~~~~~~~~~~~~
+// grows p to preferred_size if it can, or to at least min_size, without ever moving it. a buddy block merges
+// with the free buddies above it, an mmap region is extended with mremap where the pages after it are free.
+// returns the usable size p now has (at least min_size), or 0 if it couldn't grow that far - p is then as it
+// was. p must come from smalloc, scalloc or srealloc; free it with sfree, or sfree_sized and the new size
+static size_t expandMMapBlock(MallocMetadata* md, size_t min_size, size_t preferred_size)
+{
+    size_t old_block_size = md->getBlockSize();
+    size_t old_size = old_block_size - META_DATA_SIZE;
+    if (old_size >= preferred_size)
+    {
+        return old_size;
+    }
+    size_t mapped_size = roundUpToPage(old_block_size);
+    size_t new_size = 0;
+    HeapGrowth growth;
+    // try what the caller prefers first, then what it can live with
+    const size_t sizes[2] = {preferred_size, std::max(min_size, old_size)};
+    for (size_t size : sizes)
+    {
+        size_t new_mapped_size = roundUpToPage(size + META_DATA_SIZE);
+        if (new_mapped_size <= mapped_size ||
+            (growth.admit(new_mapped_size - mapped_size, false) && mremap(md, mapped_size, new_mapped_size, 0) != MAP_FAILED))
+        {
+            new_size = size;
+            break;
+        }
+    }
+    if (new_size == 0)
+    {
+        return 0;
+    }
+    if (new_size == old_size)
+    {
+        return old_size;
+    }
+    // the header didn't move, so the list around it is as it was. only the sizes change
+    MMapAllocator* mmap_allocator = mem_man.getMMapAllocator();
+    std::unique_lock<std::mutex> guard(mem_man.getMMapLock());
+    uint8_t tag = md->getTag();
+    mmap_allocator->unaccountBlock(md);
+    mmap_allocator->decNumOfBytesInAllocatedBlocksBy(old_size);
+    md->setBlockSize(new_size + META_DATA_SIZE);
+    mmap_allocator->incNumOfBytesInAllocatedBlocksBy(new_size);
+    mmap_allocator->accountBlock(md, new_size, tag);
+    guard.unlock();
+    dropSample(md);
+    sampleAllocation(md, new_size, PROFILE_ORDER_MMAP);
+    return new_size;
+}
+
+static size_t expandBuddyBlock(MallocMetadata* md, size_t min_size, size_t preferred_size)
+{
+    if (min_size + META_DATA_SIZE > MAXIMAL_BUDDY_BLOCK)
+    {
+        return 0; // only an mmap region can be that big, and becoming one means moving
+    }
+    Arena* arena = mem_man.getArenaOf(md);
+    if (arena == nullptr)
+    {
+        return 0;
+    }
+    BuddyAllocator* buddy_allocator = arena->getBuddyAllocator();
+    size_t preferred_block_size = std::min(preferred_size + META_DATA_SIZE, size_t(MAXIMAL_BUDDY_BLOCK));
+    int min_order = BuddyAllocator::convertSizeToOrder(BuddyAllocator::next_power_of_two(min_size + META_DATA_SIZE));
+    int preferred_order = BuddyAllocator::convertSizeToOrder(BuddyAllocator::next_power_of_two(preferred_block_size));
+
+    std::unique_lock<std::mutex> guard(arena->getLock());
+    int current_order = BuddyAllocator::convertSizeToOrder(md->getBlockSize());
+    int new_order = buddy_allocator->getInPlaceOrder(md, current_order, preferred_order);
+    if (new_order < min_order)
+    {
+        return 0;
+    }
+    size_t new_size = BuddyAllocator::convertOrderToSize(new_order) - META_DATA_SIZE;
+    size_t requested_size = std::max(md->getRequestedSize(), std::min(preferred_size, new_size));
+    uint8_t tag = md->getTag();
+    buddy_allocator->unaccountUsedBlock(md, current_order);
+    if (new_order > current_order)
+    {
+        // nothing to copy, the merged block starts at md
+        buddy_allocator->reallocByMerging(md, current_order, new_order, GET_USER_PTR(md), 0);
+    }
+    buddy_allocator->accountUsedBlock(md, new_order, requested_size, tag);
+    guard.unlock();
+    if (new_order > current_order)
+    {
+        // counted like a new allocation, as srealloc's merges are
+        dropSample(md);
+        sampleAllocation(md, requested_size, new_order);
+    }
+    return new_size;
+}
+
+size_t BuddyEngine::expand(void* p, size_t min_size, size_t preferred_size)
+{
+    MallocMetadata* md = GET_METADATA(p);
+    return md->isFree() ? 0 : expandBuddyBlock(md, min_size, preferred_size);
+}
+
+size_t MMapRegions::expand(void* p, size_t min_size, size_t preferred_size)
+{
+    MallocMetadata* md = GET_METADATA(p);
+    return md->isFree() ? 0 : expandMMapBlock(md, min_size, preferred_size);
+}
+
+size_t sexpand(void* p, size_t min_size, size_t preferred_size)
+{
+    AllocationTracer* tracer = mem_man.getTracer();
+    if (!tracer->isTracing())
+    {
+        size_t new_size = heap.expand(p, min_size, preferred_size);
+        relieveHeapPressureIfPending();
+        return new_size;
+    }
+    // replayed as a realloc that didn't move
+    uint32_t old_id = tracer->detachRealloc(p);
+    size_t new_size = heap.expand(p, min_size, preferred_size);
+    if (new_size != 0)
+    {
+        tracer->recordRealloc(p, old_id, new_size, p);
+    }
+    else
+    {
+        tracer->cancelRealloc(p, old_id);
+    }
+    relieveHeapPressureIfPending();
+    return new_size;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ REGIONS ~~~~~~~~~~~~~~~~~~~
+// a region bump allocates inside buddy blocks of REGION_BLOCK_ORDER. the blocks are chained through the next
+// field of their metadata (unused while a block is allocated) and are handed back to the buddy allocator
+// together, so the small allocations inside a region never go through sfree and recMergeBuddyBlocks.
+class Region
+{
+private:
+    MallocMetadata* first_block; // the Region object itself lives in this block
+    MallocMetadata* current_block;
+    char* bump_pointer;
+    char* bump_end;
+    void* large_allocations; // allocations above REGION_LARGE_ALLOCATION, linked through their first word
+
+    explicit Region(MallocMetadata* first_block);
+    friend Region* sregion_create();
+public:
+    ~Region() = default;
+    void* allocate(size_t size);
+    void releaseBlocksAfter(MallocMetadata* block);
+    void releaseLargeAllocations();
+    void reset();
+    MallocMetadata* getFirstBlock();
+};
+
+Region::Region(MallocMetadata* first_block): first_block(first_block), current_block(first_block),
+    bump_pointer(nullptr), bump_end(nullptr), large_allocations(nullptr)
+{
+    this->reset();
+}
+
+void* Region::allocate(size_t size)
+{
+    size = (size + DEFAULT_USER_ALIGNMENT - 1) & ~(size_t)(DEFAULT_USER_ALIGNMENT - 1);
+    if (size > REGION_LARGE_ALLOCATION)
+    {
+        void* large = smalloc(size + DEFAULT_USER_ALIGNMENT);
+        if (large == nullptr)
+        {
+            return NULL;
+        }
+        *static_cast<void**>(large) = this->large_allocations;
+        this->large_allocations = large;
+        return static_cast<char*>(large) + DEFAULT_USER_ALIGNMENT;
+    }
+    if (static_cast<size_t>(this->bump_end - this->bump_pointer) < size)
+    {
+        MallocMetadata* new_block = allocateBuddyBlock(REGION_BLOCK_ORDER, MAXIMAL_BUDDY_BLOCK - META_DATA_SIZE, current_tag);
+        if (new_block == nullptr)
+        {
+            return NULL;
+        }
+        this->current_block->setNext(new_block);
+        this->current_block = new_block;
+        this->bump_pointer = static_cast<char*>(GET_USER_PTR(new_block));
+        this->bump_end = reinterpret_cast<char*>(new_block) + new_block->getBlockSize();
+    }
+    void* allocation = this->bump_pointer;
+    this->bump_pointer += size;
+    return allocation;
+}
+
+void Region::releaseBlocksAfter(MallocMetadata* block)
+{
+    MallocMetadata* curr = block->getNext();
+    block->setNext(nullptr);
+    while (curr != nullptr)
+    {
+        MallocMetadata* next = curr->getNext();
+        curr->setNext(nullptr);
+        // blocks of the maximal order have no buddy to merge with, this is just a list insert
+        freeBuddyBlock(curr, REGION_BLOCK_ORDER);
+        curr = next;
+    }
+}
+
+void Region::releaseLargeAllocations()
+{
+    void* curr = this->large_allocations;
+    while (curr != nullptr)
+    {
+        void* next = *static_cast<void**>(curr);
+        sfree(curr);
+        curr = next;
+    }
+    this->large_allocations = nullptr;
+}
+
+void Region::reset()
+{
+    // keep the first block (it holds the Region) and give everything else back
+    this->releaseLargeAllocations();
+    this->releaseBlocksAfter(this->first_block);
+    this->current_block = this->first_block;
+    size_t header_size = (sizeof(Region) + DEFAULT_USER_ALIGNMENT - 1) & ~(size_t)(DEFAULT_USER_ALIGNMENT - 1);
+    this->bump_pointer = static_cast<char*>(GET_USER_PTR(this->first_block)) + header_size;
+    this->bump_end = reinterpret_cast<char*>(this->first_block) + this->first_block->getBlockSize();
+}
+
+MallocMetadata* Region::getFirstBlock()
+{
+    return this->first_block;
+}
+
+Region* sregion_create()
+{
+    MallocMetadata* first_block = allocateBuddyBlock(REGION_BLOCK_ORDER, MAXIMAL_BUDDY_BLOCK - META_DATA_SIZE, current_tag);
+    if (first_block == nullptr)
+    {
+        return NULL;
+    }
+    return new (GET_USER_PTR(first_block)) Region(first_block);
+}
+
+void* sregion_alloc(Region* region, size_t size)
+{
+    if (region == NULL || size == 0 || size > MAX_SIZE)
+    {
+        return NULL;
+    }
+    return region->allocate(size);
+}
+
+void sregion_reset(Region* region)
+{
+    if (region == NULL)
+    {
+        return;
+    }
+    region->reset();
+}
+
+void sregion_destroy(Region* region)
+{
+    if (region == NULL)
+    {
+        return;
+    }
+    region->reset();
+    MallocMetadata* first_block = region->getFirstBlock();
+    region->~Region();
+    freeBuddyBlock(first_block, REGION_BLOCK_ORDER);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ PERSISTENT HEAP ENTRY POINTS ~~~~~~~~~~~~~~~~~~~
+// a heap in fd (a file or a memfd) that a restarted process takes over with every block intact. an empty
+// fd is made a heap of num_of_chunks chunks (4MB each, up to PERSISTENT_MAX_CHUNKS). returns where the heap
+// is mapped: the address it had in the last process if that is free, so pointers inside it stay valid,
+// otherwise compare with the old one (or keep offsets). NULL if fd isn't a heap, is corrupt or one is open
+void* smalloc_persistent_open(int fd, size_t num_of_chunks)
+{
+    return mem_man.getPersistentHeap()->open(fd, num_of_chunks, mem_man.getCookie());
+}
+
+// up to MAXIMAL_BUDDY_BLOCK - META_DATA_SIZE bytes. sfree and srealloc take persistent blocks like any other
+void* smalloc_persistent(size_t size)
+{
+    return allocatePersistent(size, current_tag);
+}
+
+// the one pointer a restarted process can find the heap's contents from
+bool smalloc_persistent_set_root(void* root)
+{
+    return mem_man.getPersistentHeap()->setRoot(root);
+}
+
+void* smalloc_persistent_root()
+{
+    return mem_man.getPersistentHeap()->getRoot();
+}
+
+// syncs and unmaps the heap, false if none is open or the sync failed
+bool smalloc_persistent_close()
+{
+    return mem_man.getPersistentHeap()->close();
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ MAINTENANCE THREAD ~~~~~~~~~~~~~~~~~~~
+// an optional thread that takes the slow bookkeeping off sfree: it merges the blocks sfree no longer merges,
+// madvises idle high order blocks and trims the mmap region cache. it works in short steps under the
+// arena / mmap locks and stops a wakeup once it spent its cpu budget, the rest waits for the next one
+static uint64_t threadCpuNs()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+class MaintenanceThread
+{
+private:
+    std::thread thread;
+    std::mutex lock; // start / stop and the wakeup wait
+    std::condition_variable wakeup;
+    bool is_running;
+    bool stop_requested;
+    smalloc_maintenance_config config;
+    std::atomic<size_t> wakeups;
+    std::atomic<size_t> budget_exhausted;
+    std::atomic<size_t> merged_blocks;
+    std::atomic<size_t> released_blocks;
+    std::atomic<size_t> released_bytes;
+    std::atomic<size_t> evicted_regions;
+    std::atomic<size_t> evicted_bytes;
+    std::atomic<uint64_t> cpu_ns;
+
+    void run();
+    bool doWork(uint64_t cpu_budget_ns, size_t cache_budget);
+    static void setDeferMerges(bool defer);
+public:
+    MaintenanceThread();
+    ~MaintenanceThread();
+    bool start(const smalloc_maintenance_config* new_config);
+    void stop();
+    void fillStats(smalloc_maintenance_counters* counters) const;
+};
+
+MaintenanceThread::MaintenanceThread(): thread(), lock(), wakeup(), is_running(false), stop_requested(false), config(),
+                                        wakeups(0), budget_exhausted(0), merged_blocks(0), released_blocks(0),
+                                        released_bytes(0), evicted_regions(0), evicted_bytes(0), cpu_ns(0) {}
+
+// a joinable std::thread can't be destroyed, stop it if the program didn't
+MaintenanceThread::~MaintenanceThread()
+{
+    this->stop();
+}
+
+void MaintenanceThread::setDeferMerges(bool defer)
+{
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        Arena* arena = mem_man.getArena(i);
+        std::lock_guard<std::mutex> guard(arena->getLock());
+        arena->getBuddyAllocator()->setDeferMerges(defer);
+    }
+}
+
+bool MaintenanceThread::start(const smalloc_maintenance_config* new_config)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (this->is_running)
+    {
+        return false;
+    }
+    if (new_config != NULL)
+    {
+        this->config = *new_config;
+    }
+    else
+    {
+        this->config = {MAINTENANCE_DEFAULT_INTERVAL_MS, MAINTENANCE_DEFAULT_CPU_BUDGET_US,
+                        MAINTENANCE_DEFAULT_MMAP_CACHE_BYTES};
+    }
+    setDeferMerges(true);
+    {
+        std::lock_guard<std::mutex> mmap_guard(mem_man.getMMapLock());
+        mem_man.getMMapAllocator()->setCacheBudget(this->config.mmap_cache_bytes);
+    }
+    this->stop_requested = false;
+    this->thread = std::thread(&MaintenanceThread::run, this);
+    this->is_running = true;
+    return true;
+}
+
+// joins the thread and then does what it left undone in the calling thread, without a budget: everything
+// is merged and the cache emptied, so sfree behaves as if the thread never ran
+void MaintenanceThread::stop()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+    if (!this->is_running)
+    {
+        return;
+    }
+    this->stop_requested = true;
+    guard.unlock();
+    this->wakeup.notify_one();
+    this->thread.join();
+    guard.lock();
+    setDeferMerges(false);
+    {
+        std::lock_guard<std::mutex> mmap_guard(mem_man.getMMapLock());
+        mem_man.getMMapAllocator()->setCacheBudget(0);
+    }
+    this->doWork(UINT64_MAX, 0);
+    this->is_running = false;
+}
+
+void MaintenanceThread::run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+    while (!this->stop_requested)
+    {
+        this->wakeup.wait_for(guard, std::chrono::milliseconds(this->config.interval_ms));
+        if (this->stop_requested)
+        {
+            break;
+        }
+        uint64_t cpu_budget_ns = uint64_t(this->config.cpu_budget_us) * 1000;
+        size_t cache_budget = this->config.mmap_cache_bytes;
+        guard.unlock();
+        uint64_t start = threadCpuNs();
+        if (!this->doWork(cpu_budget_ns, cache_budget))
+        {
+            this->budget_exhausted.fetch_add(1, std::memory_order_relaxed);
+        }
+        this->cpu_ns.fetch_add(threadCpuNs() - start, std::memory_order_relaxed);
+        this->wakeups.fetch_add(1, std::memory_order_relaxed);
+        guard.lock();
+    }
+}
+
+// one wakeup's work: merge, then release idle blocks, then trim the cache. returns false if the budget ran
+// out first. the budget is checked between steps, so one step may overrun it by a little
+bool MaintenanceThread::doWork(uint64_t cpu_budget_ns, size_t cache_budget)
+{
+    uint64_t start = threadCpuNs();
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        Arena* arena = mem_man.getArena(i);
+        if (!arena->isInitialized())
+        {
+            continue;
+        }
+        size_t num_of_blocks = MAINTENANCE_STEP_BLOCKS;
+        while (num_of_blocks == MAINTENANCE_STEP_BLOCKS)
+        {
+            if (threadCpuNs() - start > cpu_budget_ns)
+            {
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(arena->getLock());
+            num_of_blocks = arena->getBuddyAllocator()->mergePendingBlocks(MAINTENANCE_STEP_BLOCKS);
+            this->merged_blocks.fetch_add(num_of_blocks, std::memory_order_relaxed);
+        }
+    }
+    for (int i = 0; i < mem_man.getNumOfArenas(); i++)
+    {
+        Arena* arena = mem_man.getArena(i);
+        if (!arena->isInitialized())
+        {
+            continue;
+        }
+        if (threadCpuNs() - start > cpu_budget_ns)
+        {
+            return false;
+        }
+        size_t num_of_bytes = 0;
+        std::lock_guard<std::mutex> guard(arena->getLock());
+        this->released_blocks.fetch_add(arena->getBuddyAllocator()->releaseIdleBlocks(&num_of_bytes),
+                                        std::memory_order_relaxed);
+        this->released_bytes.fetch_add(num_of_bytes, std::memory_order_relaxed);
+    }
+    while (true)
+    {
+        if (threadCpuNs() - start > cpu_budget_ns)
+        {
+            return false;
+        }
+        MallocMetadata* region;
+        {
+            std::lock_guard<std::mutex> guard(mem_man.getMMapLock());
+            region = mem_man.getMMapAllocator()->evictCachedRegion(cache_budget);
+        }
+        if (region == nullptr)
+        {
+            return true;
+        }
+        size_t mapped_size = region->getBlockSize();
+        if (munmap(region, mapped_size) != 0)
+        {
+            exit(1);
+        }
+        this->evicted_regions.fetch_add(1, std::memory_order_relaxed);
+        this->evicted_bytes.fetch_add(mapped_size, std::memory_order_relaxed);
+    }
+}
+
+void MaintenanceThread::fillStats(smalloc_maintenance_counters* counters) const
+{
+    counters->wakeups = this->wakeups.load(std::memory_order_relaxed);
+    counters->budget_exhausted = this->budget_exhausted.load(std::memory_order_relaxed);
+    counters->merged_blocks = this->merged_blocks.load(std::memory_order_relaxed);
+    counters->released_blocks = this->released_blocks.load(std::memory_order_relaxed);
+    counters->released_bytes = this->released_bytes.load(std::memory_order_relaxed);
+    counters->evicted_regions = this->evicted_regions.load(std::memory_order_relaxed);
+    counters->evicted_bytes = this->evicted_bytes.load(std::memory_order_relaxed);
+    counters->cpu_ns = this->cpu_ns.load(std::memory_order_relaxed);
+}
+
+// after mem_man, so it is destroyed (and stopped) before it
+MaintenanceThread maintenance_thread;
+
+// starts the thread, config NULL takes the defaults. false if it is already running
+bool smalloc_maintenance_start(const smalloc_maintenance_config* config)
+{
+    return maintenance_thread.start(config);
+}
+
+void smalloc_maintenance_stop()
+{
+    maintenance_thread.stop();
+}
+
+void smalloc_maintenance_stats(smalloc_maintenance_counters* counters)
+{
+    if (counters == NULL)
+    {
+        return;
+    }
+    maintenance_thread.fillStats(counters);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ STL ADAPTERS ~~~~~~~~~~~~~~~~~~~
+// Allocator<T> is a template, so it is in malloc_3.h where other files can instantiate it
+#if __cplusplus >= 201703L
+class BuddyMemoryResource : public std::pmr::memory_resource
+{
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+void* BuddyMemoryResource::do_allocate(size_t bytes, size_t alignment)
+{
+    // memory_resource allows requests of 0 bytes, smalloc doesn't
+    void* p = smalloc_aligned((bytes == 0) ? 1 : bytes, alignment);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void BuddyMemoryResource::do_deallocate(void* p, size_t bytes, size_t alignment)
+{
+    sfree_sized(p, (bytes == 0) ? 1 : bytes, alignment);
+}
+
+bool BuddyMemoryResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    // there is a single heap, so every BuddyMemoryResource can free memory of any other
+    return dynamic_cast<const BuddyMemoryResource*>(&other) != nullptr;
+}
+
+std::pmr::memory_resource* smalloc_memory_resource()
+{
+    static BuddyMemoryResource resource;
+    return &resource;
 }
+#endif
@@ -0,0 +1,229 @@
+// malloc_3.h - the public interface of malloc_3.cpp, for the code that uses it as its allocator.
+// everything is defined in malloc_3.cpp, except the Allocator<T> template below.
+#ifndef MALLOC_3_H
+#define MALLOC_3_H
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+#define SMALLOC_MAX_SIZE 100000000
+#define SMALLOC_MAX_ORDER 10 // buddy orders are 0 .. SMALLOC_MAX_ORDER, 128 bytes to 128KB
+#define SMALLOC_MAX_TAGS 64  // tags are 0 .. SMALLOC_MAX_TAGS - 1, untagged allocations get 0
+#define SHEAP_DUMP_TEXT 0
+#define SHEAP_DUMP_JSON 1
+#define SMALLOC_PREFAULT_NONE 0     // pages fault in on first use, as without smalloc_init
+#define SMALLOC_PREFAULT_TOUCH 1    // read and write back a byte of every page
+// MAP_POPULATE if smalloc_init maps the chunk (and it isn't bound to a node), otherwise one
+// madvise(MADV_POPULATE_WRITE), touching if the kernel lacks it
+#define SMALLOC_PREFAULT_POPULATE 2
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ STRUCTS ~~~~~~~~~~~~~~~~~~~
+// filled by smalloc_fragmentation, every byte count excludes metadata
+struct smalloc_fragmentation_stats
+{
+    size_t free_blocks_per_order[SMALLOC_MAX_ORDER+1];
+    size_t used_blocks_per_order[SMALLOC_MAX_ORDER+1];
+    size_t buddy_requested_bytes; // asked for by the users of used buddy blocks
+    size_t buddy_granted_bytes;   // usable bytes of those blocks, the rest is lost to power of two rounding
+    size_t mmap_requested_bytes;
+    size_t mmap_granted_bytes;    // includes rounding to whole pages
+    size_t buddy_free_bytes;
+    size_t largest_free_block;
+    double external_fragmentation; // 1 - largest_free_block / buddy_free_bytes, 0 when nothing is free
+};
+
+// filled by smalloc_stats from a single pass over the statistics shards
+struct smalloc_stats_snapshot
+{
+    size_t num_free_blocks;
+    size_t num_free_bytes;
+    size_t num_allocated_blocks;
+    size_t num_allocated_bytes;
+    size_t num_meta_data_bytes;
+    size_t num_mmap_blocks;
+    size_t num_mmap_bytes;
+    size_t requested_bytes; // buddy and mmap together
+    size_t mmap_retain_threshold; // freed mmap regions up to this size are retained for reuse
+    size_t mmap_retained_bytes;
+};
+
+// one per tag, filled by smalloc_tag_stats
+struct smalloc_tag_usage
+{
+    size_t live_blocks;
+    size_t live_bytes; // requested, without metadata
+};
+
+// one per arena, filled by smalloc_numa_stats
+struct smalloc_node_stats
+{
+    int node;
+    size_t reserved_bytes;  // the arena's buddy chunk, 0 until a thread of the node allocates
+    size_t used_bytes;      // granted to used buddy blocks
+    size_t requested_bytes;
+    size_t num_used_blocks;
+};
+
+// what sheap_walk reports for every block it finds
+struct sheap_block_info
+{
+    void* block;          // the metadata address
+    size_t block_size;    // including metadata
+    size_t requested_size;
+    int order;            // -1 for mmap regions
+    bool is_mmap;
+    bool is_free;
+    bool in_free_list;    // a free buddy block that isn't in its order's list (or pending stack) is lost
+    bool is_corrupt;      // bad cookie, size or alignment, the walk of that region stops here
+};
+
+typedef void (*sheap_walk_callback)(const sheap_block_info* block, void* arg);
+
+// see smalloc_add_pressure_callback. heap_bytes is the footprint after the allocator's own trimming
+typedef void (*smalloc_pressure_callback)(size_t heap_bytes, size_t soft_limit, void* arg);
+
+// what smalloc_init prepares, a zeroed struct reserves only the calling thread's arena
+struct smalloc_init_options
+{
+    bool all_nodes;                       // reserve every node's arena, not only the calling thread's
+    int prefault;                         // SMALLOC_PREFAULT_*
+    size_t presplit[SMALLOC_MAX_ORDER+1]; // blocks to split off ahead in each order, per arena
+};
+
+// see smalloc_maintenance_start
+struct smalloc_maintenance_config
+{
+    unsigned interval_ms;     // between wakeups
+    unsigned cpu_budget_us;   // thread cpu time one wakeup may use
+    size_t mmap_cache_bytes;  // freed mmap regions kept for reuse, trimmed down to this every wakeup
+};
+
+// what the maintenance thread did since it was first started
+struct smalloc_maintenance_counters
+{
+    size_t wakeups;
+    size_t budget_exhausted;  // wakeups that stopped on the cpu budget before finishing
+    size_t merged_blocks;     // blocks whose deferred merge was done
+    size_t released_blocks;
+    size_t released_bytes;
+    size_t evicted_regions;
+    size_t evicted_bytes;
+    uint64_t cpu_ns;
+};
+
+class Region;
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ FUNCTIONS ~~~~~~~~~~~~~~~~~~~
+void* smalloc(size_t size);
+void* smalloc_tagged(size_t size, int tag);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+void* smalloc_aligned(size_t size, size_t alignment);
+void sfree_sized(void* p, size_t size, size_t alignment);
+size_t sexpand(void* p, size_t min_size, size_t preferred_size);
+
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+void smalloc_stats(smalloc_stats_snapshot* snapshot);
+void smalloc_fragmentation(smalloc_fragmentation_stats* stats);
+size_t smalloc_numa_stats(smalloc_node_stats* stats, size_t max_nodes);
+#ifdef MALLOC_LATENCY_HISTOGRAMS
+void smalloc_latency_dump(int fd);
+void smalloc_latency_reset();
+#endif
+
+int smalloc_set_tag(int tag);
+int smalloc_get_tag();
+size_t smalloc_tag_stats(smalloc_tag_usage* usage, size_t max_tags);
+
+bool smalloc_init(const smalloc_init_options* options);
+size_t smalloc_release_free_chunks();
+bool smalloc_set_heap_limits(size_t soft_limit, size_t hard_limit);
+size_t smalloc_heap_footprint();
+bool smalloc_add_pressure_callback(smalloc_pressure_callback callback, void* arg);
+bool smalloc_remove_pressure_callback(smalloc_pressure_callback callback, void* arg);
+
+size_t sheap_walk(sheap_walk_callback callback, void* arg);
+void sheap_dump(int fd, int format);
+bool smalloc_profile_start(size_t sample_bytes);
+void smalloc_profile_stop();
+bool smalloc_profile_dump(int fd);
+bool smalloc_trace_start(const char* path);
+void smalloc_trace_stop();
+
+Region* sregion_create();
+void* sregion_alloc(Region* region, size_t size);
+void sregion_reset(Region* region);
+void sregion_destroy(Region* region);
+
+void* smalloc_persistent_open(int fd, size_t num_of_chunks);
+void* smalloc_persistent(size_t size);
+bool smalloc_persistent_set_root(void* root);
+void* smalloc_persistent_root();
+bool smalloc_persistent_close();
+
+bool smalloc_maintenance_start(const smalloc_maintenance_config* config);
+void smalloc_maintenance_stop();
+void smalloc_maintenance_stats(smalloc_maintenance_counters* counters);
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ STL ADAPTERS ~~~~~~~~~~~~~~~~~~~
+#if __cplusplus >= 201703L
+// one resource for the whole heap, it passes the size and alignment of every deallocation to sfree_sized
+std::pmr::memory_resource* smalloc_memory_resource();
+#endif
+
+template <class T>
+class Allocator
+{
+public:
+    typedef T value_type;
+
+    Allocator() noexcept = default;
+    template <class U>
+    Allocator(const Allocator<U>&) noexcept {}
+    ~Allocator() = default;
+    T* allocate(size_t n);
+    void deallocate(T* p, size_t n) noexcept;
+};
+
+template <class T>
+T* Allocator<T>::allocate(size_t n)
+{
+    if (n == 0 || n > SMALLOC_MAX_SIZE / sizeof(T))
+    {
+        throw std::bad_alloc();
+    }
+    void* p = smalloc_aligned(n * sizeof(T), alignof(T));
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+}
+
+template <class T>
+void Allocator<T>::deallocate(T* p, size_t n) noexcept
+{
+    sfree_sized(p, n * sizeof(T), alignof(T));
+}
+
+template <class T, class U>
+bool operator==(const Allocator<T>&, const Allocator<U>&) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const Allocator<T>&, const Allocator<U>&) noexcept
+{
+    return false;
+}
+#endif
@@ -0,0 +1,160 @@
+// replay.cpp - replays a trace recorded by smalloc_trace_start (malloc_3.cpp) against one allocator.
+//
+// like benchmark.cpp, every allocator gets its own binary:
+//   g++ -O2 -std=c++17 replay.cpp malloc_2.cpp -DREPLAY_ALLOCATOR='"malloc_2"' -o replay_malloc_2
+//   (add the configuration flags listed in benchmark.cpp, e.g. -DFIT_POLICY=BEST_FIT, to replay against
+//   another configuration, or link the configuration's library from the Makefile, e.g. libmalloc_2_best_fit.a)
+//   g++ -O2 -std=c++17 replay.cpp malloc_3.cpp -DREPLAY_ALLOCATOR='"malloc_3"' -o replay_malloc_3
+//   g++ -O2 -std=c++17 replay.cpp -DREPLAY_SYSTEM_MALLOC -o replay_glibc
+// usage: replay_<allocator> <trace file>
+//
+// the records are replayed one after the other in the order they were recorded, whatever thread made
+// them, so two runs over the same trace do exactly the same calls. the result is one JSON line:
+//   {"allocator":..., "trace":..., "ops":..., "failed_ops":..., "ops_per_sec":...,
+//    "p50_ns":..., "p99_ns":..., "p999_ns":..., "peak_rss_kb":...}
+// failed_ops counts calls that failed here although they succeeded when the trace was recorded.
+#include <unistd.h>
+#include <sys/resource.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include "trace_format.h"
+
+#ifndef REPLAY_ALLOCATOR
+#ifdef REPLAY_SYSTEM_MALLOC
+#define REPLAY_ALLOCATOR "glibc"
+#else
+#define REPLAY_ALLOCATOR "smalloc"
+#endif
+#endif
+
+// ~~~~~~~~~~~~~~~~~~~~~~~ ALLOCATOR UNDER TEST ~~~~~~~~~~~~~~~~~~~
+#ifdef REPLAY_SYSTEM_MALLOC
+void* smalloc(size_t size) { return malloc(size); }
+void* scalloc(size_t num, size_t size) { return calloc(num, size); }
+void* srealloc(void* oldp, size_t size) { return realloc(oldp, size); }
+void sfree(void* p) { free(p); }
+#else
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void* srealloc(void* oldp, size_t size);
+void sfree(void* p);
+#endif
+
+static inline uint64_t nowNs()
+{
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static bool readTrace(const char* path, std::vector<TraceRecord>& records)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+    TraceFileHeader header{};
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord))
+    {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return false;
+    }
+    TraceRecord record{};
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        records.push_back(record);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    std::vector<TraceRecord> records;
+    if (!readTrace(argv[1], records))
+    {
+        return 1;
+    }
+    // ids are given in allocation order, so the highest id bounds the table
+    uint32_t max_id = 0;
+    for (const TraceRecord& record : records)
+    {
+        max_id = std::max(max_id, record.ptr_id);
+    }
+    std::vector<void*> pointers(max_id + 1, nullptr);
+    std::vector<uint32_t> latencies_ns;
+    latencies_ns.reserve(records.size());
+    size_t failed_ops = 0;
+    uint64_t total_ns = 0;
+
+    for (const TraceRecord& record : records)
+    {
+        void* result = nullptr;
+        uint64_t start = nowNs();
+        switch (record.op)
+        {
+            case TRACE_MALLOC:
+                result = smalloc(record.size);
+                break;
+            case TRACE_CALLOC:
+                result = scalloc(record.aux, record.size);
+                break;
+            case TRACE_REALLOC:
+                result = srealloc(pointers[record.aux], record.size);
+                break;
+            case TRACE_FREE:
+                sfree(pointers[record.ptr_id]);
+                break;
+            default:
+                fprintf(stderr, "unknown trace op %d\n", record.op);
+                return 1;
+        }
+        uint64_t elapsed = nowNs() - start;
+        total_ns += elapsed;
+        latencies_ns.push_back(static_cast<uint32_t>(std::min<uint64_t>(elapsed, UINT32_MAX)));
+
+        if (record.op == TRACE_FREE)
+        {
+            pointers[record.ptr_id] = nullptr;
+            continue;
+        }
+        if (result == nullptr)
+        {
+            failed_ops += (record.ptr_id != 0) ? 1 : 0;
+            continue;
+        }
+        if (record.op == TRACE_REALLOC)
+        {
+            pointers[record.aux] = nullptr;
+        }
+        pointers[record.ptr_id] = result;
+        pointers[0] = nullptr; // id 0 is NULL, results the recording didn't track must not stick to it
+    }
+
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+    auto percentile = [&latencies_ns](double q) -> uint32_t {
+        return latencies_ns.empty() ? 0 :
+               latencies_ns[std::min(latencies_ns.size() - 1, static_cast<size_t>(q * latencies_ns.size()))];
+    };
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"allocator\":\"%s\",\"trace\":\"%s\",\"ops\":%zu,\"failed_ops\":%zu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"peak_rss_kb\":%ld}\n",
+           REPLAY_ALLOCATOR, argv[1], records.size(), failed_ops,
+           (total_ns > 0) ? records.size() / (total_ns / 1e9) : 0.0,
+           percentile(0.50), percentile(0.99), percentile(0.999), usage.ru_maxrss);
+    return 0;
+}
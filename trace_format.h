@@ -0,0 +1,34 @@
+// trace_format.h - the allocation trace file that smalloc_trace_start (malloc_3.cpp) writes and replay.cpp
+// reads. the file is a TraceFileHeader followed by TraceRecords, in the byte order of the machine.
+// pointers are replaced by ids (1, 2, ...) given in allocation order, 0 stands for NULL
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+#include <cstdint>
+
+#define TRACE_MAGIC 0x43525453 // "STRC"
+#define TRACE_VERSION 1
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_FREE 4
+
+struct TraceFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct TraceRecord
+{
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t thread_id;
+    uint32_t ptr_id; // the result of malloc/calloc/realloc, the freed pointer for free
+    uint32_t aux;    // the old pointer for realloc, the number of elements for calloc
+    uint32_t size;   // smalloc's MAX_SIZE fits in 32 bits
+    uint64_t timestamp_ns;
+};
+
+#endif